@@ -68,6 +68,10 @@ int __prussdrv_memmap_init(void)
     int i, fd;
     char hexstring[PRUSS_UIO_PARAM_VAL_LEN];
 
+    /* Opening another host interrupt does not need a second mapping */
+    if (prussdrv.mmap_fd)
+        return 0;
+
     if (prussdrv.mmap_fd == 0) {
         for (i = 0; i < NUM_PRU_HOSTIRQS; i++) {
             if (prussdrv.fd[i])
@@ -0,0 +1,164 @@
+/** \file
+ * Bit transposition of frames into per-bit GPIO masks.
+ *
+ * Each slot is sliced in two steps.  First the pixels of every group of
+ * 8 channels are transposed into 24 bit planes, one byte per bit with a
+ * bit for each channel.  Then each plane byte is looked up in the group's
+ * table to find the pins on each GPIO bank that send a one.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+#include "bitslice.h"
+#include "util.h"
+
+bitslice_t *bitslice_init(const unsigned num_channels, const unsigned bits,
+                          const uint8_t *gpio, const uint8_t *pin) {
+  if (num_channels < 1 || num_channels > BITSLICE_MAX_CHANNELS)
+    die("%u channels can not be sliced\n", num_channels);
+  if (bits != 24 && bits != 32)
+    die("%u bit pixels can not be sliced\n", bits);
+
+  bitslice_t *const bs = calloc(1, sizeof(*bs));
+  if (!bs)
+    die("calloc failed: %s", strerror(errno));
+
+  bs->num_channels = num_channels;
+  bs->bits = bits;
+
+  for (unsigned c = 0; c < num_channels; c++) {
+    const unsigned group = c / 8;
+    const uint32_t mask = 1u << pin[c];
+
+    bs->gpio_mask[gpio[c]] |= mask;
+
+    for (unsigned byte = 0; byte < 256; byte++)
+      if (byte & (1 << (c % 8)))
+        bs->pins[group][byte][gpio[c]] |= mask;
+  }
+
+  return bs;
+}
+
+void bitslice_free(bitslice_t *const bs) { free(bs); }
+
+#ifdef __ARM_NEON__
+/** Transpose the 8x8 bit matrix of one color byte of 8 channels.
+ *
+ * Each lane of the result is the mask of the channels that have that
+ * bit set.  vtst picks out the bit in every channel, the AND gives each
+ * channel its own bit and the pairwise adds fold the lanes together.
+ */
+static inline uint8x8_t transpose_neon(const uint8x8_t v,
+                                       const uint8x8_t weights) {
+  uint8x8_t t[8];
+  for (unsigned bit = 0; bit < 8; bit++)
+    t[bit] = vand_u8(vtst_u8(v, vdup_n_u8(1 << bit)), weights);
+
+  const uint8x8_t q0 = vpadd_u8(vpadd_u8(t[0], t[1]), vpadd_u8(t[2], t[3]));
+  const uint8x8_t q1 = vpadd_u8(vpadd_u8(t[4], t[5]), vpadd_u8(t[6], t[7]));
+  return vpadd_u8(q0, q1);
+}
+
+/** Split the pixels of 8 channels into 8 * bytes bit planes, from the
+ * lowest byte up.
+ */
+static inline void planes_8(uint8_t *const planes, const uint32_t *const pixels,
+                            const unsigned bytes) {
+  static const uint8_t weight_bits[8] = {1, 2, 4, 8, 16, 32, 64, 128};
+  const uint8x8_t weights = vld1_u8(weight_bits);
+
+  // De-interleave the pixels into one vector per byte
+  const uint8x8x4_t v = vld4_u8((const uint8_t *)pixels);
+
+  vst1_u8(&planes[0], transpose_neon(v.val[0], weights));
+  vst1_u8(&planes[8], transpose_neon(v.val[1], weights));
+  vst1_u8(&planes[16], transpose_neon(v.val[2], weights));
+  if (bytes == 4)
+    vst1_u8(&planes[24], transpose_neon(v.val[3], weights));
+}
+#else
+/** Transpose an 8x8 bit matrix so that bit c of byte r becomes
+ * bit r of byte c.
+ */
+static inline uint64_t transpose8(uint64_t x) {
+  uint64_t t;
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
+
+/** Split the pixels of 8 channels into 8 * bytes bit planes, from the
+ * lowest byte up.
+ */
+static inline void planes_8(uint8_t *const planes, const uint32_t *const pixels,
+                            const unsigned bytes) {
+  for (unsigned color = 0; color < bytes; color++) {
+    uint64_t x = 0;
+    for (unsigned c = 0; c < 8; c++)
+      x |= (uint64_t)((pixels[c] >> (8 * color)) & 0xFF) << (8 * c);
+
+    x = transpose8(x);
+    for (unsigned bit = 0; bit < 8; bit++)
+      planes[8 * color + bit] = x >> (8 * bit);
+  }
+}
+#endif
+
+void bitslice_frame(const bitslice_t *const bs, void *const out,
+                    const uint32_t *const frame, const size_t num_slots) {
+  bitslice_frame_channels(bs, out, frame, num_slots, bs->num_channels);
+}
+
+void bitslice_frame_channels(const bitslice_t *const bs, void *const out,
+                             const uint32_t *const frame,
+                             const size_t num_slots,
+                             const unsigned num_channels) {
+  const unsigned num_groups = (num_channels + 7) / 8;
+  const unsigned partial = num_channels % 8;
+  const unsigned bits = bs->bits;
+  uint32_t (*masks)[4] = (uint32_t (*)[4])out;
+
+  for (size_t s = 0; s < num_slots; s++, masks += bits) {
+    const uint32_t *const pixels = &frame[s * num_channels];
+    uint8_t planes[BITSLICE_MAX_CHANNELS / 8][BITSLICE_MAX_BITS];
+
+    for (unsigned g = 0; g < num_groups; g++) {
+      if (partial && g == num_groups - 1) {
+        // Pad the last group out to 8 channels
+        uint32_t tail[8] = {0};
+        memcpy(tail, &pixels[8 * g], partial * sizeof(*tail));
+        planes_8(planes[g], tail, bits / 8);
+      } else {
+        planes_8(planes[g], &pixels[8 * g], bits / 8);
+      }
+    }
+
+    // The PRU clocks the MSB out first, the green one for GRB pixels, and
+    // the blue LSB last
+    for (unsigned bit = 0; bit < bits; bit++) {
+      const unsigned plane = bits - 1 - bit;
+      uint32_t *const zeros = masks[bit];
+#ifdef __ARM_NEON__
+      uint32x4_t ones = vld1q_u32(bs->pins[0][planes[0][plane]]);
+      for (unsigned g = 1; g < num_groups; g++)
+        ones = vorrq_u32(ones, vld1q_u32(bs->pins[g][planes[g][plane]]));
+      vst1q_u32(zeros, vbicq_u32(vld1q_u32(bs->gpio_mask), ones));
+#else
+      uint32_t ones[4] = {0};
+      for (unsigned g = 0; g < num_groups; g++)
+        for (unsigned gpio = 0; gpio < 4; gpio++)
+          ones[gpio] |= bs->pins[g][planes[g][plane]][gpio];
+      for (unsigned gpio = 0; gpio < 4; gpio++)
+        zeros[gpio] = bs->gpio_mask[gpio] & ~ones[gpio];
+#endif
+    }
+  }
+}
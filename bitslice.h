@@ -0,0 +1,77 @@
+/** \file
+ * Bit transposition of frames into per-bit GPIO masks.
+ *
+ * The PRU normally reads every channel's pixel from DDR for every bit
+ * and builds the GPIO zero masks itself.  Slicing the frame on the ARM
+ * instead leaves the PRU with a single burst read per bit.
+ */
+#ifndef _bitslice_h_
+#define _bitslice_h_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BITSLICE_MAX_CHANNELS 32
+#define BITSLICE_MAX_BITS 32
+
+/** GPIO masks for one pixel slot.
+ *
+ * For each of the bits, in the order they are clocked out, the pins on
+ * GPIO0 to GPIO3 that send a zero.  Slots of 24 bit pixels only use the
+ * first 24 masks, and are packed BITSLICE_SLOT_SIZE(24) bytes apart.
+ */
+typedef struct {
+  uint32_t zeros[BITSLICE_MAX_BITS][4];
+} bitslice_slot_t;
+
+/** Bytes in a slot of pixels of a number of bits. */
+#define BITSLICE_SLOT_SIZE(bits) ((bits) * 4 * sizeof(uint32_t))
+
+/** Channel to pin lookup tables.
+ *
+ * Each group of 8 channels has a table that maps a byte with one bit
+ * per channel to the pins of those channels on each GPIO bank.
+ */
+typedef struct {
+  unsigned num_channels;
+  unsigned bits;
+  uint32_t gpio_mask[4];
+  uint32_t pins[BITSLICE_MAX_CHANNELS / 8][256][4];
+} bitslice_t;
+
+/** Build the lookup tables for channels 0 to num_channels - 1, where
+ * channel c is on pin pin[c] of GPIO bank gpio[c], and pixels of 24 or
+ * 32 bits.
+ */
+extern bitslice_t *bitslice_init(unsigned num_channels, unsigned bits,
+                                 const uint8_t *gpio, const uint8_t *pin);
+
+extern void bitslice_free(bitslice_t *const bs);
+
+/** Slice num_slots pixel slots of a frame into out, which takes
+ * num_slots * BITSLICE_SLOT_SIZE(bits) bytes.
+ *
+ * The frame holds num_channels interleaved pixels per slot, in the same
+ * layout that the PRU reads.  The most significant of the bits of each
+ * pixel is clocked out first.
+ */
+extern void bitslice_frame(const bitslice_t *const bs, void *const out,
+                           const uint32_t *const frame, size_t num_slots);
+
+/** Slice slots that only hold the first num_channels of the channels, as
+ * at the end of a frame where some of the strips have already ended.  The
+ * other channels send zeros.
+ */
+extern void bitslice_frame_channels(const bitslice_t *const bs,
+                                    void *const out,
+                                    const uint32_t *const frame,
+                                    size_t num_slots, unsigned num_channels);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,310 @@
+/** \file
+ * An off-screen RGBA surface to draw into with the graphics library.
+ *
+ * Two colors of a pixel are worked on at once in the 0x00FF00FF lanes of a
+ * word, with 16 bits of room for each product.  Division by 255 rounds
+ * exactly, so an alpha of 255 leaves a color as it is.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <algorithm> // before the swap() macro of gfx.hpp
+#include "canvas.hpp"
+
+/** Scale each of the four bytes of p by a / 255. */
+static inline uint32_t scale(const uint32_t p, const uint32_t a) {
+  uint32_t rb = (p & 0x00FF00FF) * a + 0x00800080;
+  uint32_t ag = (p >> 8 & 0x00FF00FF) * a + 0x00800080;
+  rb = (rb + (rb >> 8 & 0x00FF00FF)) >> 8 & 0x00FF00FF;
+  ag = (ag + (ag >> 8 & 0x00FF00FF)) & 0xFF00FF00;
+  return rb | ag;
+}
+
+/** f / 256 of a and the rest of b, for each of the four bytes. */
+static inline uint32_t lerp(const uint32_t a, const uint32_t b,
+                            const uint32_t f) {
+  const uint32_t rb =
+      ((a & 0x00FF00FF) * f + (b & 0x00FF00FF) * (256 - f)) >> 8 & 0x00FF00FF;
+  const uint32_t ag =
+      ((a >> 8 & 0x00FF00FF) * f + (b >> 8 & 0x00FF00FF) * (256 - f)) &
+      0xFF00FF00;
+  return rb | ag;
+}
+
+PixelBone_Canvas::PixelBone_Canvas(int16_t w, int16_t h)
+    : PixelBone_GFX(w, h), drawAlpha(255) {
+  // An empty canvas may get NULL back, which it never dereferences
+  pixels = (uint32_t *)calloc((size_t)w * h, sizeof(*pixels));
+  if (!pixels && w && h)
+    die("Unable to allocate a canvas of %dx%d\n", w, h);
+}
+
+PixelBone_Canvas::~PixelBone_Canvas() { free(pixels); }
+
+uint32_t PixelBone_Canvas::Color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+  return scale(0xFF000000 | (uint32_t)r << 16 | (uint32_t)g << 8 | b, a);
+}
+
+/** Set the alpha of everything drawn from now on, from 0 for transparent
+ * to 255 for opaque.
+ *
+ * The drawing calls replace the pixels that they draw rather than blending
+ * with them, so a sprite can be drawn with see-through parts and then
+ * composited.  The top byte of their colors is ignored.
+ */
+void PixelBone_Canvas::setDrawAlpha(uint8_t alpha) { drawAlpha = alpha; }
+
+uint32_t PixelBone_Canvas::premultiply(uint32_t color) const {
+  const uint32_t opaque = 0xFF000000 | color;
+  return drawAlpha == 255 ? opaque : scale(opaque, drawAlpha);
+}
+
+void PixelBone_Canvas::drawPixel(int16_t x, int16_t y, uint32_t color) {
+  if ((x < 0) || (y < 0) || (x >= _width) || (y >= _height))
+    return;
+
+  int16_t t;
+  switch (rotation) {
+  case 1:
+    t = x;
+    x = WIDTH - 1 - y;
+    y = t;
+    break;
+  case 2:
+    x = WIDTH - 1 - x;
+    y = HEIGHT - 1 - y;
+    break;
+  case 3:
+    t = x;
+    x = y;
+    y = HEIGHT - 1 - t;
+    break;
+  }
+
+  pixels[y * WIDTH + x] = premultiply(color);
+}
+
+void PixelBone_Canvas::drawFastHLine(int16_t x, int16_t y, int16_t w,
+                                     uint32_t color) {
+  fillRect(x, y, w, 1, color);
+}
+
+void PixelBone_Canvas::drawFastVLine(int16_t x, int16_t y, int16_t h,
+                                     uint32_t color) {
+  fillRect(x, y, 1, h, color);
+}
+
+void PixelBone_Canvas::fillRect(int16_t x, int16_t y, int16_t w, int16_t h,
+                                uint32_t color) {
+  if (x < 0) {
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    h += y;
+    y = 0;
+  }
+  if (w > _width - x)
+    w = _width - x;
+  if (h > _height - y)
+    h = _height - y;
+  if (w <= 0 || h <= 0)
+    return;
+
+  // The same rectangle on the unrotated canvas
+  int16_t t;
+  switch (rotation) {
+  case 1:
+    t = x;
+    x = WIDTH - y - h;
+    y = t;
+    swap(w, h);
+    break;
+  case 2:
+    x = WIDTH - x - w;
+    y = HEIGHT - y - h;
+    break;
+  case 3:
+    t = x;
+    x = y;
+    y = HEIGHT - t - w;
+    swap(w, h);
+    break;
+  }
+
+  const uint32_t c = premultiply(color);
+  for (int16_t j = 0; j < h; j++)
+    std::fill_n(&pixels[(y + j) * WIDTH + x], w, c);
+}
+
+void PixelBone_Canvas::fillScreen(uint32_t color) {
+  std::fill_n(pixels, WIDTH * HEIGHT, premultiply(color));
+}
+
+/** Make the whole canvas transparent. */
+void PixelBone_Canvas::clear() {
+  memset(pixels, 0, WIDTH * HEIGHT * sizeof(*pixels));
+}
+
+/** Pixels of the unrotated canvas, a row at a time. */
+uint32_t *PixelBone_Canvas::getPixels() const { return pixels; }
+
+uint32_t PixelBone_Canvas::getPixel(int16_t x, int16_t y) const {
+  if ((x < 0) || (y < 0) || (x >= WIDTH) || (y >= HEIGHT))
+    return 0;
+  return pixels[y * WIDTH + x];
+}
+
+/** Clip a w by h rectangle at (sx, sy) of src, going to (x, y) of this
+ * canvas, to both.
+ *
+ * \return false if nothing is left.
+ */
+bool PixelBone_Canvas::clip(const PixelBone_Canvas &src, int16_t &sx,
+                            int16_t &sy, int16_t &w, int16_t &h, int16_t &x,
+                            int16_t &y) const {
+  if (sx < 0) {
+    x -= sx;
+    w += sx;
+    sx = 0;
+  }
+  if (sy < 0) {
+    y -= sy;
+    h += sy;
+    sy = 0;
+  }
+  if (x < 0) {
+    sx -= x;
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    sy -= y;
+    h += y;
+    y = 0;
+  }
+  w = std::min<int16_t>(w, std::min(src.WIDTH - sx, WIDTH - x));
+  h = std::min<int16_t>(h, std::min(src.HEIGHT - sy, HEIGHT - y));
+  return w > 0 && h > 0;
+}
+
+/** Copy the whole of src to (x, y), clipped to this canvas. */
+void PixelBone_Canvas::blit(const PixelBone_Canvas &src, int16_t x,
+                            int16_t y) {
+  blit(src, 0, 0, src.WIDTH, src.HEIGHT, x, y);
+}
+
+/** Copy a w by h rectangle at (sx, sy) of src to (x, y), clipped to both.
+ *
+ * The pixels are copied as they are, alpha and all.  src may be this
+ * canvas, with the two rectangles overlapping.
+ */
+void PixelBone_Canvas::blit(const PixelBone_Canvas &src, int16_t sx,
+                            int16_t sy, int16_t w, int16_t h, int16_t x,
+                            int16_t y) {
+  if (!clip(src, sx, sy, w, h, x, y))
+    return;
+
+  // Rows moving down a canvas onto itself go from the bottom up
+  const bool up = &src == this && y > sy;
+  for (int16_t j = 0; j < h; j++) {
+    const int16_t r = up ? h - 1 - j : j;
+    memmove(&pixels[(y + r) * WIDTH + x], &src.pixels[(sy + r) * src.WIDTH + sx],
+            w * sizeof(*pixels));
+  }
+}
+
+/** Copy src to a position given in 1/256ths of a pixel, for scrolling
+ * smoothly at less than a pixel a frame.
+ *
+ * Each pixel is interpolated from the four pixels of src that it covers,
+ * with those past the edges of src transparent.  At a whole pixel it is
+ * the same as blit().
+ */
+void PixelBone_Canvas::blitSubpixel(const PixelBone_Canvas &src, int32_t x,
+                                    int32_t y) {
+  const int32_t xi = x >> 8, yi = y >> 8;
+  const uint32_t fx = x & 0xFF, fy = y & 0xFF;
+
+  // A fraction of a pixel spreads src over one more column or row
+  const int32_t x0 = std::max<int32_t>(xi, 0);
+  const int32_t y0 = std::max<int32_t>(yi, 0);
+  const int32_t x1 = std::min<int32_t>(xi + src.WIDTH + (fx != 0), WIDTH);
+  const int32_t y1 = std::min<int32_t>(yi + src.HEIGHT + (fy != 0), HEIGHT);
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  for (int32_t py = y0; py < y1; py++) {
+    // The rows of src above and below, or NULL past its edges
+    const int32_t v = py - yi;
+    const uint32_t *const above =
+        v >= 1 && v <= src.HEIGHT ? &src.pixels[(v - 1) * src.WIDTH] : NULL;
+    const uint32_t *const below =
+        v < src.HEIGHT ? &src.pixels[v * src.WIDTH] : NULL;
+
+    int32_t u = x0 - xi;
+    const bool in = u >= 1 && u <= src.WIDTH;
+    uint32_t left0 = in && above ? above[u - 1] : 0;
+    uint32_t left1 = in && below ? below[u - 1] : 0;
+    uint32_t *out = &pixels[py * WIDTH + x0];
+    for (int32_t px = x0; px < x1; px++, u++) {
+      const bool inside = u < src.WIDTH;
+      const uint32_t right0 = inside && above ? above[u] : 0;
+      const uint32_t right1 = inside && below ? below[u] : 0;
+      *out++ = lerp(lerp(left0, right0, fx), lerp(left1, right1, fx), fy);
+      left0 = right0;
+      left1 = right1;
+    }
+  }
+}
+
+/** Draw src over this canvas at (x, y), clipped, blending by its alpha. */
+void PixelBone_Canvas::composite(const PixelBone_Canvas &src, int16_t x,
+                                 int16_t y) {
+  int16_t sx = 0, sy = 0, w = src.WIDTH, h = src.HEIGHT;
+  if (!clip(src, sx, sy, w, h, x, y))
+    return;
+
+  for (int16_t j = 0; j < h; j++) {
+    const uint32_t *const s = &src.pixels[(sy + j) * src.WIDTH + sx];
+    uint32_t *const d = &pixels[(y + j) * WIDTH + x];
+    for (int16_t i = 0; i < w; i++) {
+      const uint32_t alpha = s[i] >> 24;
+      if (alpha == 255)
+        d[i] = s[i];
+      else if (alpha)
+        d[i] = s[i] + scale(d[i], 255 - alpha);
+    }
+  }
+}
+
+/** Move everything on the canvas by (dx, dy) pixels, leaving what comes
+ * in from the edges transparent.
+ */
+void PixelBone_Canvas::scroll(int16_t dx, int16_t dy) {
+  if (dx >= WIDTH || -dx >= WIDTH || dy >= HEIGHT || -dy >= HEIGHT) {
+    clear();
+    return;
+  }
+
+  blit(*this, 0, 0, WIDTH, HEIGHT, dx, dy);
+
+  // Clear the strips that nothing was copied into
+  const int16_t y0 = dy > 0 ? 0 : HEIGHT + dy, rows = dy > 0 ? dy : -dy;
+  memset(&pixels[y0 * WIDTH], 0, rows * WIDTH * sizeof(*pixels));
+  const int16_t x0 = dx > 0 ? 0 : WIDTH + dx, cols = dx > 0 ? dx : -dx;
+  for (int16_t j = 0; cols && j < HEIGHT; j++)
+    memset(&pixels[j * WIDTH + x0], 0, cols * sizeof(*pixels));
+}
+
+/** Copy the canvas into the frame buffer of a matrix with its top left
+ * at (x, y), as it would look on black.
+ *
+ * It goes in with one PixelBone_Matrix::drawImage(), so the layout of the
+ * matrix is worked out once per tile rather than per pixel, or not at all
+ * for a canvas the size of a matrix with its lookup table on.  The colors
+ * are already scaled by the alpha, and the matrix ignores the top byte.
+ */
+void PixelBone_Canvas::copyTo(PixelBone_Matrix &matrix, int16_t x,
+                              int16_t y) const {
+  matrix.drawImage(x, y, pixels, WIDTH, HEIGHT, WIDTH);
+}
@@ -0,0 +1,53 @@
+/** \file
+ * An off-screen RGBA surface to draw into with the graphics library.
+ *
+ * Text, sprites and backgrounds can be drawn once into a canvas and then
+ * moved about a frame with block copies, instead of being redrawn a pixel
+ * at a time through drawPixel() every frame.  A frame put together in a
+ * canvas goes into a PixelBone_Matrix with a single copy.
+ */
+#ifndef _CANVAS_HPP_
+#define _CANVAS_HPP_
+
+#include "gfx.hpp"
+#include "matrix.hpp"
+
+// Pixels of a canvas are 0xAARRGGBB with the colors premultiplied by the
+// alpha, so that a pixel composites with one multiply per color and a
+// transparent pixel is 0.
+class PixelBone_Canvas : public PixelBone_GFX {
+
+public:
+  PixelBone_Canvas(int16_t w, int16_t h);
+  ~PixelBone_Canvas();
+
+  void drawPixel(int16_t x, int16_t y, uint32_t color);
+  void drawFastHLine(int16_t x, int16_t y, int16_t w, uint32_t color);
+  void drawFastVLine(int16_t x, int16_t y, int16_t h, uint32_t color);
+  void fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint32_t color);
+  void fillScreen(uint32_t color);
+  void setDrawAlpha(uint8_t alpha);
+  void clear();
+
+  uint32_t *getPixels() const;
+  uint32_t getPixel(int16_t x, int16_t y) const;
+
+  void blit(const PixelBone_Canvas &src, int16_t x, int16_t y);
+  void blit(const PixelBone_Canvas &src, int16_t sx, int16_t sy, int16_t w,
+            int16_t h, int16_t x, int16_t y);
+  void blitSubpixel(const PixelBone_Canvas &src, int32_t x, int32_t y);
+  void composite(const PixelBone_Canvas &src, int16_t x, int16_t y);
+  void scroll(int16_t dx, int16_t dy);
+  void copyTo(PixelBone_Matrix &matrix, int16_t x = 0, int16_t y = 0) const;
+
+  static uint32_t Color(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255);
+
+private:
+  uint32_t *pixels;
+  uint8_t drawAlpha;
+  uint32_t premultiply(uint32_t color) const;
+  bool clip(const PixelBone_Canvas &src, int16_t &sx, int16_t &sy,
+            int16_t &w, int16_t &h, int16_t &x, int16_t &y) const;
+};
+
+#endif // _CANVAS_HPP_
@@ -0,0 +1,256 @@
+/** \file
+ * Color correction of frames on their way out to the LEDs.
+ *
+ * Each color byte v becomes round(255 * (v / 255)^gamma) scaled by the
+ * brightness times the gain of its color.  The tables are indexed in the
+ * B, R, G order of the bytes in a pixel.
+ *
+ * Dithering adds the error left over from the last frame to each 16 bit
+ * color and sends the top 8 bits, so a color between two steps flickers
+ * between them too fast to see in the right proportion.  The colors are
+ * first scaled by 255 / 256 so that 65535 is full on and 257 * v of an 8
+ * bit color v is exactly v, without any flicker.
+ *
+ * The wire takes the most significant byte of each pixel first, so the
+ * first color of an order goes in the top byte.  White extraction moves
+ * the smallest of red, green and blue from all three into the white,
+ * which RGBW LEDs show as a purer white for less power.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+#include "color.h"
+#include "util.h"
+
+static inline uint32_t min_u32(const uint32_t a, const uint32_t b) {
+  return a < b ? a : b;
+}
+
+/** Byte of a BRGW pixel that holds each of the letters of an order. */
+static int order_byte(const char letter) {
+  switch (letter) {
+  case 'B': return 0;
+  case 'R': return 1;
+  case 'G': return 2;
+  case 'W': return 3;
+  default: return -1;
+  }
+}
+
+unsigned color_order_bits(const char *const order) {
+  const size_t len = strlen(order);
+  unsigned seen = 0;
+
+  for (size_t i = 0; i < len && len <= 4; i++) {
+    const int byte = order_byte(order[i]);
+    if (byte < 0 || seen & 1u << byte)
+      break;
+    seen |= 1u << byte;
+  }
+
+  // Red, green and blue once each, and a white for the fourth
+  if (seen != (len == 4 ? 0xFu : 0x7u))
+    die("Color order %s is not R, G, B and optionally W\n", order);
+
+  return 8 * len;
+}
+
+color_t *color_init(const uint8_t brightness, const uint8_t *const gains,
+                    const float gamma, const char *const order,
+                    const int white) {
+  // Byte order of the pixels, as indices into the R, G, B gains
+  static const unsigned gain_index[3] = {2, 0, 1};
+
+  if (!(gamma > 0))
+    die("Gamma of %f is not positive\n", gamma);
+  const unsigned bits = color_order_bits(order);
+
+  color_t *const color = calloc(1, sizeof(*color));
+  if (!color)
+    die("calloc failed: %s", strerror(errno));
+
+  color->linear = gamma == 1.0f;
+  color->white = white && bits == 32;
+  int identity = color->linear && !color->white;
+
+  // The first color goes out first, in the most significant byte
+  const unsigned bytes = bits / 8;
+  color->order[3] = 4;
+  for (unsigned i = 0; i < bytes; i++)
+    color->order[bytes - 1 - i] = order_byte(order[i]);
+  if (bits != 24 || memcmp(color->order, "\0\1\2\4", 4))
+    identity = 0;
+
+  for (unsigned c = 0; c < 4; c++) {
+    // Each table entry is already in the byte that it goes out in, or 0
+    // if the color is not sent
+    const uint8_t *const out_byte = memchr(color->order, c, 4);
+    const unsigned shift = out_byte ? 8 * (out_byte - color->order) : 0;
+    const uint32_t mask = out_byte ? 0xFF : 0;
+
+    // Multiplier out of 256, so that 255 and 255 leave the color alone
+    const unsigned gain = c < 3 ? gains[gain_index[c]] : 255;
+    const uint16_t scale =
+        (brightness * gain * 256 + 255 * 255 / 2) / (255 * 255);
+    color->scale[c] = scale;
+    if (scale != 256 && c < bytes)
+      identity = 0;
+
+    for (unsigned v = 0; v < 256; v++) {
+      uint32_t out = (v * scale + 128) >> 8;
+      if (!color->linear)
+        out = pow(v / 255.0, gamma) * 255 * scale / 256 + 0.5;
+      color->lut[c][v] = (out & mask) << shift;
+    }
+
+    const unsigned lut16_size = 1 << COLOR_LUT16_BITS;
+    for (unsigned v = 0; !color->linear && v < lut16_size; v++) {
+      const double out =
+          pow(v / (double)(lut16_size - 1), gamma) * 65535 * scale / 256;
+      color->lut16[c][v] = (uint16_t)(out + 0.5);
+    }
+  }
+
+  if (identity) {
+    free(color);
+    return NULL;
+  }
+
+  return color;
+}
+
+void color_free(color_t *const color) { free(color); }
+
+#ifdef __ARM_NEON__
+/** Scale 8 bytes of one color with rounding, as in the linear tables. */
+static inline uint8x8_t scale_neon(const uint8x8_t v, const uint16_t scale) {
+  return vrshrn_n_u16(vmulq_n_u16(vmovl_u8(v), scale), 8);
+}
+#endif
+
+void color_frame(const color_t *const color, uint32_t *const out,
+                 const uint32_t *const in, const size_t num_pixels) {
+  size_t i = 0;
+
+#ifdef __ARM_NEON__
+  if (color->linear) {
+    const uint8_t *const order = color->order;
+    // De-interleave 8 pixels at a time and scale each color with one
+    // multiply, which beats four table lookups a pixel.  The reordering
+    // is free in the interleaving store.
+    for (; i + 8 <= num_pixels; i += 8) {
+      const uint8x8x4_t v = vld4_u8((const uint8_t *)&in[i]);
+      uint8x8_t b = v.val[0], r = v.val[1], g = v.val[2], w = v.val[3];
+      if (color->white) {
+        const uint8x8_t common = vmin_u8(vmin_u8(b, r), g);
+        b = vsub_u8(b, common);
+        r = vsub_u8(r, common);
+        g = vsub_u8(g, common);
+        w = vqadd_u8(w, common);
+      }
+
+      const uint8x8_t bytes[5] = {
+          scale_neon(b, color->scale[0]), scale_neon(r, color->scale[1]),
+          scale_neon(g, color->scale[2]), scale_neon(w, color->scale[3]),
+          vdup_n_u8(0)};
+      uint8x8x4_t o;
+      o.val[0] = bytes[order[0]];
+      o.val[1] = bytes[order[1]];
+      o.val[2] = bytes[order[2]];
+      o.val[3] = bytes[order[3]];
+      vst4_u8((uint8_t *)&out[i], o);
+    }
+  }
+#endif
+
+  for (; i < num_pixels; i++) {
+    const uint32_t p = in[i];
+    uint32_t b = p & 0xFF, r = (p >> 8) & 0xFF, g = (p >> 16) & 0xFF;
+    uint32_t w = p >> 24;
+    if (color->white) {
+      const uint32_t common = min_u32(min_u32(b, r), g);
+      b -= common;
+      r -= common;
+      g -= common;
+      w = min_u32(w + common, 255);
+    }
+
+    out[i] = color->lut[0][b] | color->lut[1][r] | color->lut[2][g] |
+             color->lut[3][w];
+  }
+}
+
+void color_dither(const color_t *const color, uint32_t *const out,
+                  const uint16_t *const in, uint8_t *const error,
+                  const size_t num_pixels) {
+  static const uint8_t default_order[4] = {0, 1, 2, 4};
+  const uint8_t *const order = color ? color->order : default_order;
+  size_t i = 0;
+
+#ifdef __ARM_NEON__
+  if (!color || (color->linear && !color->white)) {
+    // Two pixels at a time, reordered with a table lookup that gives 0
+    // for the indices past the end
+    const uint16_t scale_lanes[4] = {
+        color ? color->scale[0] : 256, color ? color->scale[1] : 256,
+        color ? color->scale[2] : 256, color ? color->scale[3] : 256};
+    const uint16x4_t scale = vld1_u16(scale_lanes);
+    uint8_t index_lanes[8];
+    for (unsigned b = 0; b < 8; b++)
+      index_lanes[b] = order[b % 4] == 4 ? 0xFF : order[b % 4] + b / 4 * 4;
+    const uint8x8_t index = vld1_u8(index_lanes);
+
+    for (; i + 2 <= num_pixels; i += 2) {
+      const uint16x8_t v = vld1q_u16(&in[4 * i]);
+      uint16x8_t scaled =
+          vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(v), scale), 8),
+                       vshrn_n_u32(vmull_u16(vget_high_u16(v), scale), 8));
+      scaled = vsubq_u16(scaled, vshrq_n_u16(scaled, 8));
+      const uint16x8_t sum =
+          vqaddq_u16(scaled, vmovl_u8(vld1_u8(&error[4 * i])));
+      vst1_u8((uint8_t *)&out[i], vtbl1_u8(vshrn_n_u16(sum, 8), index));
+      vst1_u8(&error[4 * i], vmovn_u16(sum));
+    }
+  }
+#endif
+
+  // Only RGBW pixels need the white dithered, and only other orders need
+  // the bytes moving
+  const unsigned colors = memchr(order, 3, 4) ? 4 : 3;
+  const int reorder = memcmp(order, default_order, 4) != 0;
+
+  for (; i < num_pixels; i++) {
+    uint32_t v[4] = {in[4 * i], in[4 * i + 1], in[4 * i + 2], in[4 * i + 3]};
+    if (color && color->white) {
+      const uint32_t common = min_u32(min_u32(v[0], v[1]), v[2]);
+      v[0] -= common;
+      v[1] -= common;
+      v[2] -= common;
+      v[3] = min_u32(v[3] + common, 65535);
+    }
+
+    uint64_t p = 0;
+    for (unsigned c = 0; c < colors; c++) {
+      if (color && color->linear)
+        v[c] = v[c] * color->scale[c] >> 8;
+      else if (color)
+        v[c] = color->lut16[c][v[c] >> (16 - COLOR_LUT16_BITS)];
+      v[c] -= v[c] >> 8;
+
+      // Can not carry past full on
+      const uint32_t sum = v[c] + error[4 * i + c];
+      p |= (sum >> 8) << (8 * c);
+      error[4 * i + c] = sum;
+    }
+
+    // An order of 4 shifts in a 0 from past the pixel
+    if (reorder)
+      p = (p >> 8 * order[0] & 0xFF) | (p >> 8 * order[1] & 0xFF) << 8 |
+          (p >> 8 * order[2] & 0xFF) << 16 | (p >> 8 * order[3] & 0xFF) << 24;
+    out[i] = p;
+  }
+}
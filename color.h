@@ -0,0 +1,89 @@
+/** \file
+ * Color correction of frames on their way out to the LEDs.
+ *
+ * Applications draw in the colors that they want to see, and each frame
+ * is scaled by a global brightness and per-color white balance gains and
+ * put through a gamma curve as it is copied out for the PRU.  All three
+ * are folded into one lookup table per color.  The same pass puts the
+ * colors in the order that the LEDs expect, with an optional white.
+ */
+#ifndef _color_h_
+#define _color_h_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** Bits of a 16 bit color that index lut16. */
+#define COLOR_LUT16_BITS 12
+
+/** Color order of the LEDs that need no reordering of the pixels. */
+#define COLOR_ORDER_DEFAULT "GRB"
+
+/** Lookup tables for each byte of a BRGW pixel.
+ *
+ * With a gamma of 1 each table is just a multiply by scale / 256, which
+ * the NEON path does instead of the lookups.  Other gammas always take
+ * the scalar lookups, as a NEON table lookup spans at most 32 bytes.
+ * lut16 is the same curve for pixels of 16 bits per color, and is only
+ * filled in for other gammas.  The white byte only takes the brightness.
+ *
+ * Byte b of each pixel sent out is byte order[b] of the corrected BRGW
+ * pixel, or 0 for an order of 4.  The entries of lut are already shifted
+ * into the byte that they are sent in.
+ */
+typedef struct {
+  int linear;
+  int white;
+  uint8_t order[4];
+  uint16_t scale[4];
+  uint32_t lut[4][256];
+  uint16_t lut16[4][1 << COLOR_LUT16_BITS];
+} color_t;
+
+/** Check a color order of the letters R, G, B and optionally W, in the
+ * order that the LEDs take the colors, such as "GRB" or "GRBW".
+ *
+ * \return the bits per pixel on the wire, 24 or 32.
+ */
+extern unsigned color_order_bits(const char *order);
+
+/** Build the tables for a brightness and red, green and blue gains of 0
+ * to 255, where 255 leaves the color as it is, a gamma exponent and a
+ * color order.  With white set and a W in the order, the white that the
+ * red, green and blue have in common is moved to the white LED.
+ *
+ * \return NULL if the tables would not change any pixel.
+ */
+extern color_t *color_init(uint8_t brightness, const uint8_t *gains,
+                           float gamma, const char *order, int white);
+
+extern void color_free(color_t *const color);
+
+/** Correct and reorder num_pixels BRGW pixels from in to out.
+ *
+ * Any byte that the order does not send is cleared.
+ */
+extern void color_frame(const color_t *const color, uint32_t *const out,
+                        const uint32_t *const in, size_t num_pixels);
+
+/** Quantise num_pixels pixels of 16 bits per color to pixels for the PRU.
+ *
+ * in holds the B, R, G and W of each pixel as 16 bit values.  The part of
+ * each color that is lost in rounding it down to 8 bits is kept in error,
+ * a byte per color that starts out as 0, and added on in the next frame.
+ * Over a few frames the LEDs then average out at the full precision.
+ * The colors are corrected and reordered first if color is not NULL,
+ * otherwise the pixels are BRG with the last byte cleared.
+ */
+extern void color_dither(const color_t *const color, uint32_t *const out,
+                         const uint16_t *const in, uint8_t *const error,
+                         size_t num_pixels);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
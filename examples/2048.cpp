@@ -53,7 +53,17 @@ uint16_t getColor(uint16_t value) {
   }
 }
 
-void drawBoard(PixelBone_Matrix &matrix, uint16_t board[SIZE][SIZE]) {
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Draw the board and show it at ns on CLOCK_MONOTONIC, or straight away
+ * for 0.
+ */
+void drawBoard(PixelBone_Matrix &matrix, uint16_t board[SIZE][SIZE],
+               uint64_t ns = 0) {
   matrix.clear();
   for (int16_t y = 0; y < SIZE; y++) {
     for (int16_t x = 0; x < SIZE; x++) {
@@ -63,7 +73,7 @@ void drawBoard(PixelBone_Matrix &matrix, uint16_t board[SIZE][SIZE]) {
     }
   }
   matrix.wait();
-  matrix.show();
+  matrix.showAt(ns);
   matrix.moveToNextBuffer();
 }
 
@@ -368,10 +378,11 @@ int main(int argc, char *argv[]) {
       success = false;
     }
     if (success) {
+      // Let the move settle before the new tile appears
       drawBoard(*matrix, board);
-      usleep(150000);
+      const uint64_t moved_ns = now_ns();
       addRandom(board);
-      drawBoard(*matrix, board);
+      drawBoard(*matrix, board, moved_ns + 150000000);
       if (gameEnded(board)) {
         printf("         GAME OVER          \n");
         break;
@@ -0,0 +1,94 @@
+/** \file
+ * Measure how fast the ARM can slice frames into per-bit GPIO masks.
+ *
+ * This only exercises bitslice_frame() and does not touch the PRU.  Both
+ * the 24 bit pixels of RGB strips and the 32 bit pixels of RGBW strips
+ * are timed.  Each is first checked against slicing the frame a bit at a
+ * time, which on the BeagleBone tests the NEON transpose.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include "../bitslice.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Compare the masks of each bit of each slot with the pins of the
+ * channels that send a zero for it.
+ */
+static bool check(const uint32_t (*const masks)[4], const uint32_t *frame,
+                  const unsigned num_slots, const unsigned num_channels,
+                  const unsigned bits, const uint8_t *gpio,
+                  const uint8_t *pin) {
+  for (unsigned s = 0; s < num_slots; s++, frame += num_channels)
+    for (unsigned bit = 0; bit < bits; bit++) {
+      uint32_t zeros[4] = {0};
+      for (unsigned c = 0; c < num_channels; c++)
+        if (!(frame[c] >> (bits - 1 - bit) & 1))
+          zeros[gpio[c]] |= 1u << pin[c];
+
+      if (memcmp(zeros, masks[s * bits + bit], sizeof(zeros))) {
+        printf("%2u channels x %u bits: slot %u bit %u differs\n",
+               num_channels, bits, s, bit);
+        return false;
+      }
+    }
+  return true;
+}
+
+int main(void) {
+  const unsigned num_slots = 512;
+  const unsigned channel_counts[] = {1, 8, 16, 32};
+  const unsigned bit_counts[] = {24, 32};
+  uint8_t gpio[BITSLICE_MAX_CHANNELS], pin[BITSLICE_MAX_CHANNELS];
+
+  for (unsigned c = 0; c < BITSLICE_MAX_CHANNELS; c++) {
+    gpio[c] = c / 8;
+    pin[c] = c % 8;
+  }
+
+  uint32_t *const frame =
+      (uint32_t *)malloc(num_slots * BITSLICE_MAX_CHANNELS * sizeof(*frame));
+  bitslice_slot_t *const slices =
+      (bitslice_slot_t *)malloc(num_slots * sizeof(*slices));
+  if (!frame || !slices)
+    return EXIT_FAILURE;
+
+  for (unsigned i = 0; i < num_slots * BITSLICE_MAX_CHANNELS; i++)
+    frame[i] = rand();
+
+  for (const unsigned bits : bit_counts) {
+    for (const unsigned num_channels : channel_counts) {
+      bitslice_t *const bs = bitslice_init(num_channels, bits, gpio, pin);
+      bitslice_frame(bs, slices, frame, num_slots);
+      if (!check((const uint32_t(*)[4])slices, frame, num_slots, num_channels,
+                 bits, gpio, pin))
+        return EXIT_FAILURE;
+
+      unsigned frames = 0;
+      const double start = now();
+      double elapsed;
+
+      do {
+        bitslice_frame(bs, slices, frame, num_slots);
+        frames++;
+      } while ((elapsed = now() - start) < 1.0);
+
+      const double pixels = (double)frames * num_slots * num_channels;
+      printf("%2u channels x %u x %u bits: %8.0f frames/sec %12.0f "
+             "pixels/sec\n",
+             num_channels, num_slots, bits, frames / elapsed, pixels / elapsed);
+      bitslice_free(bs);
+    }
+  }
+
+  free(slices);
+  free(frame);
+  return EXIT_SUCCESS;
+}
@@ -74,13 +74,13 @@ uint8_t GameOfLife::getState(uint16_t state, uint8_t yCoord, uint8_t xCoord) {
         continue;
       }
       if ( i > -1 && i < HEIGHT && j > -1 && j < WIDTH ) {
-        if ( world->getPixelColor(j, i) == WHITE) {
+        if ( world->getPixelColor(j, i) != BLANK) {
           neighbors++;
         }
       }
     }
   }
-  if (state == WHITE) {
+  if (state != BLANK) {
     return ( neighbors > 1 && neighbors < 4 ) ? WHITE : BLANK;
   }
   else {
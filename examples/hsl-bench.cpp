@@ -0,0 +1,108 @@
+/** \file
+ * Compare the HSL and HSV conversions with the original per-pixel HSL.
+ *
+ * The original divided by 600000 three times a pixel.  Every hue,
+ * saturation and lightness is first checked to convert to the same color
+ * both ways.  Nothing here touches the PRU.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <ctime>
+#include "../pixel.hpp"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t h2rgb(uint32_t v1, uint32_t v2, uint32_t hue) {
+  if (hue < 60)
+    return v1 * 60 + (v2 - v1) * hue;
+  if (hue < 180)
+    return v2 * 60;
+  if (hue < 240)
+    return v1 * 60 + (v2 - v1) * (240 - hue);
+
+  return v1 * 60;
+}
+
+/** PixelBone_Pixel::HSL() as it was. */
+static uint32_t HSL_divide(uint32_t hue, uint32_t saturation,
+                           uint32_t lightness) {
+  uint32_t red, green, blue;
+  uint32_t var1, var2;
+
+  if (hue > 359) hue = hue % 360;
+  if (saturation > 100) saturation = 100;
+  if (lightness > 100) lightness = 100;
+
+  if (saturation == 0) {
+    red = green = blue = lightness * 255 / 100;
+  } else {
+    if (lightness < 50) {
+      var2 = lightness * (100 + saturation);
+    } else {
+      var2 = ((lightness + saturation) * 100) - (saturation * lightness);
+    }
+    var1 = lightness * 200 - var2;
+    red = h2rgb(var1, var2, (hue < 240) ? hue + 120 : hue - 240) * 255 / 600000;
+    green = h2rgb(var1, var2, hue) * 255 / 600000;
+    blue = h2rgb(var1, var2, (hue >= 120) ? hue - 120 : hue + 240) * 255 / 600000;
+  }
+  return (red << 16) | (green << 8) | blue;
+}
+
+static const unsigned num_pixels = 1024;
+static uint16_t hue[num_pixels];
+static uint8_t saturation[num_pixels], lightness[num_pixels];
+static uint32_t colors[num_pixels];
+
+/** Run fn for a second and print how many pixels it converted. */
+template <typename Fn> static void bench(const char *const name, Fn fn) {
+  unsigned frames = 0;
+  const double start = now();
+  double elapsed;
+
+  do {
+    fn();
+    frames++;
+  } while ((elapsed = now() - start) < 1.0);
+
+  printf("%-24s %12.0f pixels/sec\n", name,
+         (double)frames * num_pixels / elapsed);
+}
+
+int main(void) {
+  unsigned mismatches = 0;
+  for (uint32_t h = 0; h < 360; h++)
+    for (uint32_t s = 0; s <= 100; s++)
+      for (uint32_t l = 0; l <= 100; l++)
+        if (PixelBone_Pixel::HSL(h, s, l) != HSL_divide(h, s, l))
+          mismatches++;
+  printf("%u HSL mismatches\n", mismatches);
+
+  for (unsigned i = 0; i < num_pixels; i++) {
+    hue[i] = rand() % 360;
+    saturation[i] = rand() % 101;
+    lightness[i] = rand() % 101;
+  }
+
+  bench("HSL() dividing", [] {
+    for (unsigned i = 0; i < num_pixels; i++)
+      colors[i] = HSL_divide(hue[i], saturation[i], lightness[i]);
+  });
+  bench("HSL() per pixel", [] {
+    for (unsigned i = 0; i < num_pixels; i++)
+      colors[i] = PixelBone_Pixel::HSL(hue[i], saturation[i], lightness[i]);
+  });
+  bench("HSL() batch", [] {
+    PixelBone_Pixel::HSL(hue, saturation, lightness, colors, num_pixels);
+  });
+  bench("HSV() batch", [] {
+    PixelBone_Pixel::HSV(hue, saturation, lightness, colors, num_pixels);
+  });
+
+  return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
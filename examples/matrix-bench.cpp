@@ -0,0 +1,426 @@
+/** \file
+ * Time the drawing primitives of PixelBone_Matrix on a tiled 64x8 and a
+ * 128x128 layout, in each rotation that swaps the axes.
+ *
+ * Every primitive is first checked to light exactly the pixels that
+ * drawPixel() would, on a few awkward layouts and all four rotations,
+ * and the lookup table and PixelBone_FixedMatrix to give the same offsets
+ * as working them out.  Nothing is shown, so this measures only the
+ * writes into the buffer.
+ *
+ * The offsets of the whole display are also worked out on their own with
+ * the layout known only at run time and with it fixed at compile time,
+ * where the loop has no branches on the layout left and can vectorise.
+ *
+ * Finally a line of text is scrolled across each display by printing
+ * it afresh each frame and by copying it from a canvas that it was drawn
+ * into once, with and without the lookup table, after checking that a
+ * canvas copied into a matrix looks the same as drawing straight into it.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include "../matrix.hpp"
+#include "../canvas.hpp"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct layout_t {
+  const char *name;
+  uint8_t matrix_width, matrix_height, tiles_x, tiles_y;
+  uint8_t type;
+};
+
+static const layout_t checked[] = {
+    {"8x8 tiles, zigzag", 8, 8, 3, 2,
+     TILE_TOP + TILE_LEFT + TILE_ROWS + TILE_PROGRESSIVE + MATRIX_TOP +
+         MATRIX_LEFT + MATRIX_ROWS + MATRIX_ZIGZAG},
+    {"5x3 tiles, zigzag both", 5, 3, 2, 3,
+     TILE_BOTTOM + TILE_RIGHT + TILE_COLUMNS + TILE_ZIGZAG + MATRIX_TOP +
+         MATRIX_RIGHT + MATRIX_COLUMNS + MATRIX_ZIGZAG},
+    {"7x5 tiles", 7, 5, 2, 2,
+     TILE_TOP + TILE_RIGHT + TILE_ROWS + TILE_ZIGZAG + MATRIX_BOTTOM +
+         MATRIX_LEFT + MATRIX_ROWS + MATRIX_PROGRESSIVE},
+    {"13x9 single, columns", 13, 9, 0, 0,
+     MATRIX_BOTTOM + MATRIX_RIGHT + MATRIX_COLUMNS + MATRIX_ZIGZAG},
+};
+
+#define TILED_TYPE                                                             \
+  (TILE_TOP + TILE_LEFT + TILE_ROWS + TILE_PROGRESSIVE + MATRIX_TOP +          \
+   MATRIX_LEFT + MATRIX_ROWS + MATRIX_ZIGZAG)
+#define COLUMNS_TYPE                                                           \
+  (MATRIX_BOTTOM + MATRIX_RIGHT + MATRIX_COLUMNS + MATRIX_ZIGZAG)
+
+static const layout_t benched[] = {
+    {"64x8 as 8x8 tiles", 8, 8, 8, 1, TILED_TYPE},
+    {"128x128 zigzag columns", 128, 128, 0, 0, COLUMNS_TYPE},
+};
+
+typedef PixelBone_FixedMatrix<8, 8, TILED_TYPE, 8, 1> tiled_matrix_t;
+typedef PixelBone_FixedMatrix<128, 128, COLUMNS_TYPE> columns_matrix_t;
+
+static PixelBone_Matrix *create(const layout_t &l) {
+  if (l.tiles_x)
+    return new PixelBone_Matrix(l.matrix_width, l.matrix_height, l.tiles_x,
+                                l.tiles_y, l.type);
+  return new PixelBone_Matrix(l.matrix_width, l.matrix_height, l.type);
+}
+
+static std::vector<uint32_t> snapshot(PixelBone_Matrix *const matrix) {
+  std::vector<uint32_t> pixels(matrix->numPixels());
+  for (uint32_t i = 0; i < pixels.size(); i++)
+    pixels[i] = matrix->PixelBone_Pixel::getPixelColor(i);
+  return pixels;
+}
+
+/** Draw with fn and then pixel by pixel with ref, which should match. */
+template <typename Fn, typename Ref>
+static bool check(PixelBone_Matrix *const matrix, const char *const what,
+                  Fn fn, Ref ref) {
+  matrix->clear();
+  fn();
+  const std::vector<uint32_t> drawn = snapshot(matrix);
+  matrix->clear();
+  ref();
+  if (drawn == snapshot(matrix))
+    return true;
+
+  printf("  %s, rotation %u: differs from drawPixel()\n", what,
+         matrix->getRotation());
+  return false;
+}
+
+/** Paint each pixel a different color with and without the lookup table. */
+static bool check_lookup(PixelBone_Matrix *const matrix) {
+  const int16_t w = matrix->width(), h = matrix->height();
+  std::vector<uint32_t> drawn[2];
+
+  for (int lut = 0; lut < 2; lut++) {
+    matrix->setLookupTable(lut);
+    matrix->clear();
+    for (int16_t y = 0; y < h; y++)
+      for (int16_t x = 0; x < w; x++)
+        matrix->drawPixel(x, y, y * w + x + 1);
+    drawn[lut] = snapshot(matrix);
+  }
+  matrix->setLookupTable(false);
+  if (drawn[0] == drawn[1])
+    return true;
+
+  printf("  lookup table, rotation %u: differs from getOffset()\n",
+         matrix->getRotation());
+  return false;
+}
+
+/** Paint each pixel a different color on a matrix and its fixed twin. */
+template <typename Fixed>
+static bool check_fixed(const layout_t &l) {
+  PixelBone_Matrix *const matrix = create(l);
+  Fixed *const fixed = new Fixed();
+  bool ok = true;
+
+  for (uint8_t r = 0; r < 4; r++) {
+    matrix->setRotation(r);
+    fixed->setRotation(r);
+    const int16_t w = matrix->width(), h = matrix->height();
+    for (int16_t y = 0; y < h; y++)
+      for (int16_t x = 0; x < w; x++) {
+        matrix->drawPixel(x, y, y * w + x + 1);
+        fixed->drawPixel(x, y, y * w + x + 1);
+      }
+
+    if (snapshot(matrix) != snapshot(fixed)) {
+      printf("  %s, rotation %u: fixed layout differs\n", l.name, r);
+      ok = false;
+    }
+  }
+
+  delete fixed;
+  delete matrix;
+  return ok;
+}
+
+/** Draw the same shapes on a canvas and a matrix in each rotation. */
+static bool check_canvas(const layout_t &l) {
+  PixelBone_Matrix *const matrix = create(l);
+  PixelBone_Canvas canvas(matrix->width(), matrix->height());
+  PixelBone_Canvas copy(matrix->width() + 3, matrix->height());
+  bool ok = true;
+
+  for (uint8_t r = 0; r < 4; r++) {
+    const auto draw = [r](PixelBone_GFX *const gfx) {
+      gfx->setRotation(r);
+      gfx->fillScreen(0x102030);
+      gfx->fillRect(-2, 1, 7, 5, 0x405060);
+      gfx->drawFastVLine(3, -1, 40, 0x708090);
+      gfx->drawLine(0, 0, 30, 7, 0xA0B0C0);
+      gfx->setCursor(1, 0);
+      gfx->setTextColor(0xFF8000);
+      gfx->print("Hi!");
+    };
+
+    matrix->setRotation(0);
+    matrix->clear();
+    draw(matrix);
+    const std::vector<uint32_t> drawn = snapshot(matrix);
+
+    draw(&canvas);
+    // By way of a blit and a sub-pixel blit at a whole pixel
+    copy.clear();
+    copy.blitSubpixel(canvas, 3 * 256, 0);
+    copy.blit(copy, 3, 0, copy.width(), copy.height(), 0, 0);
+    matrix->setRotation(0);
+    matrix->clear();
+    copy.copyTo(*matrix);
+    if (snapshot(matrix) != drawn) {
+      printf("  %s, rotation %u: canvas differs\n", l.name, r);
+      ok = false;
+    }
+
+    // And straight along the strip through the lookup table
+    matrix->setLookupTable(true);
+    matrix->clear();
+    canvas.copyTo(*matrix);
+    matrix->setLookupTable(false);
+    if (snapshot(matrix) != drawn) {
+      printf("  %s, rotation %u: canvas differs through the lookup table\n",
+             l.name, r);
+      ok = false;
+    }
+  }
+
+  delete matrix;
+  return ok;
+}
+
+static bool check_all(const layout_t &l) {
+  PixelBone_Matrix *const matrix = create(l);
+  const uint32_t c = 0x123456;
+  bool ok = true;
+
+  for (uint8_t r = 0; r < 4; r++) {
+    matrix->setRotation(r);
+    ok &= check_lookup(matrix);
+    const int16_t w = matrix->width(), h = matrix->height();
+    for (unsigned i = 0; i < 200; i++) {
+      // Partly off screen some of the time
+      const int16_t x = rand() % (w + 8) - 4, y = rand() % (h + 8) - 4;
+      const int16_t rw = rand() % (w + 4), rh = rand() % (h + 4);
+
+      ok &= check(matrix, "drawFastHLine",
+                  [&] { matrix->drawFastHLine(x, y, rw, c); },
+                  [&] {
+                    for (int16_t i = 0; i < rw; i++)
+                      matrix->drawPixel(x + i, y, c);
+                  });
+      ok &= check(matrix, "drawFastVLine",
+                  [&] { matrix->drawFastVLine(x, y, rh, c); },
+                  [&] {
+                    for (int16_t i = 0; i < rh; i++)
+                      matrix->drawPixel(x, y + i, c);
+                  });
+      ok &= check(matrix, "fillRect",
+                  [&] { matrix->fillRect(x, y, rw, rh, c); },
+                  [&] {
+                    for (int16_t j = 0; j < rh; j++)
+                      for (int16_t i = 0; i < rw; i++)
+                        matrix->drawPixel(x + i, y + j, c);
+                  });
+    }
+    ok &= check(matrix, "fillScreen", [&] { matrix->fillScreen(c); },
+                [&] {
+                  for (int16_t j = 0; j < h; j++)
+                    for (int16_t i = 0; i < w; i++)
+                      matrix->drawPixel(i, j, c);
+                });
+  }
+
+  delete matrix;
+  return ok;
+}
+
+/** Run fn for half a second and print how many pixels a second it drew. */
+template <typename Fn>
+static void bench(const char *const name, const uint32_t pixels, Fn fn) {
+  unsigned frames = 0;
+  const double start = now();
+  double elapsed;
+
+  do {
+    fn();
+    frames++;
+  } while ((elapsed = now() - start) < 0.5);
+
+  printf("  %-24s %10.1f Mpixels/sec\n", name,
+         (double)frames * pixels / elapsed / 1e6);
+}
+
+/** Offsets of the whole display with a layout only known at run time. */
+static void __attribute__((noinline))
+runtime_offsets(const layout_t &l, uint16_t *const offsets) {
+  const uint16_t w = l.matrix_width * (l.tiles_x ? l.tiles_x : 1);
+  const uint16_t h = l.matrix_height * (l.tiles_y ? l.tiles_y : 1);
+  for (uint16_t y = 0; y < h; y++)
+    for (uint16_t x = 0; x < w; x++)
+      offsets[y * w + x] = matrix_offset(x, y, l.type, l.matrix_width,
+                                         l.matrix_height, l.tiles_x, l.tiles_y);
+}
+
+/** The same with the layout fixed at compile time. */
+template <typename Fixed>
+static void __attribute__((noinline))
+fixed_offsets(const uint16_t w, const uint16_t h, uint16_t *const offsets) {
+  for (uint16_t y = 0; y < h; y++)
+    for (uint16_t x = 0; x < w; x++)
+      offsets[y * w + x] = Fixed::offset(x, y);
+}
+
+template <typename Fixed>
+static void bench_all(const layout_t &l) {
+  PixelBone_Matrix *const matrix = create(l);
+  Fixed *const fixed = new Fixed();
+  uint32_t c = 0;
+
+  const uint32_t num_pixels = matrix->numPixels();
+  std::vector<uint16_t> offsets(num_pixels);
+  printf("%s offsets:\n", l.name);
+  bench("runtime layout", num_pixels,
+        [&] { runtime_offsets(l, offsets.data()); });
+  bench("fixed layout", num_pixels, [&] {
+    fixed_offsets<Fixed>(matrix->width(), matrix->height(), offsets.data());
+  });
+
+  for (uint8_t r = 0; r < 2; r++) {
+    matrix->setRotation(r);
+    const int16_t w = matrix->width(), h = matrix->height();
+    const uint32_t n = w * h;
+    printf("%s, rotation %u:\n", l.name, r);
+    matrix->setLookupTable(true);
+    printf("  %-24s %10zu bytes\n", "lookup table", matrix->lookupTableBytes());
+    matrix->setLookupTable(false);
+
+    const auto draw_pixels = [&] {
+      c++;
+      for (int16_t y = 0; y < h; y++)
+        for (int16_t x = 0; x < w; x++)
+          matrix->drawPixel(x, y, c);
+    };
+    bench("drawPixel", n, draw_pixels);
+    fixed->setRotation(r);
+    bench("drawPixel, fixed layout", n, [&] {
+      c++;
+      for (int16_t y = 0; y < h; y++)
+        for (int16_t x = 0; x < w; x++)
+          fixed->drawPixel(x, y, c);
+    });
+    matrix->setLookupTable(true);
+    bench("drawPixel, lookup table", n, draw_pixels);
+    matrix->setLookupTable(false);
+    bench("fillScreen", n, [&] { matrix->fillScreen(++c); });
+    bench("fillRect whole screen", n,
+          [&] { matrix->fillRect(0, 0, w, h, ++c); });
+    bench("fillRect 8x8 blocks", n, [&] {
+      c++;
+      for (int16_t y = 0; y < h; y += 8)
+        for (int16_t x = 0; x < w; x += 8)
+          matrix->fillRect(x, y, 8, 8, c);
+    });
+    bench("drawFastHLine rows", n, [&] {
+      c++;
+      for (int16_t y = 0; y < h; y++)
+        matrix->drawFastHLine(0, y, w, c);
+    });
+    bench("drawFastVLine columns", n, [&] {
+      c++;
+      for (int16_t x = 0; x < w; x++)
+        matrix->drawFastVLine(x, 0, h, c);
+    });
+  }
+
+  delete fixed;
+  delete matrix;
+}
+
+/** Scroll a line of text as tall as the display across it. */
+static void bench_marquee(const layout_t &l) {
+  PixelBone_Matrix *const matrix = create(l);
+  const int16_t w = matrix->width(), h = matrix->height();
+  const char *const text = "Hello from PixelBone";
+  const uint8_t size = h / 8;
+  const int16_t text_width = 6 * size * strlen(text);
+  const int16_t step = size;
+  int32_t offset = 0;
+
+  printf("%s marquee:\n", l.name);
+  const auto print = [&] {
+    matrix->fillScreen(0);
+    matrix->setCursor(w - offset, 0);
+    matrix->print(text);
+    offset = (offset + step) % (w + text_width);
+  };
+  matrix->setTextWrap(false);
+  matrix->setTextSize(size);
+  matrix->setTextColor(0x00FF00);
+  bench("print per frame", w * h, print);
+  matrix->setTextColor(0x00FF00, 0x000010);
+  bench("print with background", w * h, print);
+
+  PixelBone_Canvas line(text_width, h), frame(w, h);
+  line.setTextWrap(false);
+  line.setTextSize(size);
+  line.setTextColor(0x00FF00, 0x000010);
+  line.print(text);
+  bench("canvas copy per frame", w * h, [&] {
+    matrix->fillScreen(0);
+    line.copyTo(*matrix, w - offset, 0);
+    offset = (offset + step) % (w + text_width);
+  });
+  const auto blit = [&] {
+    frame.clear();
+    frame.blit(line, w - offset, 0);
+    frame.copyTo(*matrix);
+    offset = (offset + step) % (w + text_width);
+  };
+  bench("canvas blit per frame", w * h, blit);
+  matrix->setLookupTable(true);
+  bench("canvas blit, lookup table", w * h, blit);
+  matrix->setLookupTable(false);
+  bench("canvas sub-pixel blit", w * h, [&] {
+    frame.clear();
+    frame.blitSubpixel(line, (w << 8) - offset, 0);
+    frame.copyTo(*matrix);
+    offset = (offset + 64 * step) % ((w + text_width) << 8);
+  });
+
+  delete matrix;
+}
+
+int main(void) {
+  bool ok = true;
+  for (const layout_t &l : checked)
+    ok &= check_all(l);
+  for (const layout_t &l : benched)
+    ok &= check_all(l);
+  ok &= check_fixed<tiled_matrix_t>(benched[0]);
+  ok &= check_fixed<columns_matrix_t>(benched[1]);
+  for (const layout_t &l : checked)
+    ok &= check_canvas(l);
+  for (const layout_t &l : benched)
+    ok &= check_canvas(l);
+  if (!ok)
+    return EXIT_FAILURE;
+  printf("All primitives match drawPixel()\n");
+
+  bench_all<tiled_matrix_t>(benched[0]);
+  bench_all<columns_matrix_t>(benched[1]);
+  for (const layout_t &l : benched)
+    bench_marquee(l);
+  return EXIT_SUCCESS;
+}
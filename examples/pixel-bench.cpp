@@ -0,0 +1,217 @@
+/** \file
+ * Compare the per-pixel and bulk ways of filling a frame buffer.
+ *
+ * Nothing is shown, so this measures only the writes into the buffer.
+ * The strip is the same 384 pixels as the scroll example.  Each test is
+ * run against the DDR and then against a shadow buffer, including the
+ * flush() that show() would do to copy it to the DDR.
+ *
+ * The last two tests compare repainting each frame in full with changing
+ * 8 pixels and letting the dirty tracking bring the next buffer up to date.
+ * Finally the color correction and the reordering into RGBW pixels are
+ * timed as the shadow is copied out, and the dithering of 16 bits per
+ * color down to the 8 bits sent to the LEDs.  Both are first checked
+ * against correcting one pixel at a time, which always takes the scalar
+ * path, so that on the BeagleBone the NEON paths are tested too.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include "../pixel.hpp"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const uint32_t num_pixels = 384;
+static PixelBone_Pixel *strip;
+static bool shadowed;
+
+/** Run fn for a second and print how long each frame took. */
+template <typename Fn>
+static void bench(const char *const name, Fn fn) {
+  unsigned frames = 0;
+  const double start = now();
+  double elapsed;
+
+  do {
+    fn();
+    if (shadowed)
+      strip->flush();
+    frames++;
+  } while ((elapsed = now() - start) < 1.0);
+
+  printf("%-28s %10.0f frames/sec %8.2f ns/pixel\n", name, frames / elapsed,
+         elapsed * 1e9 / frames / num_pixels);
+}
+
+static void bench_all(void) {
+  uint32_t colors[num_pixels];
+  uint8_t rgb[3 * num_pixels];
+  for (uint32_t i = 0; i < num_pixels; i++) {
+    colors[i] = rand() & 0xFFFFFF;
+    rgb[3 * i + 0] = colors[i] >> 16;
+    rgb[3 * i + 1] = colors[i] >> 8;
+    rgb[3 * i + 2] = colors[i];
+  }
+
+  bench("clear per pixel", [&] {
+    for (uint32_t i = 0; i < num_pixels; i++)
+      strip->setPixelColor(i, 0, 0, 0);
+  });
+  bench("clear()", [&] { strip->clear(); });
+  bench("fill per pixel", [&] {
+    for (uint32_t i = 0; i < num_pixels; i++)
+      strip->setPixelColor(i, 0x808080);
+  });
+  bench("fill()", [&] { strip->fill(0, num_pixels, 0x808080); });
+  bench("copy RGB per pixel", [&] {
+    for (uint32_t i = 0; i < num_pixels; i++)
+      strip->setPixelColor(i, rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]);
+  });
+  bench("setPixelsRGB()", [&] { strip->setPixelsRGB(0, rgb, num_pixels); });
+  bench("setPixels()", [&] { strip->setPixels(0, colors, num_pixels); });
+  bench("read per pixel", [&] {
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < num_pixels; i++)
+      sum += strip->getPixelColor(i);
+    if (sum == 1)
+      printf("\n");
+  });
+
+  bench("repaint next buffer", [&] {
+    strip->moveToNextBuffer();
+    strip->setPixels(0, colors, num_pixels);
+  });
+
+  strip->setDirtyTracking(true);
+  uint32_t frame = 0;
+  bench("8 pixels, dirty tracking", [&] {
+    strip->moveToNextBuffer();
+    for (uint32_t i = 0; i < 8; i++)
+      strip->setPixelColor((i * 47 + frame) % num_pixels, colors[i]);
+    frame++;
+  });
+  printf("%-28s %10zu bytes/frame\n", "  copied", strip->copiedBytes());
+  strip->setDirtyTracking(false);
+}
+
+/** Correct a frame and a few dithered frames in one call and a pixel at
+ * a time, and compare the pixels sent out.  Only dithering takes a NULL
+ * color.
+ */
+static bool check_color(const char *const name, const color_t *const color) {
+  static uint32_t in[num_pixels], out[num_pixels], ref[num_pixels];
+  static uint16_t deep[4 * num_pixels];
+  static uint8_t error[4 * num_pixels], ref_error[4 * num_pixels];
+
+  for (uint32_t i = 0; i < num_pixels; i++) {
+    in[i] = rand();
+    // Some grays, and some colors at either end of the tables
+    if (i % 8 == 1)
+      in[i] = (in[i] & 0xFF) * 0x01010101;
+    else if (i % 8 == 2)
+      in[i] |= 0xFF00FF00;
+  }
+  if (color) {
+    color_frame(color, out, in, num_pixels);
+    for (uint32_t i = 0; i < num_pixels; i++)
+      color_frame(color, &ref[i], &in[i], 1);
+  }
+  if (color && memcmp(out, ref, sizeof(out))) {
+    printf("%s: color_frame() differs from the scalar path\n", name);
+    return false;
+  }
+
+  // The error of a byte that is not sent out is left to each path
+  memset(error, 0, sizeof(error));
+  memset(ref_error, 0, sizeof(ref_error));
+  for (unsigned frame = 0; frame < 4; frame++) {
+    for (uint32_t i = 0; i < 4 * num_pixels; i++)
+      deep[i] = i % 16 == 5 ? 0xFFFF : rand();
+    color_dither(color, out, deep, error, num_pixels);
+    for (uint32_t i = 0; i < num_pixels; i++)
+      color_dither(color, &ref[i], &deep[4 * i], &ref_error[4 * i], 1);
+    if (memcmp(out, ref, sizeof(out))) {
+      printf("%s: color_dither() differs from the scalar path\n", name);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(void) {
+  const uint8_t gains[3] = {255, 255, 255};
+  const uint8_t warm[3] = {255, 200, 120};
+  struct {
+    const char *name;
+    uint8_t brightness;
+    const uint8_t *gains;
+    float gamma;
+    const char *order;
+    int white;
+  } checks[] = {
+      {"brightness", 128, gains, 1, COLOR_ORDER_DEFAULT, 0},
+      {"gains", 255, warm, 1, "RGB", 0},
+      {"RGBW", 200, warm, 1, "GRBW", 0},
+      {"RGBW, white extraction", 200, warm, 1, "WGRB", 1},
+      {"gamma", 128, warm, 2.2, "BGR", 0},
+      {"gamma, white extraction", 255, gains, 2.2, "GRBW", 1},
+  };
+
+  if (!check_color("no correction", NULL))
+    return EXIT_FAILURE;
+  for (const auto &c : checks) {
+    color_t *const color =
+        color_init(c.brightness, c.gains, c.gamma, c.order, c.white);
+    const bool ok = check_color(c.name, color);
+    color_free(color);
+    if (!ok)
+      return EXIT_FAILURE;
+  }
+  printf("Color correction and dithering match the scalar path\n");
+
+  strip = new PixelBone_Pixel(num_pixels);
+
+  printf("Writing straight to the DDR:\n");
+  bench_all();
+
+  printf("Through a shadow buffer:\n");
+  strip->setShadowBuffer(true);
+  shadowed = true;
+  bench_all();
+
+  printf("Color correction of the copy to the DDR:\n");
+  bench("none", [] {});
+  strip->setBrightness(128);
+  bench("brightness", [] {});
+  strip->setGamma(2.2);
+  bench("brightness and gamma", [] {});
+  strip->setGamma(1);
+  strip->setBrightness(255);
+  strip->setColorOrder("GRBW");
+  bench("RGBW", [] {});
+  strip->setWhiteExtraction(true);
+  bench("RGBW, white extraction", [] {});
+
+  printf("Dithering 16 bits per color:\n");
+  static uint16_t deep[4 * num_pixels];
+  static uint8_t error[4 * num_pixels];
+  static uint32_t out[num_pixels];
+  for (uint32_t i = 0; i < 4 * num_pixels; i++)
+    deep[i] = rand();
+
+  color_t *const gamma = color_init(128, gains, 2.2, COLOR_ORDER_DEFAULT, 0);
+  shadowed = false;
+  bench("dither", [] { color_dither(NULL, out, deep, error, num_pixels); });
+  bench("dither with gamma",
+        [gamma] { color_dither(gamma, out, deep, error, num_pixels); });
+  color_free(gamma);
+
+  delete strip;
+  return EXIT_SUCCESS;
+}
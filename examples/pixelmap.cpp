@@ -0,0 +1,67 @@
+/** \file
+ * Light an irregular fixture through a pixel map.
+ *
+ * pixelmap MAP shows a rainbow that scrolls across a 64x64 canvas,
+ * sampled at the position of each LED in the map.  The strips are as long
+ * as the largest index in the map, split across as many channels as it
+ * takes to keep each under 65536 pixels.
+ *
+ * pixelmap MAP OUT saves the map in the binary form instead, for the
+ * map to be mapped straight into memory from then on.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+#include "../pixel.hpp"
+#include "../pixelmap.h"
+
+static const uint32_t canvas_size = 64;
+
+int main(int argc, char **argv) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s MAP [OUT]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  pixelmap_t *const map = pixelmap_open(argv[1]);
+  const pixelmap_header_t *const header = map->header;
+  printf("%s: %u LEDs on %ux%ux%u, indices up to %u\n", argv[1],
+         header->num_leds, header->width, header->height, header->depth,
+         header->num_indices);
+
+  if (argc == 3) {
+    pixelmap_save(map, argv[2]);
+    pixelmap_free(map);
+    return EXIT_SUCCESS;
+  }
+
+  const uint32_t num_indices = header->num_indices;
+  if (!num_indices)
+    return EXIT_SUCCESS;
+  const uint32_t channels = (num_indices + 65534) / 65535;
+  const uint32_t stride = (num_indices + channels - 1) / channels;
+  if (channels > 32)
+    die("%u pixels will not fit on 32 channels\n", num_indices);
+  PixelBone_Pixel *const strips =
+      new PixelBone_Pixel(stride, channels, stride);
+
+  std::vector<uint32_t> canvas(canvas_size * canvas_size);
+  std::vector<uint32_t> colors(num_indices);
+  for (uint32_t frame = 0;; frame++) {
+    for (uint32_t y = 0; y < canvas_size; y++)
+      for (uint32_t x = 0; x < canvas_size; x++)
+        canvas[y * canvas_size + x] = PixelBone_Pixel::HSL(
+            (x + y + frame) * 6 % 360, 100, 20);
+
+    pixelmap_sample(map, canvas.data(), canvas_size, canvas_size,
+                    colors.data());
+    strips->setPixels(0, colors.data(), num_indices);
+    strips->show();
+    strips->moveToNextBuffer();
+  }
+
+  delete strips;
+  pixelmap_free(map);
+  return EXIT_SUCCESS;
+}
@@ -33,84 +33,24 @@ const uint8_t dim_curve[] = {
   255,
 };
 
-void HSBtoRGB(int hue, int sat, int val, uint8_t out[]) {
-  /* convert hue, saturation and brightness ( HSB/HSV ) to RGB
-     The dim_curve is used only on brightness/value and on saturation
-     (inverted).
-     This looks the most natural.
-  */
-
-  val = dim_curve[val];
-  sat = 255 - dim_curve[255 - sat];
-
-  int r;
-  int g;
-  int b;
-  int base;
-
-  if (sat == 0) { // Acromatic color (gray). Hue doesn't mind.
-    r = g = b = val;
-  } else {
-    base = ((255 - sat) * val) >> 8;
-
-    switch ((hue % 360) / 60) {
-    case 0:
-      r = val;
-      g = (((val - base) * hue) / 60) + base;
-      b = base;
-      break;
-
-    case 1:
-      r = (((val - base) * (60 - (hue % 60))) / 60) + base;
-      g = val;
-      b = base;
-      break;
-
-    case 2:
-      r = base;
-      g = val;
-      b = (((val - base) * (hue % 60)) / 60) + base;
-      break;
-
-    case 3:
-      r = base;
-      g = (((val - base) * (60 - (hue % 60))) / 60) + base;
-      b = val;
-      break;
-
-    case 4:
-      r = (((val - base) * (hue % 60)) / 60) + base;
-      g = base;
-      b = val;
-      break;
-
-    case 5:
-      r = val;
-      g = base;
-      b = (((val - base) * (60 - (hue % 60))) / 60) + base;
-      break;
-    }
-
-    out[0] = r;
-    out[1] = g;
-    out[2] = b;
-  }
-}
-
 int main(void) {
   const int num_pixels = 512;
   PixelBone_Pixel *const strip = new PixelBone_Pixel(num_pixels);
   time_t last_time = time(NULL);
   unsigned last_i = 0;
   unsigned i = 0;
-  uint8_t rgb[3];
+  uint16_t hue[num_pixels];
+  uint8_t sat[num_pixels], val[num_pixels];
 
-  while (1) {
-    for (unsigned p = 0; p < num_pixels; p++) {
-      HSBtoRGB(((i + (p * 360) / num_pixels) % 360), 100, 219, rgb);
+  // The dim_curve is used only on brightness/value and on saturation
+  // (inverted).  This looks the most natural.
+  memset(sat, 255 - dim_curve[255 - 100], sizeof(sat));
+  memset(val, dim_curve[219], sizeof(val));
 
-      strip->setPixelColor(p, rgb[0], rgb[1], rgb[2]);
-    }
+  while (1) {
+    for (unsigned p = 0; p < num_pixels; p++)
+      hue[p] = (i + (p * 360) / num_pixels) % 360;
+    strip->setPixelsHSV(0, hue, sat, val, num_pixels);
 
     // wait for the previous frame to finish;
     const uint32_t response = strip->wait();
@@ -470,6 +470,6 @@ int16_t PixelBone_GFX::width(void) { return _width; }
 
 int16_t PixelBone_GFX::height(void) { return _height; }
 
-void PixelBone_GFX::invertDisplay(bool i) {
+void PixelBone_GFX::invertDisplay(bool) {
   // Do nothing, must be subclassed if supported
 }
@@ -15,6 +15,7 @@ class PixelBone_GFX {
 
 public:
   PixelBone_GFX(int16_t w, int16_t h); // Constructor
+  virtual ~PixelBone_GFX() {}
 
   // This MUST be defined by the subclass:
   virtual void drawPixel(int16_t x, int16_t y, uint32_t color) = 0;
@@ -56,7 +57,7 @@ public:
   void setTextColor(uint32_t color, uint32_t bg);
   void setTextSize(uint8_t s);
   void setTextWrap(bool w);
-  void setRotation(uint8_t r);
+  virtual void setRotation(uint8_t r);
 
   void print(const std::string &s);
   void print(const char str[]);
@@ -31,25 +31,31 @@
 
 #include "matrix.hpp"
 #include "gamma.h"
+#include <cstdlib>
 #define pgm_read_byte(addr) (*(const unsigned char *)(addr))
 
 // Constructor for single matrix:
 PixelBone_Matrix::PixelBone_Matrix(int w, int h, uint8_t matrixType)
     : PixelBone_GFX(w, h), PixelBone_Pixel(w * h), type(matrixType),
-      matrixWidth(w), matrixHeight(h), tilesX(0), tilesY(0), remapFn(NULL) {}
+      matrixWidth(w), matrixHeight(h), tilesX(0), tilesY(0), remapFn(NULL),
+      pixelMap(NULL), lut(NULL), lutPixels(NULL) {}
 
 // Constructor for tiled matrices:
 PixelBone_Matrix::PixelBone_Matrix(uint8_t mW, uint8_t mH, uint8_t tX,
                                    uint8_t tY, uint8_t matrixType)
     : PixelBone_GFX(mW * tX, mH * tY), PixelBone_Pixel(mW * mH * tX * tY),
       type(matrixType), matrixWidth(mW), matrixHeight(mH), tilesX(tX),
-      tilesY(tY), remapFn(NULL) {}
+      tilesY(tY), remapFn(NULL), pixelMap(NULL), lut(NULL), lutPixels(NULL) {}
+
+PixelBone_Matrix::~PixelBone_Matrix() { free(lut); }
 
 
 int PixelBone_Matrix::getOffset(int16_t x, int16_t y) {
 
   if ((x < 0) || (y < 0) || (x >= _width) || (y >= _height))
     return -1;
+  if (lut)
+    return lut[y * _width + x];
 
   int16_t t;
   switch (rotation) {
@@ -69,117 +75,312 @@ int PixelBone_Matrix::getOffset(int16_t x, int16_t y) {
     break;
   }
 
-  int tileOffset = 0, pixelOffset;
+  if (remapFn) // Custom X/Y remapping function
+    return (*remapFn)(x, y);
+  if (pixelMap) { // Irregular fixture, with no LED at some positions
+    const uint32_t index = pixelmap_find(pixelMap, x, y);
+    return index == PIXELMAP_NONE ? -1 : (int)index;
+  }
 
-  if (remapFn) { // Custom X/Y remapping function
-    pixelOffset = (*remapFn)(x, y);
-  } else { // Standard single matrix or tiled matrices
+  // Standard single matrix or tiled matrices
+  return matrix_offset(x, y, type, matrixWidth, matrixHeight, tilesX, tilesY);
+}
 
-    uint8_t corner = type & MATRIX_CORNER;
-    uint16_t minor, major, majorScale;
+void PixelBone_Matrix::drawPixel(int16_t x, int16_t y, uint32_t color) {
+  setPixelColor(getOffset(x,y), color);
+}
 
-    if (tilesX) { // Tiled display, multiple matrices
-      uint16_t tile;
+// Read a pixel back as a 565 color, or 0 where there is no LED.  Going
+// through PixelBone_Pixel::getPixelColor() bounds checks the offset and
+// reads the 16 bit buffer in high precision mode.
+uint16_t PixelBone_Matrix::getPixelColor(int16_t x, int16_t y) {
+  const int offset = getOffset(x, y);
+  if (offset < 0)
+    return 0;
 
-      minor = x / matrixWidth;           // Tile # X/Y; presume row major to
-      major = y / matrixHeight,          // start (will swap later if needed)
-          x = x - (minor * matrixWidth); // Pixel X/Y within tile
-      y = y - (major * matrixHeight);    // (-* is less math than modulo)
+  const uint32_t c = PixelBone_Pixel::getPixelColor(offset);
+  return (c >> 8 & 0xF800) | (c >> 5 & 0x07E0) | (c >> 3 & 0x001F);
+}
 
-      // Determine corner of entry, flip axes if needed
-      if (type & TILE_RIGHT)
-        minor = tilesX - 1 - minor;
-      if (type & TILE_BOTTOM)
-        major = tilesY - 1 - major;
+// Map len pixels from (x, y) on in the direction (dx, dy), which is one
+// pixel along either axis, to runs of offsets.  The line has already been
+// clipped.  Within a tile the offsets of a line step by the same amount
+// each pixel, or alternate between two steps where the line crosses
+// zigzag rows, so only the first three pixels in each tile need
+// getOffset().  Each run is passed to segment() as the index of its first
+// pixel along the line, its first offset, its length and its two steps.
+template <typename Segment>
+void PixelBone_Matrix::mapSpan(int16_t x, int16_t y, int16_t dx, int16_t dy,
+                               int16_t len, Segment segment) {
+  if (remapFn || pixelMap) {
+    for (int16_t i = 0; i < len; i++, x += dx, y += dy)
+      segment(i, getOffset(x, y), 1, 0, 0);
+    return;
+  }
 
-      // Determine actual major axis of tiling
-      if ((type & TILE_AXIS) == TILE_ROWS) {
-        majorScale = tilesX;
-      } else {
-        swap(major, minor);
-        majorScale = tilesY;
-      }
+  // Position and direction of the line on the unrotated display
+  int16_t px = x, py = y, pdx = dx, pdy = dy;
+  switch (rotation) {
+  case 1:
+    px = WIDTH - 1 - y;
+    py = x;
+    pdx = -dy;
+    pdy = dx;
+    break;
+  case 2:
+    px = WIDTH - 1 - x;
+    py = HEIGHT - 1 - y;
+    pdx = -dx;
+    pdy = -dy;
+    break;
+  case 3:
+    px = y;
+    py = HEIGHT - 1 - x;
+    pdx = dy;
+    pdy = -dx;
+    break;
+  }
 
-      // Determine tile number
-      if ((type & TILE_SEQUENCE) == TILE_PROGRESSIVE) {
-        // All tiles in same order
-        tile = major * majorScale + minor;
-      } else {
-        // Zigzag; alternate rows change direction.  On these rows,
-        // this also flips the starting corner of the matrix for the
-        // pixel math later.
-        if (major & 1) {
-          corner ^= MATRIX_CORNER;
-          tile = (major + 1) * majorScale - 1 - minor;
-        } else {
-          tile = major * majorScale + minor;
-        }
-      }
+  for (int16_t i = 0; i < len;) {
+    // Pixels left before the line leaves this tile
+    const int16_t pos = pdx ? px : py;
+    const int16_t size = pdx ? matrixWidth : matrixHeight;
+    int16_t n = (pdx + pdy) > 0 ? size - pos % size : pos % size + 1;
+    if (n > len - i)
+      n = len - i;
+
+    const int first = getOffset(x, y);
+    const int step0 = n > 1 ? getOffset(x + dx, y + dy) - first : 0;
+    const int step1 =
+        n > 2 ? getOffset(x + 2 * dx, y + 2 * dy) - first - step0 : step0;
+    segment(i, first, n, step0, step1);
+
+    x += n * dx;
+    y += n * dy;
+    px += n * pdx;
+    py += n * pdy;
+    i += n;
+  }
+}
 
-      // Index of first pixel in tile
-      tileOffset = tile * matrixWidth * matrixHeight;
+void PixelBone_Matrix::drawSpan(int16_t x, int16_t y, int16_t dx, int16_t dy,
+                                int16_t len, uint32_t color) {
+  mapSpan(x, y, dx, dy, len,
+          [&](int16_t, int first, int16_t n, int step0, int step1) {
+            if (step0 == step1 && (step0 == 1 || step0 == -1)) {
+              fill(step0 > 0 ? first : first - (n - 1), n, color);
+              return;
+            }
+            int offset = first;
+            for (int16_t i = 0; i < n; i++) {
+              setPixelColor(offset, color);
+              offset += i & 1 ? step1 : step0;
+            }
+          });
+}
 
-    } // else no tiling (handle as single tile)
+/** Draw a w by h image with its top left at (x, y), clipped to the
+ * display.  Each row of the image starts stride colors after the last,
+ * and each color is ANDed with mask.
+ *
+ * With the lookup table on, an image of the whole display goes in with
+ * one pass along the strip, each pixel reading its color through the
+ * table.  Otherwise it is copied a line at a time along whichever of the
+ * rows and columns runs along the strips.  Each tile's worth of a line is
+ * mapped once and goes in with setPixels(), reversed first if it runs
+ * backwards.
+ */
+void PixelBone_Matrix::drawImage(int16_t x, int16_t y, const uint32_t *image,
+                                 int16_t w, int16_t h, size_t stride,
+                                 uint32_t mask) {
+  // The top byte of a color is ignored anyway
+  if (lut && x == 0 && y == 0 && w == _width && h == _height &&
+      stride == (size_t)_width && (mask | 0xFF000000) == 0xFFFFFFFF) {
+    setPixels(0, image, lutPixels, numPixels());
+    return;
+  }
 
-    // Find pixel number within tile
-    minor = x; // Presume row major to start (will swap later if needed)
-    major = y;
+  if (x < 0) {
+    image -= x;
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    image -= y * stride;
+    h += y;
+    y = 0;
+  }
+  if (w > _width - x)
+    w = _width - x;
+  if (h > _height - y)
+    h = _height - y;
+  if (w <= 0 || h <= 0)
+    return;
+
+  const bool strip_rows = (type & MATRIX_AXIS) == MATRIX_ROWS;
+  const bool rows = strip_rows == !(rotation & 1);
+  const size_t along = rows ? 1 : stride, across = rows ? stride : 1;
+
+  for (int16_t k = 0; k < (rows ? h : w); k++) {
+    const uint32_t *const line = image + k * across;
+    const auto segment = [&](int16_t i, int first, int16_t n, int step0,
+                             int step1) {
+      const uint32_t *const colors = line + i * along;
+      if (step0 == step1 && (step0 == 1 || step0 == -1)) {
+        // No more than the width or height of a tile
+        uint32_t run[256];
+        for (int16_t j = 0; j < n; j++)
+          run[step0 > 0 ? j : n - 1 - j] = colors[j * along] & mask;
+        setPixels(step0 > 0 ? first : first - (n - 1), run, n);
+        return;
+      }
+      int offset = first;
+      for (int16_t j = 0; j < n; j++) {
+        setPixelColor(offset, colors[j * along] & mask);
+        offset += j & 1 ? step1 : step0;
+      }
+    };
+    if (rows)
+      mapSpan(x, y + k, 1, 0, w, segment);
+    else
+      mapSpan(x + k, y, 0, 1, h, segment);
+  }
+}
 
-    // Determine corner of entry, flip axes if needed
-    if (corner & MATRIX_RIGHT)
-      minor = matrixWidth - 1 - minor;
-    if (corner & MATRIX_BOTTOM)
-      major = matrixHeight - 1 - major;
+void PixelBone_Matrix::drawFastHLine(int16_t x, int16_t y, int16_t w,
+                                     uint32_t color) {
+  if (y < 0 || y >= _height)
+    return;
+  if (x < 0) {
+    w += x;
+    x = 0;
+  }
+  if (w > _width - x)
+    w = _width - x;
+  if (w > 0)
+    drawSpan(x, y, 1, 0, w, color);
+}
 
-    // Determine actual major axis of matrix
-    if ((type & MATRIX_AXIS) == MATRIX_ROWS) {
-      majorScale = matrixWidth;
-    } else {
-      swap(major, minor);
-      majorScale = matrixHeight;
-    }
+void PixelBone_Matrix::drawFastVLine(int16_t x, int16_t y, int16_t h,
+                                     uint32_t color) {
+  if (x < 0 || x >= _width)
+    return;
+  if (y < 0) {
+    h += y;
+    y = 0;
+  }
+  if (h > _height - y)
+    h = _height - y;
+  if (h > 0)
+    drawSpan(x, y, 0, 1, h, color);
+}
 
-    // Determine pixel number within tile/matrix
-    if ((type & MATRIX_SEQUENCE) == MATRIX_PROGRESSIVE) {
-      // All lines in same order
-      pixelOffset = major * majorScale + minor;
-    } else {
-      // Zigzag; alternate rows change direction.
-      if (major & 1)
-        pixelOffset = (major + 1) * majorScale - 1 - minor;
-      else
-        pixelOffset = major * majorScale + minor;
-    }
+void PixelBone_Matrix::fillRect(int16_t x, int16_t y, int16_t w, int16_t h,
+                                uint32_t color) {
+  if (x < 0) {
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    h += y;
+    y = 0;
+  }
+  if (w > _width - x)
+    w = _width - x;
+  if (h > _height - y)
+    h = _height - y;
+  if (w <= 0 || h <= 0)
+    return;
+
+  // Fill along whichever of the rows and columns runs along the strips,
+  // where the pixels of each line are next to each other in the buffer
+  const bool strip_rows = (type & MATRIX_AXIS) == MATRIX_ROWS;
+  if (strip_rows == !(rotation & 1)) {
+    for (int16_t i = 0; i < h; i++)
+      drawSpan(x, y + i, 1, 0, w, color);
+  } else {
+    for (int16_t i = 0; i < w; i++)
+      drawSpan(x + i, y, 0, 1, h, color);
   }
-  int offset = (tileOffset + pixelOffset);
-  return offset;
 }
 
-void PixelBone_Matrix::drawPixel(int16_t x, int16_t y, uint32_t color) {
-  setPixelColor(getOffset(x,y), color);
+void PixelBone_Matrix::fillScreen(uint32_t color) {
+  if (remapFn || pixelMap) {
+    fillRect(0, 0, _width, _height, color);
+    return;
+  }
+
+  fill(0, numPixels(), color);
 }
 
-uint16_t PixelBone_Matrix::getPixelColor(int16_t x, int16_t y) {
-  // uint32_t color = expandColor(PixelBone_Pixel::getPixelColor(getOffset(x,y)));
-  // uint8_t r = (uint8_t) (color & 0xFF);         // first 8 bits
-  // uint8_t g = (uint8_t) ((color >> 8) & 0xFF);  // second 8 bits
-  // uint8_t b = (uint8_t) ((color >> 16) & 0xFF); // third 8 bits 
+void PixelBone_Matrix::setRemapFunction(uint16_t (*fn)(uint16_t, uint16_t)) {
+  remapFn = fn;
+  buildLookupTable();
+}
 
-  pixel_t *const p = PixelBone_Pixel::getPixel(getOffset(x,y));
-  // printf("Red color: 0x%x\n", p->r);
-  // printf("Green color: 0x%x\n", p->g);
-  // printf("Blue color: 0x%x\n", p->b);
+/** Draw through a map of the LEDs of an irregular fixture, such as one
+ * from pixelmap_open(), which must outlive the matrix.
+ *
+ * The map is in the coordinates of the unrotated display, and drawing
+ * where it has no LED does nothing.  NULL goes back to the layout that
+ * the matrix was constructed with.
+ */
+void PixelBone_Matrix::setPixelMap(const pixelmap_t *map) {
+  pixelMap = map;
+  buildLookupTable();
+}
 
-  return PixelBone_Matrix::Color(p->r, p->g, p->b);
+void PixelBone_Matrix::setRotation(uint8_t r) {
+  PixelBone_GFX::setRotation(r);
+  buildLookupTable();
 }
 
-void PixelBone_Matrix::fillScreen(uint32_t color) {
-  uint32_t n = numPixels();
+/** Look up the offset of each pixel in a table instead of working it out.
+ *
+ * The table holds the offset of every (x, y) in the current rotation, so
+ * drawPixel() is one load after the bounds check however the matrix is
+ * tiled or remapped.  A second table holds the (x, y) of each pixel of the
+ * strip, so that drawImage() can copy a whole display image along the
+ * strip in one pass.  They take two bytes a pixel each and are rebuilt by
+ * setRotation() and setRemapFunction().
+ */
+void PixelBone_Matrix::setLookupTable(bool enable) {
+  free(lut);
+  lut = lutPixels = NULL;
+  if (!enable)
+    return;
+
+  if (WIDTH * HEIGHT >= 0xFFFF || numPixels() >= 0xFFFF)
+    die("The lookup table only goes up to %u pixels\n", 0xFFFF);
+  lut = (uint16_t *)malloc((WIDTH * HEIGHT + numPixels()) * sizeof(*lut));
+  if (!lut)
+    die("Unable to allocate the lookup table for %dx%d pixels\n", WIDTH,
+        HEIGHT);
+  lutPixels = lut + WIDTH * HEIGHT;
+  buildLookupTable();
+}
 
-  for (uint32_t i = 0; i < n; i++)
-    setPixelColor(i, color);
+size_t PixelBone_Matrix::lookupTableBytes() const {
+  return lut ? (WIDTH * HEIGHT + numPixels()) * sizeof(*lut) : 0;
 }
 
-void PixelBone_Matrix::setRemapFunction(uint16_t (*fn)(uint16_t, uint16_t)) {
-  remapFn = fn;
+void PixelBone_Matrix::buildLookupTable() {
+  if (!lut)
+    return;
+
+  // Fill it in with the table out of the way of getOffset().  Pixels that
+  // are off the strip become 0xFFFF, which is past the end of any strip.
+  uint16_t *const table = lut;
+  lut = NULL;
+  for (uint32_t i = 0; i < numPixels(); i++)
+    lutPixels[i] = 0xFFFF;
+  for (int16_t y = 0; y < _height; y++)
+    for (int16_t x = 0; x < _width; x++) {
+      const int offset = getOffset(x, y);
+      const bool on = offset >= 0 && (uint32_t)offset < numPixels();
+      table[y * _width + x] = on ? offset : 0xFFFF;
+      if (on)
+        lutPixels[offset] = y * _width + x;
+    }
+  lut = table;
 }
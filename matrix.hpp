@@ -22,6 +22,7 @@
 
 #include "gfx.hpp"
 #include "pixel.hpp"
+#include "pixelmap.h"
 
 // Matrix layout information is passed in the 'matrixType' parameter for
 // each constructor (the parameter immediately following is the LED type
@@ -57,6 +58,93 @@
 #define TILE_ZIGZAG 0x80      // Tile order reverses between lines
 #define TILE_SEQUENCE 0x80    // Bitmask for tile line order
 
+// Offset of pixel (x, y) of the unrotated display in the strip.  Inline so
+// that with a layout known at compile time, as in PixelBone_FixedMatrix,
+// the compiler folds away the branches on the type and the divides by the
+// tile size.  A tile count of 0 is a single matrix.
+inline int matrix_offset(uint16_t x, uint16_t y, uint8_t type,
+                         uint8_t matrixWidth, uint8_t matrixHeight,
+                         uint8_t tilesX, uint8_t tilesY) {
+  int tileOffset = 0, pixelOffset;
+  uint8_t corner = type & MATRIX_CORNER;
+  uint16_t minor, major, majorScale;
+
+  if (tilesX) { // Tiled display, multiple matrices
+    uint16_t tile;
+
+    minor = x / matrixWidth;           // Tile # X/Y; presume row major to
+    major = y / matrixHeight,          // start (will swap later if needed)
+        x = x - (minor * matrixWidth); // Pixel X/Y within tile
+    y = y - (major * matrixHeight);    // (-* is less math than modulo)
+
+    // Determine corner of entry, flip axes if needed
+    if (type & TILE_RIGHT)
+      minor = tilesX - 1 - minor;
+    if (type & TILE_BOTTOM)
+      major = tilesY - 1 - major;
+
+    // Determine actual major axis of tiling
+    if ((type & TILE_AXIS) == TILE_ROWS) {
+      majorScale = tilesX;
+    } else {
+      swap(major, minor);
+      majorScale = tilesY;
+    }
+
+    // Determine tile number
+    if ((type & TILE_SEQUENCE) == TILE_PROGRESSIVE) {
+      // All tiles in same order
+      tile = major * majorScale + minor;
+    } else {
+      // Zigzag; alternate rows change direction.  On these rows,
+      // this also flips the starting corner of the matrix for the
+      // pixel math later.
+      if (major & 1) {
+        corner ^= MATRIX_CORNER;
+        tile = (major + 1) * majorScale - 1 - minor;
+      } else {
+        tile = major * majorScale + minor;
+      }
+    }
+
+    // Index of first pixel in tile
+    tileOffset = tile * matrixWidth * matrixHeight;
+
+  } // else no tiling (handle as single tile)
+
+  // Find pixel number within tile
+  minor = x; // Presume row major to start (will swap later if needed)
+  major = y;
+
+  // Determine corner of entry, flip axes if needed
+  if (corner & MATRIX_RIGHT)
+    minor = matrixWidth - 1 - minor;
+  if (corner & MATRIX_BOTTOM)
+    major = matrixHeight - 1 - major;
+
+  // Determine actual major axis of matrix
+  if ((type & MATRIX_AXIS) == MATRIX_ROWS) {
+    majorScale = matrixWidth;
+  } else {
+    swap(major, minor);
+    majorScale = matrixHeight;
+  }
+
+  // Determine pixel number within tile/matrix
+  if ((type & MATRIX_SEQUENCE) == MATRIX_PROGRESSIVE) {
+    // All lines in same order
+    pixelOffset = major * majorScale + minor;
+  } else {
+    // Zigzag; alternate rows change direction.
+    if (major & 1)
+      pixelOffset = (major + 1) * majorScale - 1 - minor;
+    else
+      pixelOffset = major * majorScale + minor;
+  }
+
+  return tileOffset + pixelOffset;
+}
+
  class PixelBone_Matrix : public PixelBone_GFX, public PixelBone_Pixel {
 
 public:
@@ -68,18 +156,87 @@ public:
   PixelBone_Matrix(uint8_t matrixW, uint8_t matrixH, uint8_t tX, uint8_t tY,
                    uint8_t matrixType = MATRIX_TOP + MATRIX_LEFT + MATRIX_ROWS +
                                         TILE_TOP + TILE_LEFT + TILE_ROWS);
+  ~PixelBone_Matrix();
 
   void drawPixel(int16_t x, int16_t y, uint32_t color);
   uint16_t getPixelColor(int16_t x, int16_t y);
+  void drawFastHLine(int16_t x, int16_t y, int16_t w, uint32_t color);
+  void drawFastVLine(int16_t x, int16_t y, int16_t h, uint32_t color);
+  void fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint32_t color);
   void fillScreen(uint32_t color);
+  void drawImage(int16_t x, int16_t y, const uint32_t *image, int16_t w,
+                 int16_t h, size_t stride, uint32_t mask = 0xFFFFFFFF);
   void setRemapFunction(uint16_t (*fn)(uint16_t, uint16_t));
+  void setPixelMap(const pixelmap_t *map);
+  void setRotation(uint8_t r);
+  void setLookupTable(bool enable);
+  size_t lookupTableBytes() const;
 
 
-private:
+protected:
   const uint8_t type;
   const uint8_t matrixWidth, matrixHeight, tilesX, tilesY;
   uint16_t (*remapFn)(uint16_t x, uint16_t y);
+  const pixelmap_t *pixelMap;
+  uint16_t *lut;
+  uint16_t *lutPixels;
+
+private:
   int getOffset(int16_t x, int16_t y);
+  template <typename Segment>
+  void mapSpan(int16_t x, int16_t y, int16_t dx, int16_t dy, int16_t len,
+               Segment segment);
+  void drawSpan(int16_t x, int16_t y, int16_t dx, int16_t dy, int16_t len,
+                uint32_t color);
+  void buildLookupTable();
+};
+
+// A matrix whose layout is fixed when it is compiled, for the usual case
+// of a display that is built one way.  drawPixel() works out the offset
+// with the layout as constants, so the only branches left are on the
+// bounds and the rotation.  A remap function, pixel map or lookup table
+// still works as on any other matrix.
+template <uint8_t MatrixW, uint8_t MatrixH, uint8_t Type, uint8_t TilesX = 0,
+          uint8_t TilesY = 0>
+class PixelBone_FixedMatrix final : public PixelBone_Matrix {
+
+public:
+  PixelBone_FixedMatrix()
+      : PixelBone_Matrix(MatrixW, MatrixH, TilesX ? TilesX : 1,
+                         TilesY ? TilesY : 1, Type) {}
+
+  // Offset of pixel (x, y) of the unrotated display
+  static int offset(uint16_t x, uint16_t y) {
+    return matrix_offset(x, y, Type, MatrixW, MatrixH, TilesX, TilesY);
+  }
+
+  void drawPixel(int16_t x, int16_t y, uint32_t color) {
+    if (remapFn || pixelMap || lut) {
+      PixelBone_Matrix::drawPixel(x, y, color);
+      return;
+    }
+    if ((x < 0) || (y < 0) || (x >= _width) || (y >= _height))
+      return;
+
+    int16_t t;
+    switch (rotation) {
+    case 1:
+      t = x;
+      x = WIDTH - 1 - y;
+      y = t;
+      break;
+    case 2:
+      x = WIDTH - 1 - x;
+      y = HEIGHT - 1 - y;
+      break;
+    case 3:
+      t = x;
+      x = y;
+      y = HEIGHT - 1 - t;
+      break;
+    }
+    setPixelColor(offset(x, y), color);
+  }
 };
 
 #endif // _MATRIX_HPP_
@@ -1,24 +1,218 @@
 #include "pixel.hpp"
+#include "ws281x_soft.hpp"
 #include <iostream>
 #include <cstring>
+#include <ctime>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <sys/socket.h>
+#include <netdb.h>
 
-/* GPIO pins used */
-static const uint8_t gpios0 = 2;
+/* GPIO bank and pin used by each channel.
+ *
+ * Changing this requires changes in ws281x.p
+ */
+const ws281x_pin_t ws281x_pins[WS281X_MAX_CHANNELS] = {
+    {0, 2},  {0, 3},  {0, 4},  {0, 5},  {0, 7},  {0, 14}, {0, 15}, {0, 20},
+    {0, 22}, {0, 23}, {0, 26}, {0, 27}, {0, 30}, {0, 31}, {1, 12}, {1, 13},
+    {1, 14}, {1, 15}, {1, 16}, {1, 17}, {1, 18}, {1, 19}, {1, 28}, {1, 29},
+    {2, 1},  {2, 2},  {2, 3},  {2, 4},  {2, 5},  {3, 14}, {3, 15}, {3, 16},
+};
+
+/* Nominal timing of the supported LED types.
+ *
+ * The overclocked profile shortens every part of the bit and is only for
+ * short chains that have been seen to cope with it.
+ */
+const ws281x_profile_t ws281x_profiles[WS281X_NUM_PROFILES] = {
+    {"WS2811 400KHz", 500, 1200, 2500, 50000},
+    {"WS2812", 400, 800, 1250, 50000},
+    {"SK6812", 300, 600, 1250, 80000},
+    {"1MHz overclock", 250, 550, 1000, 50000},
+};
+
+/* Bytes in each block of a frame buffer that setDirtyTracking() follows,
+ * a cache line on the Cortex-A8.
+ */
+static const size_t dirty_block = 64;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(const uint64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000ull;
+  ts.tv_nsec = ns % 1000000000ull;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+static void set_bits(uint32_t *const map, uint32_t first, const uint32_t last) {
+  for (; first <= last; first++)
+    map[first / 32] |= 1u << (first % 32);
+}
+
+/* Copy the blocks of a buffer of size bytes that are set in map, color
+ * correcting them on the way if color is set.
+ *
+ * \return the number of bytes copied.
+ */
+static size_t copy_blocks(uint8_t *const dst, const uint8_t *const src,
+                          const uint32_t *const map, const size_t size,
+                          const color_t *const color) {
+  const size_t blocks = (size + dirty_block - 1) / dirty_block;
+  size_t copied = 0;
+  size_t b = 0;
+
+  while (b < blocks) {
+    if (!map[b / 32]) {
+      b = (b / 32 + 1) * 32;
+      continue;
+    }
+    if (!(map[b / 32] & 1u << (b % 32))) {
+      b++;
+      continue;
+    }
+
+    // Copy each run of dirty blocks in one go
+    size_t end = b + 1;
+    while (end < blocks && map[end / 32] & 1u << (end % 32))
+      end++;
+
+    const size_t start = b * dirty_block;
+    const size_t len = std::min(end * dirty_block, size) - start;
+    if (color)
+      color_frame(color, (uint32_t *)(dst + start),
+                  (const uint32_t *)(src + start), len / sizeof(uint32_t));
+    else
+      memcpy(dst + start, src + start, len);
+    copied += len;
+    b = end;
+  }
+
+  return copied;
+}
+
+/** Lay out a frame of strips of the given lengths as runs of slots.
+ *
+ * Slot s holds a pixel for each channel up to the last one that is longer
+ * than s, so that a frame with the longer strips on the lower channels
+ * has no padding at all.  The runs of slots that send on the same channels
+ * and the pins in use are filled in, along with the word of slot s in
+ * slot_offset[s] if it is not NULL, and slot_offset[num_pixels] is the
+ * size of the frame.
+ *
+ * \return the number of 32-bit words in a frame.
+ */
+uint32_t ws281x_command_t::setLengths(const uint16_t *const lengths,
+                                      uint32_t *const slot_offset) {
+  uint32_t words = 0, slot = 0;
+  unsigned r = 0;
+
+  num_pixels = 0;
+  gpio_mask[0] = gpio_mask[1] = gpio_mask[2] = gpio_mask[3] = 0;
+  for (unsigned c = 0; c < num_channels; c++) {
+    num_pixels = std::max(num_pixels, (uint32_t)lengths[c]);
+    gpio_mask[ws281x_pins[c].gpio] |= 1u << ws281x_pins[c].pin;
+  }
+
+  // A new run starts wherever a strip ends
+  while (slot < num_pixels) {
+    ws281x_run_t &run = runs[r++];
+    uint32_t end = num_pixels;
+
+    memset(&run, 0, sizeof(run));
+    run.offset = words * sizeof(uint32_t);
+    for (unsigned c = 0; c < num_channels; c++) {
+      if (lengths[c] <= slot)
+        continue;
+      end = std::min(end, (uint32_t)lengths[c]);
+      run.num_channels = c + 1;
+      run.gpio_mask[ws281x_pins[c].gpio] |= 1u << ws281x_pins[c].pin;
+    }
+
+    run.num_slots = end - slot;
+    for (; slot < end; slot++, words += run.num_channels)
+      if (slot_offset)
+        slot_offset[slot] = words;
+  }
+
+  memset(&runs[r], 0, sizeof(runs[r]));
+  if (slot_offset)
+    slot_offset[num_pixels] = words;
+  return words;
+}
 
 PixelBone_Pixel::PixelBone_Pixel(uint16_t pixel_count)
-    : pru0(pru_init(0)), num_pixels(pixel_count),
-      buffer_size(pixel_count * sizeof(pixel_t)) {
+    : PixelBone_Pixel(pixel_count, 1, pixel_count) {}
+
+/** Drive several strips in parallel.
+ *
+ * Each channel is pixel_count pixels long and channel c starts at pixel
+ * index c * channel_stride, so a stride larger than the pixel count leaves
+ * a gap of unused indices between the channels.
+ */
+PixelBone_Pixel::PixelBone_Pixel(uint16_t pixel_count, uint8_t channels,
+                                 uint16_t channel_stride)
+    : PixelBone_Pixel(std::vector<uint16_t>(channels, pixel_count).data(),
+                      channels, channel_stride) {}
+
+/** Drive strips of different lengths in parallel.
+ *
+ * Channel c is lengths[c] pixels long and starts at pixel index
+ * c * channel_stride, where a stride of 0 is the longest strip.  The
+ * frame time is that of the longest strip, and the shorter ones take no
+ * memory past their ends if they are on the higher channels.
+ */
+PixelBone_Pixel::PixelBone_Pixel(const uint16_t *lengths, uint8_t channels,
+                                 uint16_t channel_stride)
+    : pru0(pru_init(0)), num_pixels(0), num_channels(channels),
+      stride(channel_stride), slot_offset(NULL), buffer_size(0),
+      num_buffers(2), current_buffer_num(0), brightness(255), slicer(NULL),
+      pipelined(false), pru1(NULL),
+      fetch_slots(0), shadow(NULL), dirty_words(0), written(NULL),
+      behind(NULL), unflushed(NULL), copied_bytes(0),
+      frame_copied_bytes(0), gains{255, 255, 255}, gamma(1), color(NULL),
+      corrected(NULL), deep(NULL), dither_error(NULL),
+      color_order(COLOR_ORDER_DEFAULT), white_extraction(false),
+      frames_handed(0), telemetry_file(NULL), telemetry_socket(-1),
+      telemetry_interval(0), frame_callback(NULL), frame_callback_arg(NULL) {
+  if (channels < 1 || channels > WS281X_MAX_CHANNELS)
+    die("%u channels requested, only 1 to %u are supported\n", channels,
+        WS281X_MAX_CHANNELS);
+  for (unsigned c = 0; c < num_channels; c++) {
+    channel_length[c] = lengths[c];
+    num_pixels = std::max(num_pixels, (uint32_t)lengths[c]);
+  }
+  if (num_pixels < 1)
+    die("All %u channels have no pixels\n", channels);
+  if (!stride)
+    stride = num_pixels;
+  if (stride < num_pixels)
+    die("Channel stride %u is shorter than the %u pixel channels\n",
+        stride, num_pixels);
+
+  slot_offset = (uint32_t *)malloc((num_pixels + 1) * sizeof(*slot_offset));
+  if (!slot_offset)
+    die("Unable to allocate the offsets of %u slots\n", num_pixels);
+
+  ws281x = (ws281x_command_t *)pru0->data_ram;
+  *(ws281x) = ws281x_command_t(num_pixels, (unsigned)channels);
+  buffer_size = ws281x->setLengths(lengths, slot_offset) * sizeof(pixel_t);
   if (2 * buffer_size > pru0->ddr_size)
     die("Pixel data needs at least 2 * %zu, only %zu in DDR\n", buffer_size,
         pru0->ddr_size);
 
-  ws281x = (ws281x_command_t *)pru0->data_ram;
-  *(ws281x) = ws281x_command_t((unsigned)pixel_count);
-
   // Configure all of our output pins.
-  pru_gpio(0, gpios0, 1, 0);
+  for (unsigned c = 0; c < num_channels; c++)
+    pru_gpio(ws281x_pins[c].gpio, ws281x_pins[c].pin, 1, 0);
 
-  // Initiate the PRU0 program
+  // Initiate the PRU0 program, or its emulation on the software PRU
+  pru_soft_register("ws281x.bin", ws281x_emulate);
   pru_exec(pru0, "./ws281x.bin");
 
   // Watch for a done response that indicates a proper startup
@@ -27,37 +221,742 @@ PixelBone_Pixel::PixelBone_Pixel(uint16_t pixel_count)
   while (!ws281x->response)
     ;
   std::cout << "OK" << std::endl;
+
+  if (num_channels > WS281X_UNSLICED_CHANNELS)
+    setBitSlicing(true);
+  resetTelemetry();
 };
 
 PixelBone_Pixel::~PixelBone_Pixel() {
+  // Ask the PRU to exit and sleep until it has
+  drain();
+  setDualPru(false);
   ws281x->command = 0xFF;
+  while (ws281x->response != 0xFF)
+    pru_wait_event(pru0, -1);
+
   pru_close(pru0);
+  bitslice_free(slicer);
+  free(shadow);
+  freeDirty();
+  color_free(color);
+  free(corrected);
+  free(deep);
+  free(dither_error);
+  free(slot_offset);
+  setTelemetryExport(NULL, 0);
+}
+
+void PixelBone_Pixel::show(void) { showAt(0); }
+
+/** Show the current buffer, aiming for the LEDs to latch it at ns on
+ * CLOCK_MONOTONIC, or as soon as possible for 0.
+ *
+ * The frame is prepared straight away, then the calling thread sleeps
+ * until ns - frameTime() and only then hands it to the PRU, which starts
+ * on it within a few cycles.  So the latch is late by however long the
+ * scheduler takes to wake the thread, which is not bounded: on the build
+ * host clock_nanosleep() overslept by 0.3 ms on average and 11 ms at
+ * worst, and a real-time priority is needed for better.  The PRU adds a
+ * fraction of a percent of the frame time on top, as its bits run slightly
+ * longer than their nominal period.
+ *
+ * Frames that are still queued ahead of it or a fixed frame rate can hold
+ * it back further.  A frame that is already late goes out at once, as
+ * does one aimed within a frame time of the epoch of the clock, which
+ * has no start time to sleep until.
+ */
+void PixelBone_Pixel::showAt(uint64_t ns) {
+  const uint64_t start_ns = now_ns();
+  uint64_t ready_ns, prepared_ns;
+  bool blocked = false;
+  bool underrun = false;
+
+  if (ws281x->queue_depth) {
+    // Sleep until the PRU has released a slot in the queue.  The PRU has
+    // then also finished with the buffer that this frame will reuse.
+    const unsigned write = ws281x->queue_write;
+    const unsigned next = (write + 1) % ws281x->queue_depth;
+    while (next == ws281x->queue_read) {
+      pru_wait_event(pru0, -1);
+      blocked = true;
+    }
+
+    ready_ns = now_ns();
+    ws281x->queue[write] = prepareFrame();
+    prepared_ns = now_ns();
+    if (ns > frameTime())
+      sleep_until_ns(ns - frameTime());
+    __sync_synchronize();
+    ws281x->queue_write = next;
+  } else {
+    // Wait for any current command to have been acknowledged.  Until then
+    // the PRU may still be clocking out the frame that last used this
+    // buffer.  The PRU raises an interrupt when it takes a command.
+    while (ws281x->command) {
+      pru_wait_event(pru0, -1);
+      blocked = true;
+    }
+
+    ready_ns = now_ns();
+    const ws281x_frame_t frame = prepareFrame();
+    ws281x->pixels_dma = frame.pixels_dma;
+    ws281x->flags = frame.flags;
+    prepared_ns = now_ns();
+    if (ns > frameTime())
+      sleep_until_ns(ns - frameTime());
+
+    // The PRU queue counts its own underruns, but here the PRU has only
+    // run out if it has finished every frame that it was given and was
+    // not left idle on purpose
+    underrun = !ns && frames_handed && ws281x->frames_done == frames_handed;
+
+    // Send the start command
+    ws281x->command = 1;
+  }
+  frames_handed++;
+
+  // Time since the last show() that was not spent in wait()
+  const uint64_t end_ns = now_ns();
+  if (last_show_ns && start_ns - last_show_ns >= waited_ns)
+    stats_add(&render_stats, start_ns - last_show_ns - waited_ns);
+  stats_add(&prepare_stats, prepared_ns - ready_ns);
+  stats_add(&blocked_stats, ready_ns - start_ns + waited_ns);
+  counts.frames++;
+  if (blocked || waited_ns)
+    counts.blocked_frames++;
+  if (underrun)
+    counts.underruns++;
+  last_show_ns = end_ns;
+  waited_ns = 0;
+
+  pollFrames();
+  if (telemetry_interval && counts.frames % telemetry_interval == 0)
+    exportTelemetry();
+}
+
+/** Run any ARM side processing of the current buffer.
+ *
+ * \return the frame for the PRU to clock out.
+ */
+ws281x_frame_t PixelBone_Pixel::prepareFrame() {
+  uint8_t *const ddr = (uint8_t *)pru0->ddr;
+  const size_t frame_offset = buffer_size * current_buffer_num;
+  ws281x_frame_t frame;
+
+  if (slicer) {
+    // Each buffer has its sliced frame after all of the pixel frames
+    const size_t offset =
+        num_buffers * buffer_size + slicesSize() * current_buffer_num;
+
+    // The PRU only reads the slices, which can come straight from the
+    // shadow buffer without copying the pixels to DDR first.
+    const uint32_t *pixels = (const uint32_t *)bufferBytes(current_buffer_num);
+    if (deep) {
+      color_dither(color, corrected, deep, dither_error,
+                   buffer_size / sizeof(pixel_t));
+      pixels = corrected;
+    } else if (color) {
+      color_frame(color, corrected, pixels, buffer_size / sizeof(pixel_t));
+      pixels = corrected;
+    }
+
+    // Each run of slots only holds the channels still sending
+    uint8_t *out = ddr + offset;
+    for (const ws281x_run_t *run = ws281x->runs; run->num_slots; run++) {
+      bitslice_frame_channels(slicer, out, &pixels[run->offset / 4],
+                              run->num_slots, run->num_channels);
+      out += run->num_slots * BITSLICE_SLOT_SIZE(slicer->bits);
+    }
+    frame.pixels_dma = pru0->ddr_addr + offset;
+    frame.flags = WS281X_FLAG_SLICED;
+  } else {
+    // A high precision frame is quantised straight into the DDR
+    if (deep)
+      color_dither(color, (uint32_t *)(ddr + frame_offset), deep, dither_error,
+                   buffer_size / sizeof(pixel_t));
+    else
+      flush();
+    frame.pixels_dma = pru0->ddr_addr + frame_offset;
+    frame.flags = 0;
+  }
+
+  if (bitsPerPixel() == 32)
+    frame.flags |= WS281X_FLAG_32BIT;
+  if (pipelined)
+    frame.flags |= WS281X_FLAG_PIPELINED;
+  if (pru1) {
+    frame.flags |= WS281X_FLAG_FETCH;
+    fetch_slots += num_pixels;
+  }
+
+  return frame;
 }
 
-void PixelBone_Pixel::show(void) {
-  ws281x->pixels_dma = pru0->ddr_addr + buffer_size * current_buffer_num;
+/** Sleep until the PRU has clocked out everything it was given. */
+void PixelBone_Pixel::drain() {
+  while (ws281x->command || ws281x->queue_read != ws281x->queue_write)
+    pru_wait_event(pru0, -1);
+}
+
+/** Queue frames for the PRU instead of handing them over one at a time.
+ *
+ * The frame buffers become a ring of num_frames buffers.  show() adds the
+ * current buffer to a queue in the PRU data RAM that the PRU works through
+ * on its own, so the application can render up to num_frames - 1 frames
+ * ahead of the LEDs.  show() only sleeps when the queue is full.
+ * Passing 0 goes back to the two buffer handshake.
+ */
+void PixelBone_Pixel::setFrameQueue(unsigned num_frames) {
+  if (num_frames == 1 || num_frames > WS281X_QUEUE_MAX)
+    die("Frame queue of %u frames requested, only 2 to %u are supported\n",
+        num_frames, WS281X_QUEUE_MAX);
+
+  const unsigned buffers = num_frames ? num_frames : 2;
+  const size_t slices_size = slicesSize();
+  if (buffers * (buffer_size + slices_size) > pru0->ddr_size)
+    die("Frame queue needs at least %u * %zu, only %zu in DDR\n", buffers,
+        buffer_size + slices_size, pru0->ddr_size);
+
+  drain();
+  ws281x->queue_depth = 0;
+  ws281x->queue_read = ws281x->queue_write = 0;
+  num_buffers = buffers;
+  current_buffer_num = 0;
+  ws281x->queue_depth = num_frames;
+
+  if (shadow)
+    allocShadow();
+  if (written)
+    allocDirty();
+}
+
+/** Overlap the latch at the end of each frame with the start of the next.
+ *
+ * The PRU hands each frame back as soon as its last bit is out, so wait()
+ * returns and queue slots are freed at the start of the latch instead of
+ * the end.  A frame that is already queued or commanded by then has its
+ * first bit fetched during the latch and starts as soon as it is over.
+ */
+void PixelBone_Pixel::setPipelining(bool enable) { pipelined = enable; }
+
+/** Have PRU1 stream the frames from DDR into the PRU shared RAM.
+ *
+ * PRU0 then clocks every bit out of its fast local memory, so the DDR
+ * latency no longer eats into the bit timing however many channels there
+ * are.  PRU1 runs ws281x_fetch.bin and keeps up to WS281X_FETCH_SLOTS
+ * pixel slots ahead of PRU0.
+ *
+ * Fetched frames are always bit sliced, since PRU0 would otherwise have
+ * to wait for a new fetch wherever a strip ends, so this turns on
+ * setBitSlicing() as well.  It stays on when PRU1 is stopped again.
+ */
+void PixelBone_Pixel::setDualPru(bool enable) {
+  if (enable == (pru1 != NULL))
+    return;
+
+  drain();
+  if (enable)
+    setBitSlicing(true);
 
-  // Wait for any current command to have been acknowledged
-  while (ws281x->command)
+  if (!enable) {
+    // Let PRU0 clock out the last of the fetched frames before PRU1 stops
+    ws281x_fetch_t *const fetch = (ws281x_fetch_t *)pru1->shared_ram;
+    while (fetch->consumed != fetch_slots)
+      pru_wait_event(pru0, -1);
+
+    ws281x_fetch_command_t *const cmd =
+        (ws281x_fetch_command_t *)pru1->data_ram;
+    cmd->command = 0xFF;
+    while (cmd->response != 0xFF)
+      pru_wait_event(pru1, -1);
+
+    pru_close(pru1);
+    pru1 = NULL;
+    return;
+  }
+
+  pru1 = pru_init(1);
+  if (pru1->shared_ram_size < sizeof(ws281x_fetch_t))
+    die("Frame fetching needs %zu bytes of PRU shared RAM, only %zu\n",
+        sizeof(ws281x_fetch_t), pru1->shared_ram_size);
+
+  memset(pru1->shared_ram, 0, sizeof(ws281x_fetch_t));
+  fetch_slots = 0;
+
+  ws281x_fetch_command_t *const cmd = (ws281x_fetch_command_t *)pru1->data_ram;
+  cmd->command = 0;
+  cmd->response = 0;
+
+  pru_soft_register("ws281x_fetch.bin", ws281x_fetch_emulate);
+  pru_exec(pru1, "./ws281x_fetch.bin");
+  while (!cmd->response)
     ;
+}
+
+/** Render into ordinary cached memory instead of the DDR.
+ *
+ * The DDR shared with the PRU is mapped uncached, so every byte that
+ * setPixelColor() stores is a separate bus write and every read of a
+ * pixel stalls.  With a shadow buffer the pixel calls work on a cached
+ * copy of each frame buffer and show() copies it to the DDR in one go,
+ * or transposes it straight from the copy when bit slicing.
+ */
+void PixelBone_Pixel::setShadowBuffer(bool enable) {
+  if (enable == (shadow != NULL))
+    return;
+
+  if (enable) {
+    allocShadow();
+    return;
+  }
+
+  if (color)
+    die("Color correction needs the shadow buffer\n");
+
+  // Only the current buffer is known to be out of date, unless the dirty
+  // tracking says otherwise
+  for (unsigned b = 0; b < num_buffers; b++)
+    if (written || b == current_buffer_num)
+      flushBuffer(b);
+
+  free(shadow);
+  shadow = NULL;
+}
+
+/** Give each frame buffer a shadow, starting from what is in the DDR. */
+void PixelBone_Pixel::allocShadow() {
+  free(shadow);
+  shadow = (uint8_t *)malloc(num_buffers * buffer_size);
+  if (!shadow)
+    die("Unable to allocate %u * %zu for the shadow buffers\n", num_buffers,
+        buffer_size);
+  memcpy(shadow, pru0->ddr, num_buffers * buffer_size);
+}
+
+/** Copy the current shadow buffer to the DDR.
+ *
+ * show() does this itself, so it is only needed to look at the DDR.
+ */
+void PixelBone_Pixel::flush() { flushBuffer(current_buffer_num); }
+
+/** Copy a shadow buffer, or only its dirty blocks, to the DDR. */
+void PixelBone_Pixel::flushBuffer(unsigned buffer) {
+  if (!shadow)
+    return;
+
+  const size_t offset = buffer_size * buffer;
+  uint8_t *const ddr = (uint8_t *)pru0->ddr + offset;
+
+  if (!written) {
+    if (color)
+      color_frame(color, (uint32_t *)ddr, (const uint32_t *)(shadow + offset),
+                  buffer_size / sizeof(pixel_t));
+    else
+      memcpy(ddr, shadow + offset, buffer_size);
+    copied_bytes += buffer_size;
+    return;
+  }
+
+  uint32_t *const map = &unflushed[buffer * dirty_words];
+  copied_bytes += copy_blocks(ddr, shadow + offset, map, buffer_size, color);
+  memset(map, 0, dirty_words * sizeof(*map));
+}
+
+/** Keep track of which parts of the frame buffers have been written.
+ *
+ * moveToNextBuffer() then brings the next buffer up to date with the one
+ * that was just shown by copying only the blocks that differ, so that an
+ * application only needs to draw what changes from frame to frame.  With
+ * a shadow buffer, show() also only copies the blocks that have changed
+ * to the DDR.
+ *
+ * Writes through getCurrentBuffer() or getPixel() are not seen and need a
+ * markDirty().  clear() dirties the whole frame.
+ */
+void PixelBone_Pixel::setDirtyTracking(bool enable) {
+  if (enable == (written != NULL))
+    return;
+
+  if (enable)
+    allocDirty();
+  else
+    freeDirty();
+}
+
+/** Start tracking from buffers that have nothing in common.
+ *
+ * Each of the other buffers is fully copied from the current one as it
+ * next becomes current, and each shadow is fully copied to the DDR.
+ */
+void PixelBone_Pixel::allocDirty() {
+  const size_t blocks = (buffer_size + dirty_block - 1) / dirty_block;
+
+  freeDirty();
+  dirty_words = (blocks + 31) / 32;
+  const size_t maps_size = num_buffers * dirty_words * sizeof(uint32_t);
+  written = (uint32_t *)calloc(dirty_words, sizeof(uint32_t));
+  behind = (uint32_t *)malloc(maps_size);
+  unflushed = (uint32_t *)malloc(maps_size);
+  if (!written || !behind || !unflushed)
+    die("Unable to allocate the dirty maps for %zu blocks\n", blocks);
+
+  memset(behind, 0xFF, maps_size);
+  memset(&behind[current_buffer_num * dirty_words], 0,
+         dirty_words * sizeof(uint32_t));
+  memset(unflushed, 0xFF, maps_size);
+}
+
+void PixelBone_Pixel::freeDirty() {
+  free(written);
+  free(behind);
+  free(unflushed);
+  written = behind = unflushed = NULL;
+  dirty_words = 0;
+}
+
+/** Note a change to pixel words first to last of the current buffer. */
+void PixelBone_Pixel::markWords(uint32_t first, uint32_t last) {
+  if (!written)
+    return;
+
+  const uint32_t first_block = first * sizeof(pixel_t) / dirty_block;
+  const uint32_t last_block = last * sizeof(pixel_t) / dirty_block;
+  set_bits(written, first_block, last_block);
+  set_bits(&unflushed[current_buffer_num * dirty_words], first_block,
+           last_block);
+}
+
+void PixelBone_Pixel::markPixel(const pixel_t *p) {
+  const uint32_t word = p - getCurrentBuffer();
+  markWords(word, word);
+}
+
+/** Treat the whole of the current buffer as changed. */
+void PixelBone_Pixel::markDirty() {
+  markWords(0, buffer_size / sizeof(pixel_t) - 1);
+}
+
+/** Bytes of the current buffer written since it became current, rounded
+ * up to whole blocks.  0 without dirty tracking.
+ */
+size_t PixelBone_Pixel::dirtyBytes() const {
+  size_t blocks = 0;
+  for (uint32_t w = 0; w < dirty_words; w++)
+    blocks += __builtin_popcount(written[w]);
+  return std::min(blocks * dirty_block, buffer_size);
+}
+
+/** Bytes copied for the last frame, by show() from the shadow buffer to
+ * the DDR and by the moveToNextBuffer() that ended it.
+ */
+size_t PixelBone_Pixel::copiedBytes() const { return frame_copied_bytes; }
+
+/** Scale every color on its way out to the LEDs, with 255 for full
+ * brightness.
+ *
+ * The correction is applied as show() copies each frame out for the PRU,
+ * so the frame buffers keep the colors as they were drawn and it costs
+ * nothing per pixel written.  Any correction turns on the shadow buffer.
+ */
+void PixelBone_Pixel::setBrightness(uint8_t _brightness) {
+  brightness = _brightness;
+  updateColor();
+}
+
+/** Scale red, green and blue by r, g and b / 255, to white balance LEDs
+ * whose colors are not equally bright.
+ */
+void PixelBone_Pixel::setColorBalance(uint8_t r, uint8_t g, uint8_t b) {
+  gains[0] = r;
+  gains[1] = g;
+  gains[2] = b;
+  updateColor();
+}
+
+/** Raise each color, from 0 to 1, to the power of _gamma before it is
+ * scaled.  Around 2.2 to 2.8 makes steps in the drawn values look even.
+ */
+void PixelBone_Pixel::setGamma(float _gamma) {
+  gamma = _gamma;
+  updateColor();
+}
+
+/** Rebuild the color tables and mark every frame in the DDR as out of
+ * date with them.
+ */
+void PixelBone_Pixel::updateColor() {
+  color_free(color);
+  color = color_init(brightness, gains, gamma, color_order, white_extraction);
+
+  if (color) {
+    allocCorrected();
+
+    // Corrected pixels can not go back into the buffers that are drawn in
+    setShadowBuffer(true);
+  }
+
+  if (unflushed)
+    memset(unflushed, 0xFF, num_buffers * dirty_words * sizeof(uint32_t));
+}
+
+/** Scratch frame for the corrected or dithered pixels of sliced frames. */
+void PixelBone_Pixel::allocCorrected() {
+  if (!corrected)
+    corrected = (uint32_t *)malloc(buffer_size);
+  if (!corrected)
+    die("Unable to allocate %zu for the corrected frame\n", buffer_size);
+}
+
+/** Draw with 16 bits per color and dither each frame down to 8 bits.
+ *
+ * The LEDs only have 256 steps per color, which is too coarse for slow
+ * fades near black.  In high precision mode every pixel call draws into
+ * a buffer of 16 bits per color instead, and show() quantises it into
+ * the frame for the PRU.  The part of each color lost in rounding is
+ * carried over to the next frame, so each LED flickers between the two
+ * nearest steps fast enough to average out at the 16 bit value.  The 8
+ * bit calls scale their colors up to 16 bits.
+ *
+ * The color correction is applied in 16 bits, before the dithering.
+ * Dirty tracking has nothing to gain, as every frame is quantised anew.
+ */
+void PixelBone_Pixel::setHighPrecision(bool enable) {
+  if (enable == (deep != NULL))
+    return;
+
+  if (!enable) {
+    free(deep);
+    free(dither_error);
+    deep = NULL;
+    dither_error = NULL;
+    return;
+  }
+
+  deep = (uint16_t *)malloc(buffer_size * sizeof(*deep));
+  dither_error = (uint8_t *)calloc(buffer_size, 1);
+  if (!deep || !dither_error)
+    die("Unable to allocate %zu for the high precision buffer\n",
+        buffer_size * (sizeof(*deep) + 1));
+  allocCorrected();
+
+  // Start from whatever has been drawn so far
+  const uint8_t *const pixels = bufferBytes(current_buffer_num);
+  for (size_t i = 0; i < buffer_size; i++)
+    deep[i] = pixels[i] * 257;
+}
+
+/** Send the colors of each pixel in the order that the LEDs take them.
+ *
+ * order is "GRB" for WS2812s, any other order of R, G and B, or four
+ * letters including a W for RGBW strips such as the SK6812, which take
+ * 32 bits per pixel.  The pixels are still drawn as RGB and an optional
+ * white, and reordered in the same pass as the color correction, so any
+ * order but GRB turns on the shadow buffer.
+ */
+void PixelBone_Pixel::setColorOrder(const char *order) {
+  color_order_bits(order);
+
+  // The frames in flight may still be using the old slices
+  drain();
+  strcpy(color_order, order);
+  updateColor();
+  if (slicer)
+    setBitSlicing(true);
+}
+
+/** Light RGBW strips with the white LED wherever red, green and blue are
+ * all on, instead of the mix of the three.
+ *
+ * The smallest of the three is taken from each of them and added to the
+ * white as each frame is copied out.  It has no effect on RGB strips.
+ */
+void PixelBone_Pixel::setWhiteExtraction(bool enable) {
+  white_extraction = enable;
+  updateColor();
+}
+
+/** Bits that each pixel takes on the wire, 24 or 32. */
+unsigned PixelBone_Pixel::bitsPerPixel() const {
+  return 8 * strlen(color_order);
+}
 
-  // Send the start command
-  ws281x->command = 1;
+/** Number of frames queued, including the one the PRU is clocking out. */
+unsigned PixelBone_Pixel::queuedFrames() const {
+  if (!ws281x->queue_depth)
+    return 0;
+  return (ws281x->queue_write + ws281x->queue_depth - ws281x->queue_read) %
+         ws281x->queue_depth;
+}
+
+/** Queue slot of the frame that the PRU will clock out next. */
+unsigned PixelBone_Pixel::queueReadIndex() const { return ws281x->queue_read; }
+
+/** Number of times the PRU finished a frame and found the queue empty. */
+unsigned PixelBone_Pixel::underruns() const { return ws281x->underruns; }
+
+/** Select the bit timing for the LEDs on all of the channels.
+ *
+ * The PRU picks up the new timing at the start of the next frame.
+ */
+void PixelBone_Pixel::setTiming(ws281x_profile_id profile) {
+  if (profile >= WS281X_NUM_PROFILES)
+    die("Unknown timing profile %u\n", profile);
+  setTiming(ws281x_profiles[profile]);
+}
+
+void PixelBone_Pixel::setTiming(const ws281x_profile_t &profile) {
+  if (profile.t0h >= profile.t1h || profile.t1h >= profile.period)
+    die("%s: T0H %u ns, T1H %u ns and period %u ns are out of order\n",
+        profile.name, profile.t0h, profile.t1h, profile.period);
+  if (std::max(profile.period, profile.latch) / WS281X_NS_PER_CYCLE >
+      WS281X_TIMING_MAX)
+    die("%s: the PRU times no more than %u ns\n", profile.name,
+        WS281X_TIMING_MAX * WS281X_NS_PER_CYCLE);
+
+  ws281x->timing = ws281x_timing_t(profile);
+}
+
+/** Theoretical time in ns for the PRU to clock out a frame and latch it. */
+uint32_t PixelBone_Pixel::frameTime() const {
+  const ws281x_timing_t timing = ws281x->timing;
+  return ((uint64_t)num_pixels * bitsPerPixel() * timing.period +
+          timing.latch) *
+         WS281X_NS_PER_CYCLE;
+}
+
+/** Lock the frames to a fixed rate, such as 60, 100 or 120 frames/sec.
+ *
+ * The PRU stretches the latch after each frame so that the next one
+ * starts exactly 1 / hz after it did, timed by its own cycle counter, as
+ * long as the next frame has been shown by then.  A frame queue keeps the
+ * PRU supplied.  Passing 0 goes back to starting each frame as soon as
+ * the last one has latched.
+ */
+void PixelBone_Pixel::setFrameRate(unsigned hz) {
+  if (!hz) {
+    ws281x->frame_period = 0;
+    return;
+  }
+
+  const uint32_t ns = frameTime();
+  if (1000000000u / hz < ns)
+    die("%u frames/sec is faster than the frame time of %u ns\n", hz, ns);
+  ws281x->frame_period = 1000000000u / hz / WS281X_NS_PER_CYCLE;
+}
+
+/** Transpose each frame into per-bit GPIO masks on the ARM in show().
+ *
+ * The PRU then streams the masks with one burst read per bit instead of
+ * reading every channel's pixel from DDR for every bit.  It is always on
+ * with more than WS281X_UNSLICED_CHANNELS channels, which the PRU can not
+ * test within the bit timing, and with setDualPru().
+ */
+void PixelBone_Pixel::setBitSlicing(bool enable) {
+  if (!enable && num_channels > WS281X_UNSLICED_CHANNELS)
+    die("%u channels need bit slicing, unsliced frames go up to %u\n",
+        num_channels, WS281X_UNSLICED_CHANNELS);
+  if (!enable && pru1)
+    die("Frames fetched by PRU1 need bit slicing\n");
+
+  bitslice_free(slicer);
+  slicer = NULL;
+
+  if (!enable)
+    return;
+
+  const size_t slices_size = num_pixels * BITSLICE_SLOT_SIZE(bitsPerPixel());
+  if (num_buffers * (buffer_size + slices_size) > pru0->ddr_size)
+    die("Sliced frames need at least %u * (%zu + %zu), only %zu in DDR\n",
+        num_buffers, buffer_size, slices_size, pru0->ddr_size);
+
+  uint8_t gpio[WS281X_MAX_CHANNELS], pin[WS281X_MAX_CHANNELS];
+  for (unsigned c = 0; c < num_channels; c++) {
+    gpio[c] = ws281x_pins[c].gpio;
+    pin[c] = ws281x_pins[c].pin;
+  }
+
+  slicer = bitslice_init(num_channels, bitsPerPixel(), gpio, pin);
+}
+
+/** Bytes of each buffer's sliced frame, after all of the pixel frames. */
+size_t PixelBone_Pixel::slicesSize() const {
+  return slicer ? num_pixels * BITSLICE_SLOT_SIZE(slicer->bits) : 0;
 }
 
 void PixelBone_Pixel::moveToNextBuffer() {
-  ++current_buffer_num %= 2;
+  const unsigned from = current_buffer_num;
+  ++current_buffer_num %= num_buffers;
+
+  frame_copied_bytes = copied_bytes;
+  copied_bytes = 0;
+  if (!written)
+    return;
+
+  // The other buffers are now behind wherever this frame was written.
+  // Bring the next one up to date before anything is drawn into it.
+  for (unsigned b = 0; b < num_buffers; b++)
+    for (uint32_t w = 0; b != from && w < dirty_words; w++)
+      behind[b * dirty_words + w] |= written[w];
+
+  uint32_t *const next = &behind[current_buffer_num * dirty_words];
+  uint32_t *const next_unflushed = &unflushed[current_buffer_num * dirty_words];
+  frame_copied_bytes += copy_blocks(bufferBytes(current_buffer_num),
+                                    bufferBytes(from), next, buffer_size, NULL);
+
+  for (uint32_t w = 0; w < dirty_words; w++) {
+    next_unflushed[w] |= next[w];
+    next[w] = 0;
+    written[w] = 0;
+  }
 };
 
-uint32_t PixelBone_Pixel::numPixels() const { return num_pixels; }
+/** Number of pixel indices, including any gaps between the channels. */
+uint32_t PixelBone_Pixel::numPixels() const { return num_channels * stride; }
+
+uint32_t PixelBone_Pixel::numChannels() const { return num_channels; }
+
+/** Number of pixels on one of the strips. */
+uint32_t PixelBone_Pixel::channelLength(uint32_t channel) const {
+  return channel < num_channels ? channel_length[channel] : 0;
+}
+
+bool PixelBone_Pixel::contains(uint32_t n) const {
+  if (num_channels == 1)
+    return n < num_pixels;
+  return n < num_channels * stride && n % stride < channel_length[n / stride];
+}
+
+/** Where the pixels of a frame buffer are written. */
+uint8_t *PixelBone_Pixel::bufferBytes(unsigned buffer) const {
+  uint8_t *const base = shadow ? shadow : (uint8_t *)pru0->ddr;
+  return base + buffer_size * buffer;
+}
 
-/** Retrieve one of the two frame buffers. */
+/** Retrieve one of the frame buffers, or its shadow. */
 pixel_t *PixelBone_Pixel::getCurrentBuffer() const {
-  return (pixel_t *)((uint8_t *)pru0->ddr + buffer_size * current_buffer_num);
+  return (pixel_t *)bufferBytes(current_buffer_num);
 }
 
+/** Find a pixel in the current frame buffer.
+ *
+ * Index n is pixel n % stride of channel n / stride.  The channels are
+ * interleaved in the frame buffer so that the PRU can fetch one pixel of
+ * every channel with a single burst read, up to the last channel that is
+ * long enough to have a pixel in that slot.
+ *
+ * \return NULL for an index past the end of a strip or of the channels.
+ */
 pixel_t *PixelBone_Pixel::getPixel(uint32_t n) const {
-  return &getCurrentBuffer()[n];
+  if (!contains(n))
+    return NULL;
+  return &getCurrentBuffer()[wordIndex(n)];
+}
+
+uint32_t PixelBone_Pixel::wordIndex(uint32_t n) const {
+  if (num_channels == 1)
+    return n;
+  return slot_offset[n % stride] + n / stride;
 }
 
 // Convert separate R,G,B into packed 32-bit RGB color.
@@ -66,15 +965,86 @@ uint32_t PixelBone_Pixel::Color(uint8_t r, uint8_t g, uint8_t b) {
   return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
 }
 
-uint32_t PixelBone_Pixel::h2rgb(uint32_t v1, uint32_t v2, uint32_t hue) {
-  if (hue < 60)
-    return v1 * 60 + (v2 - v1) * hue;
-  if (hue < 180)
-    return v2 * 60;
-  if (hue < 240)
-    return v1 * 60 + (v2 - v1) * (240 - hue);
+/* Per hue tables for the color conversions, so that each pixel takes a
+ * couple of lookups and multiplies instead of branches and divides.
+ */
+static const struct hue_table_t {
+  // Weight out of 60 of var2 against var1 in each of red, green and blue
+  uint8_t hsl[360][3];
+
+  // Which of value, base, rising and falling each of red, green and blue
+  // takes, and how far the hue is through its 60 degree sector
+  uint8_t hsv[360][4];
 
-  return v1 * 60;
+  static uint8_t h2rgb(uint32_t hue) {
+    if (hue < 60)
+      return hue;
+    if (hue < 180)
+      return 60;
+    if (hue < 240)
+      return 240 - hue;
+    return 0;
+  }
+
+  hue_table_t() {
+    static const uint8_t sectors[6][3] = {
+        {0, 2, 1}, {3, 0, 1}, {1, 0, 2}, {1, 3, 0}, {2, 1, 0}, {0, 1, 3},
+    };
+
+    for (uint32_t hue = 0; hue < 360; hue++) {
+      hsl[hue][0] = h2rgb(hue < 240 ? hue + 120 : hue - 240);
+      hsl[hue][1] = h2rgb(hue);
+      hsl[hue][2] = h2rgb(hue >= 120 ? hue - 120 : hue + 240);
+
+      memcpy(hsv[hue], sectors[hue / 60], 3);
+      hsv[hue][3] = hue % 60;
+    }
+  }
+} hue_table;
+
+static inline uint32_t hsl_pixel(uint32_t hue, uint32_t saturation,
+                                 uint32_t lightness) {
+  if (hue > 359) hue = hue % 360;
+  if (saturation > 100) saturation = 100;
+  if (lightness > 100) lightness = 100;
+
+  // algorithm from: http://www.easyrgb.com/index.php?X=MATH&H=19#text19
+  // The grays need no special case, as var1 and var2 are then equal.
+  const uint32_t var2 = lightness < 50
+                            ? lightness * (100 + saturation)
+                            : (lightness + saturation) * 100 -
+                                  saturation * lightness;
+  const uint32_t var1 = lightness * 200 - var2;
+
+  // Each color is (var1 * 60 + (var2 - var1) * weight) * 255 / 600000,
+  // where multiplying by the reciprocal and shifting gives the same result
+  // as the divide for every possible value.
+  static const uint64_t reciprocal = ((1ull << 49) + 599999) / 600000;
+  const uint64_t base = var1 * 60 * 255 * reciprocal;
+  const uint64_t step = (var2 - var1) * 255 * reciprocal;
+  const uint8_t *const w = hue_table.hsl[hue];
+
+  return (uint32_t)((base + step * w[0]) >> 49) << 16 |
+         (uint32_t)((base + step * w[1]) >> 49) << 8 |
+         (uint32_t)((base + step * w[2]) >> 49);
+}
+
+static inline uint32_t hsv_pixel(uint32_t hue, const uint32_t saturation,
+                                 const uint32_t value) {
+  if (hue > 359) hue = hue % 360;
+  if (!saturation)
+    return value << 16 | value << 8 | value;
+
+  // (x * 17477) >> 20 is x / 60 for any x up to 255 * 59
+  const uint8_t *const sector = hue_table.hsv[hue];
+  const uint32_t base = ((255 - saturation) * value) >> 8;
+  const uint32_t range = value - base;
+  const uint32_t levels[4] = {
+      value, base, ((range * sector[3] * 17477) >> 20) + base,
+      ((range * (60 - sector[3]) * 17477) >> 20) + base,
+  };
+
+  return levels[sector[0]] << 16 | levels[sector[1]] << 8 | levels[sector[2]];
 }
 
 /**
@@ -89,35 +1059,55 @@ uint32_t PixelBone_Pixel::h2rgb(uint32_t v1, uint32_t v2, uint32_t hue) {
  */
 
 uint32_t PixelBone_Pixel::HSL(uint32_t hue, uint32_t saturation,uint32_t lightness) {
-  uint32_t red, green, blue;
-  uint32_t var1, var2;
-  
-  if (hue > 359) hue = hue % 360;
-  if (saturation > 100) saturation = 100;
-  if (lightness > 100) lightness = 100;
-  
-  // algorithm from: http://www.easyrgb.com/index.php?X=MATH&H=19#text19
-  if (saturation == 0) {
-    red = green = blue = lightness * 255 / 100;
-  } else {
-    if (lightness < 50) {
-      var2 = lightness * (100 + saturation);
-    } else {
-      var2 = ((lightness + saturation) * 100) - (saturation * lightness);
-    }
-    var1 = lightness * 200 - var2;
-    red = h2rgb(var1, var2, (hue < 240) ? hue + 120 : hue - 240) * 255 / 600000;
-    green = h2rgb(var1, var2, hue) * 255 / 600000;
-    blue = h2rgb(var1, var2, (hue >= 120) ? hue - 120 : hue + 240) * 255 / 600000;
-  }
-  return (red << 16) | (green << 8) | blue;
+  return hsl_pixel(hue, saturation, lightness);
+}
+
+/** Convert count HSL colors to packed RGB, as HSL() does one at a time. */
+void PixelBone_Pixel::HSL(const uint16_t *hue, const uint8_t *saturation,
+                          const uint8_t *lightness, uint32_t *colors,
+                          uint32_t count) {
+  for (uint32_t i = 0; i < count; i++)
+    colors[i] = hsl_pixel(hue[i], saturation[i], lightness[i]);
+}
+
+/**
+ * Convert HSV (Hue, Saturation, Value) to RGB (Red, Green, Blue)
+ *
+ * hue:        0 to 359 - position on the color wheel, 0=red, 120=green,
+ *                        240=blue
+ *
+ * saturation: 0 to 255 - how bright or dull the color, 255=full, 0=gray
+ *
+ * value:      0 to 255 - how bright the color is, 255=full, 0=black
+ */
+uint32_t PixelBone_Pixel::HSV(uint32_t hue, uint8_t saturation,
+                              uint8_t value) {
+  return hsv_pixel(hue, saturation, value);
+}
+
+/** Convert count HSV colors to packed RGB, as HSV() does one at a time. */
+void PixelBone_Pixel::HSV(const uint16_t *hue, const uint8_t *saturation,
+                          const uint8_t *value, uint32_t *colors,
+                          uint32_t count) {
+  for (uint32_t i = 0; i < count; i++)
+    colors[i] = hsv_pixel(hue[i], saturation[i], value[i]);
 }
 
 // Query color from previously-set pixel (returns packed 32-bit RGB value)
 uint32_t PixelBone_Pixel::getPixelColor(uint32_t n) const {
-  if (n < num_pixels) {
-    pixel_t *const p = getPixel(n);
-    return Color(p->r, p->g, p->b);
+  return getPixelColorWRGB(n) & 0x00FFFFFF;
+}
+
+/** Query a pixel with the white of RGBW strips in the top byte. */
+uint32_t PixelBone_Pixel::getPixelColorWRGB(uint32_t n) const {
+  if (contains(n)) {
+    if (deep) {
+      const uint16_t *const d = &deep[4 * wordIndex(n)];
+      return (uint32_t)(d[3] >> 8) << 24 |
+             Color(d[1] >> 8, d[2] >> 8, d[0] >> 8);
+    }
+    pixel_t *const p = &getCurrentBuffer()[wordIndex(n)];
+    return (uint32_t)p->a << 24 | Color(p->r, p->g, p->b);
   }
   return 0; // Pixel # is out of bounds
 }
@@ -125,46 +1115,427 @@ uint32_t PixelBone_Pixel::getPixelColor(uint32_t n) const {
 // Set pixel color from separate R,G,B components:
 void PixelBone_Pixel::setPixelColor(uint32_t n, uint8_t r, uint8_t g,
                                     uint8_t b) {
-  if (n < num_pixels) {
-    // if(brightness) { // See notes in setBrightness()
-    //   r = (r * brightness) >> 8;
-    //   g = (g * brightness) >> 8;
-    //   b = (b * brightness) >> 8;
-    // }
-    pixel_t *const p = getPixel(n);
-    p->r = r;
-    p->g = g;
-    p->b = b;
-  }
+  setPixelColorRGBW(n, r, g, b, 0);
 }
 
 // Set pixel color from 'packed' 32-bit RGB color:
 void PixelBone_Pixel::setPixelColor(uint32_t n, uint32_t c) {
-  if (n < num_pixels) {
-    uint8_t r = (uint8_t)(c >> 16);
-    uint8_t g = (uint8_t)(c >> 8);
-    uint8_t b = (uint8_t)c;
-    setPixelColor(n, r, g, b);
+  setPixelColorRGBW(n, c >> 16, c >> 8, c, 0);
+}
+
+/** Set a pixel from a packed color with the white of RGBW strips in the
+ * top byte, as getPixelColorWRGB() returns it.
+ */
+void PixelBone_Pixel::setPixelColorWRGB(uint32_t n, uint32_t c) {
+  setPixelColorRGBW(n, c >> 16, c >> 8, c, c >> 24);
+}
+
+/** Set a pixel including the white of RGBW strips.
+ *
+ * The pixel is stored as one word, as the PRU reads it, so that the white
+ * costs nothing extra.  Strips of 24 bits per pixel ignore it.
+ */
+void PixelBone_Pixel::setPixelColorRGBW(uint32_t n, uint8_t r, uint8_t g,
+                                        uint8_t b, uint8_t w) {
+  if (!contains(n))
+    return;
+
+  if (deep) {
+    uint16_t *const d = &deep[4 * wordIndex(n)];
+    d[0] = b * 257;
+    d[1] = r * 257;
+    d[2] = g * 257;
+    d[3] = w * 257;
+    return;
+  }
+
+  const uint32_t word = wordIndex(n);
+  ((uint32_t *)bufferBytes(current_buffer_num))[word] = pixelWord(r, g, b, w);
+  markWords(word, word);
+}
+
+/** Set a pixel to 16 bit colors, for high precision mode.
+ *
+ * Otherwise only the top 8 bits of each color are used.
+ */
+void PixelBone_Pixel::setPixelColor16(uint32_t n, uint16_t r, uint16_t g,
+                                      uint16_t b) {
+  if (!contains(n))
+    return;
+
+  if (!deep) {
+    setPixelColor(n, r >> 8, g >> 8, b >> 8);
+    return;
   }
+
+  uint16_t *const p = &deep[4 * wordIndex(n)];
+  p[0] = b;
+  p[1] = r;
+  p[2] = g;
+  p[3] = 0;
 }
 
 void PixelBone_Pixel::setPixel(uint32_t n, pixel_t p) {
-  memcpy(getPixel(n), &p, sizeof(pixel_t));
+  if (!contains(n))
+    return;
+
+  if (deep) {
+    setPixelColorRGBW(n, p.r, p.g, p.b, p.a);
+    return;
+  }
+
+  pixel_t *const pixel = &getCurrentBuffer()[wordIndex(n)];
+  memcpy(pixel, &p, sizeof(pixel_t));
+  markPixel(pixel);
   // setPixelColor(n, p.r, p.g, p.b);
 }
 
+/** Sleep until the PRU has finished clocking out a frame.
+ *
+ * With pipelining this is before the latch rather than after it.
+ *
+ * \return the PRU's response, which is the number of cycles that the frame
+ * took to clock out before its latch.
+ */
 uint32_t PixelBone_Pixel::wait() {
+  const uint64_t start_ns = now_ns();
+
   while (1) {
-    uint32_t response = ws281x->response;
+    const uint32_t response = tryWait();
     if (response) {
-      ws281x->response = 0;
+      waited_ns += now_ns() - start_ns;
       return response;
     }
+
+    // The PRU raises an interrupt at the end of every frame
+    pru_wait_event(pru0, -1);
+  }
+}
+
+/** Check for a finished frame without blocking.
+ *
+ * \return the PRU's response or 0 if it is still busy.
+ */
+uint32_t PixelBone_Pixel::tryWait() {
+  // Acknowledge any interrupt that has made eventFd() readable
+  pru_wait_event(pru0, 0);
+
+  const uint32_t response = ws281x->response;
+  if (response)
+    ws281x->response = 0;
+  pollFrames();
+  return response;
+}
+
+/** Catch up with the frames that the PRU has finished, sampling the
+ * transmit time of the last one and calling the frame callback.
+ *
+ * Frames that finish between two looks are counted, but only the last of
+ * them is timed.
+ */
+void PixelBone_Pixel::pollFrames() {
+  const uint32_t done = ws281x->frames_done;
+  if (done == frames_done_seen)
+    return;
+
+  stats_add(&transmit_stats, ws281x->frame_cycles * WS281X_NS_PER_CYCLE);
+  counts.frames_sent += done - frames_done_seen;
+  frames_done_seen = done;
+  if (frame_callback)
+    frame_callback(frame_callback_arg, done);
+}
+
+/** Call callback at each frame boundary, from whichever of show(),
+ * wait() or tryWait() first sees that the PRU has finished a frame.
+ *
+ * To render in step with the LEDs without blocking, call tryWait() each
+ * time eventFd() is readable.  Passing NULL stops the callbacks.
+ */
+void PixelBone_Pixel::setFrameCallback(pixel_frame_callback_t callback,
+                                       void *arg) {
+  frame_callback = callback;
+  frame_callback_arg = arg;
+}
+
+/** Frame timings and counts since the last resetTelemetry().
+ *
+ * Compare the transmit time with the render and prepare times to see
+ * whether the frame rate is limited by the wire or by the ARM.
+ */
+pixel_telemetry_t PixelBone_Pixel::telemetry() const {
+  pixel_telemetry_t t = counts;
+  t.transmit = stats_summary(&transmit_stats);
+  t.render = stats_summary(&render_stats);
+  t.prepare = stats_summary(&prepare_stats);
+  t.blocked = stats_summary(&blocked_stats);
+  t.underruns += ws281x->underruns - underruns_base;
+  return t;
+}
+
+void PixelBone_Pixel::resetTelemetry() {
+  stats_reset(&transmit_stats);
+  stats_reset(&render_stats);
+  stats_reset(&prepare_stats);
+  stats_reset(&blocked_stats);
+  counts = pixel_telemetry_t();
+  last_show_ns = 0;
+  waited_ns = 0;
+  frames_done_seen = ws281x->frames_done;
+  underruns_base = ws281x->underruns;
+}
+
+/** Write the telemetry as StatsD gauges, one "pixelbone.<name>:<value>|g"
+ * line each, with the times in ns.
+ *
+ * \return the length of the text, which is cut short if it is len or more.
+ */
+size_t PixelBone_Pixel::formatTelemetry(char *buf, size_t len) const {
+  const pixel_telemetry_t t = telemetry();
+  const struct {
+    const char *name;
+    stats_summary_t stats;
+  } series[] = {{"transmit", t.transmit},
+                {"render", t.render},
+                {"prepare", t.prepare},
+                {"blocked", t.blocked}};
+  size_t n = snprintf(buf, len,
+                      "pixelbone.frames:%llu|g\n"
+                      "pixelbone.frames_sent:%llu|g\n"
+                      "pixelbone.blocked_frames:%llu|g\n"
+                      "pixelbone.underruns:%llu|g\n",
+                      (unsigned long long)t.frames,
+                      (unsigned long long)t.frames_sent,
+                      (unsigned long long)t.blocked_frames,
+                      (unsigned long long)t.underruns);
+
+  for (const auto &s : series)
+    n += snprintf(buf + std::min(n, len), len - std::min(n, len),
+                  "pixelbone.%s.p50:%u|g\n"
+                  "pixelbone.%s.p99:%u|g\n"
+                  "pixelbone.%s.max:%u|g\n",
+                  s.name, s.stats.p50, s.name, s.stats.p99, s.name,
+                  s.stats.max);
+  return n;
+}
+
+/** Export the telemetry every interval_frames frames shown.
+ *
+ * A dest of "udp:host:port" sends each export as a datagram to a StatsD
+ * server, and anything else is a file that each export is appended to.
+ * A NULL dest or an interval of 0 stops exporting.
+ */
+void PixelBone_Pixel::setTelemetryExport(const char *dest,
+                                         unsigned interval_frames) {
+  if (telemetry_file)
+    fclose(telemetry_file);
+  if (telemetry_socket >= 0)
+    close(telemetry_socket);
+  telemetry_file = NULL;
+  telemetry_socket = -1;
+  telemetry_interval = 0;
+  if (!dest || !interval_frames)
+    return;
+
+  if (strncmp(dest, "udp:", 4) != 0) {
+    telemetry_file = fopen(dest, "a");
+    if (!telemetry_file)
+      die("Unable to open %s: %s\n", dest, strerror(errno));
+    telemetry_interval = interval_frames;
+    return;
   }
+
+  const char *const port = strrchr(dest + 4, ':');
+  if (!port)
+    die("Telemetry destination %s has no port\n", dest);
+  const std::string host(dest + 4, port);
+
+  struct addrinfo hints, *addrs;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  const int rc = getaddrinfo(host.c_str(), port + 1, &hints, &addrs);
+  if (rc)
+    die("Unable to resolve %s: %s\n", dest, gai_strerror(rc));
+
+  telemetry_socket = socket(addrs->ai_family, addrs->ai_socktype,
+                            addrs->ai_protocol);
+  if (telemetry_socket < 0 ||
+      connect(telemetry_socket, addrs->ai_addr, addrs->ai_addrlen) < 0)
+    die("Unable to connect to %s: %s\n", dest, strerror(errno));
+  freeaddrinfo(addrs);
+  telemetry_interval = interval_frames;
+}
+
+void PixelBone_Pixel::exportTelemetry() {
+  char buf[1024];
+  const size_t len = std::min(formatTelemetry(buf, sizeof(buf)),
+                              sizeof(buf) - 1);
+
+  if (telemetry_file) {
+    fwrite(buf, 1, len, telemetry_file);
+    fflush(telemetry_file);
+  }
+
+  // A StatsD server that is not listening is no reason to stop
+  if (telemetry_socket >= 0 && send(telemetry_socket, buf, len, 0) < 0)
+    warn_once("Unable to send telemetry: %s\n", strerror(errno));
 }
 
+/** File descriptor that is readable once a frame is done or a command has
+ * been taken, for use with poll() or epoll.  Call tryWait() when it is.
+ */
+int PixelBone_Pixel::eventFd() const { return pru_event_fd(pru0); }
+
+/** Blank the current buffer, gaps between the channels and all. */
 void PixelBone_Pixel::clear() {
-  for (uint16_t i = 0; i < num_pixels; i++) {
-    this->setPixelColor(i, 0, 0, 0);
+  memset(bufferBytes(current_buffer_num), 0, buffer_size);
+  markDirty();
+  if (deep)
+    memset(deep, 0, buffer_size * sizeof(*deep));
+}
+
+/** A pixel_t as the one 32-bit word that it is stored in. */
+uint32_t PixelBone_Pixel::pixelWord(uint8_t r, uint8_t g, uint8_t b,
+                                    uint8_t w) {
+  return (uint32_t)b | (uint32_t)r << 8 | (uint32_t)g << 16 | (uint32_t)w << 24;
+}
+
+/** Call write(word, i) for each pixel word of indices first to
+ * first + count - 1.
+ *
+ * Each run of indices within a channel is walked through the interleaved
+ * frame with a fixed step where every slot holds all of the channels, and
+ * slot by slot where some have ended.  Indices in the gaps between the
+ * channels or past the end of a channel are skipped, as setPixelColor()
+ * would.
+ */
+template <typename Write>
+void PixelBone_Pixel::writeSpan(uint32_t first, uint32_t count, Write write) {
+  uint32_t *const buffer = (uint32_t *)bufferBytes(current_buffer_num);
+  uint32_t i = 0;
+
+  while (i < count && first + i < numPixels()) {
+    const uint32_t n = first + i;
+    const uint32_t channel = n / stride;
+    const uint32_t slot = n % stride;
+
+    if (slot >= channel_length[channel]) {
+      i += stride - slot;
+      continue;
+    }
+
+    const uint32_t run = std::min(count - i, channel_length[channel] - slot);
+    const uint32_t *const offset = &slot_offset[slot];
+    uint32_t *const p = &buffer[channel];
+    markWords(offset[0] + channel, offset[run - 1] + channel);
+
+    // Slots that all hold every channel are a fixed step apart
+    if (offset[run - 1] - offset[0] == (run - 1) * num_channels) {
+      uint32_t *q = &p[offset[0]];
+      for (uint32_t j = 0; j < run; j++, q += num_channels)
+        write(q, i + j);
+    } else {
+      for (uint32_t j = 0; j < run; j++)
+        write(&p[offset[j]], i + j);
+    }
+
+    // Scale the run up into the high precision buffer
+    for (uint32_t j = 0; deep && j < run; j++) {
+      const uint32_t word = offset[j] + channel;
+      const uint8_t *const c = (const uint8_t *)&buffer[word];
+      uint16_t *const d = &deep[4 * word];
+      d[0] = c[0] * 257;
+      d[1] = c[1] * 257;
+      d[2] = c[2] * 257;
+      d[3] = c[3] * 257;
+    }
+    i += run;
   }
 }
+
+/** Set count pixels from index first to a packed RGB color. */
+void PixelBone_Pixel::fill(uint32_t first, uint32_t count, uint32_t c) {
+  const uint32_t word = pixelWord(c >> 16, c >> 8, c);
+  writeSpan(first, count, [word](uint32_t *p, uint32_t) { *p = word; });
+}
+
+/** Copy count packed RGB colors into the pixels from index first.  The
+ * top byte of each color is ignored, as by setPixelColor().
+ */
+void PixelBone_Pixel::setPixels(uint32_t first, const uint32_t *colors,
+                                uint32_t count) {
+  writeSpan(first, count, [colors](uint32_t *p, uint32_t i) {
+    const uint32_t c = colors[i];
+    *p = pixelWord(c >> 16, c >> 8, c);
+  });
+}
+
+/** Copy colors[index[i]] into each pixel first + i of count, for colors
+ * that are not in strip order, such as an image for a matrix.  Pixels with
+ * an index of 0xFFFF are left as they are.
+ */
+void PixelBone_Pixel::setPixels(uint32_t first, const uint32_t *colors,
+                                const uint16_t *index, uint32_t count) {
+  writeSpan(first, count, [colors, index](uint32_t *p, uint32_t i) {
+    if (index[i] == 0xFFFF)
+      return;
+    const uint32_t c = colors[index[i]];
+    *p = pixelWord(c >> 16, c >> 8, c);
+  });
+}
+
+/** Copy count packed colors with the white of RGBW strips in the top
+ * byte into the pixels from index first.
+ */
+void PixelBone_Pixel::setPixelsWRGB(uint32_t first, const uint32_t *colors,
+                                    uint32_t count) {
+  writeSpan(first, count, [colors](uint32_t *p, uint32_t i) {
+    const uint32_t c = colors[i];
+    *p = pixelWord(c >> 16, c >> 8, c, c >> 24);
+  });
+}
+
+/** Copy count pixels of 3 bytes in R, G, B order from index first. */
+void PixelBone_Pixel::setPixelsRGB(uint32_t first, const uint8_t *rgb,
+                                   uint32_t count) {
+  writeSpan(first, count, [rgb](uint32_t *p, uint32_t i) {
+    const uint8_t *const c = &rgb[3 * i];
+    *p = pixelWord(c[0], c[1], c[2]);
+  });
+}
+
+/** Convert count HSL colors, as for HSL(), into the pixels from index
+ * first.
+ */
+void PixelBone_Pixel::setPixelsHSL(uint32_t first, const uint16_t *hue,
+                                   const uint8_t *saturation,
+                                   const uint8_t *lightness, uint32_t count) {
+  writeSpan(first, count, [=](uint32_t *p, uint32_t i) {
+    const uint32_t c = hsl_pixel(hue[i], saturation[i], lightness[i]);
+    *p = pixelWord(c >> 16, c >> 8, c);
+  });
+}
+
+/** Convert count HSV colors, as for HSV(), into the pixels from index
+ * first.
+ */
+void PixelBone_Pixel::setPixelsHSV(uint32_t first, const uint16_t *hue,
+                                   const uint8_t *saturation,
+                                   const uint8_t *value, uint32_t count) {
+  writeSpan(first, count, [=](uint32_t *p, uint32_t i) {
+    const uint32_t c = hsv_pixel(hue[i], saturation[i], value[i]);
+    *p = pixelWord(c >> 16, c >> 8, c);
+  });
+}
+
+/** Copy count pixels of 4 bytes in R, G, B, A order from index first.
+ *
+ * The LEDs have no use for the alpha, so it is dropped.
+ */
+void PixelBone_Pixel::setPixelsRGBA(uint32_t first, const uint8_t *rgba,
+                                    uint32_t count) {
+  writeSpan(first, count, [rgba](uint32_t *p, uint32_t i) {
+    const uint8_t *const c = &rgba[4 * i];
+    *p = pixelWord(c[0], c[1], c[2]);
+  });
+}
@@ -8,18 +8,164 @@
 #ifndef _pixelbone_hpp_
 #define _pixelbone_hpp_
 #include "pru.h"
+#include "bitslice.h"
+#include "color.h"
+#include "stats.h"
 
-/** LEDscape pixel format is BRGA.
+/** LEDscape pixel format is BRGW.
  *
- * data is laid out with BRGA format, since that is how it will
- * be translated during the clock out from the PRU.
+ * data is laid out with BRGW format, since that is how it will
+ * be translated during the clock out from the PRU.  The white is only
+ * sent to RGBW strips, see PixelBone_Pixel::setColorOrder().
  */
 struct pixel_t {
   uint8_t b;
   uint8_t r;
   uint8_t g;
   uint8_t a;
-  pixel_t(uint8_t _r, uint8_t _g, uint8_t _b) : b(_b), r(_r), g(_g) {};
+  pixel_t(uint8_t _r, uint8_t _g, uint8_t _b, uint8_t _w = 0)
+      : b(_b), r(_r), g(_g), a(_w) {};
+} __attribute__((__packed__));
+
+/** Most channels that the PRU can drive at once. */
+#define WS281X_MAX_CHANNELS 32
+
+/** Most channels that the PRU can test bit by bit within the bit timing.
+ * Frames for more are always bit sliced on the ARM.
+ */
+#define WS281X_UNSLICED_CHANNELS 8
+
+/** GPIO bank and pin of a channel. */
+struct ws281x_pin_t {
+  uint8_t gpio;
+  uint8_t pin;
+};
+
+extern const ws281x_pin_t ws281x_pins[WS281X_MAX_CHANNELS];
+
+/** Most frames that can be queued for the PRU. */
+#define WS281X_QUEUE_MAX 16
+
+/** The frame holds per-bit GPIO masks from bitslice_frame() instead of
+ * pixels.
+ */
+#define WS281X_FLAG_SLICED (1 << 0)
+
+/** The PRU releases the frame as soon as the last bit is out, and starts
+ * the next frame while the lines are held low for the latch.
+ */
+#define WS281X_FLAG_PIPELINED (1 << 1)
+
+/** PRU1 streams the frame from DDR into the shared RAM for PRU0. */
+#define WS281X_FLAG_FETCH (1 << 2)
+
+/** Each pixel is 32 bits long, all of them sent, instead of the low 24. */
+#define WS281X_FLAG_32BIT (1 << 3)
+
+/** The PRU runs at 200 MHz. */
+#define WS281X_NS_PER_CYCLE 5
+
+/** Longest time in a ws281x_timing_t, in PRU cycles. */
+#define WS281X_TIMING_MAX 0xFFFF
+
+/** Nominal timing of an LED type, in ns. */
+struct ws281x_profile_t {
+  const char *name;
+  unsigned t0h;    // high time of a 0 bit
+  unsigned t1h;    // high time of a 1 bit
+  unsigned period; // time from the start of one bit to the next
+  unsigned latch;  // low time after a frame for the LEDs to latch it
+};
+
+/** Indices into ws281x_profiles. */
+enum ws281x_profile_id {
+  WS281X_WS2811_400KHZ,
+  WS281X_WS2812,
+  WS281X_SK6812,
+  WS281X_OVERCLOCK_1MHZ,
+  WS281X_NUM_PROFILES,
+};
+
+extern const ws281x_profile_t ws281x_profiles[WS281X_NUM_PROFILES];
+
+/** Bit timing in PRU cycles, read by the PRU at the start of each frame.
+ * The PRU keeps each time in 16 bits, so none can be more than
+ * WS281X_TIMING_MAX cycles.
+ *
+ * Changing this requires changes in ws281x.p
+ */
+struct ws281x_timing_t {
+  uint32_t t0h;
+  uint32_t t1h;
+  uint32_t period;
+  uint32_t latch;
+
+  ws281x_timing_t() {}
+  ws281x_timing_t(const ws281x_profile_t &profile)
+      : t0h(profile.t0h / WS281X_NS_PER_CYCLE),
+        t1h(profile.t1h / WS281X_NS_PER_CYCLE),
+        period(profile.period / WS281X_NS_PER_CYCLE),
+        latch(profile.latch / WS281X_NS_PER_CYCLE) {}
+} __attribute__((__packed__));
+
+/** A frame queued for the PRU. */
+struct ws281x_frame_t {
+  // in the DDR shared with the PRU
+  uint32_t pixels_dma;
+
+  // WS281X_FLAG_* bits describing the frame.
+  uint32_t flags;
+} __attribute__((__packed__));
+
+/** Pixel slots that PRU1 can fetch ahead of PRU0. */
+#define WS281X_FETCH_SLOTS 16
+
+/** Frame handoff between the PRUs, at the start of the PRU shared RAM.
+ *
+ * As PRU0 starts a frame with WS281X_FLAG_FETCH, which is always bit
+ * sliced, it fills in the frame and increments request.  PRU1 then copies
+ * the frame a slot at a time from DDR into the ring, up to WS281X_FETCH_SLOTS ahead of PRU0.  fetched and
+ * consumed count the slots copied by PRU1 and clocked out by PRU0.  Each
+ * frame starts at the beginning of the ring.
+ *
+ * Changing this requires changes in ws281x.p and ws281x_fetch.p
+ */
+struct ws281x_fetch_t {
+  uint32_t frame_addr; // in the DDR shared with the PRU
+  uint32_t slot_size;  // bytes in each pixel slot
+  uint32_t num_slots;
+  volatile uint32_t request;
+  volatile uint32_t fetched;
+  volatile uint32_t consumed;
+  uint32_t ring_end; // PRU address of the end of the slots in the ring
+  uint32_t reserved;
+  uint8_t ring[WS281X_FETCH_SLOTS * sizeof(bitslice_slot_t)];
+} __attribute__((__packed__));
+
+/** Pixel slots of a frame that send on the same channels.
+ *
+ * Changing this requires changes in ws281x.p
+ */
+struct ws281x_run_t {
+  uint32_t num_slots;
+
+  // Pixels in each slot, up to the last channel that is still sending.
+  uint32_t num_channels;
+
+  // Bytes from the start of an unsliced frame to the first slot.
+  uint32_t offset;
+
+  // Pins of the channels that are still sending on GPIO0 to GPIO3.
+  uint32_t gpio_mask[4];
+} __attribute__((__packed__));
+
+/** Command structure of ws281x_fetch.bin, in the PRU1 data RAM. */
+struct ws281x_fetch_command_t {
+  // write 0xFF to exit
+  volatile unsigned command;
+
+  // 1 once started, 0xFF once exited
+  volatile unsigned response;
 } __attribute__((__packed__));
 
 /** Command structure shared with the PRU.
@@ -31,7 +177,7 @@ struct pixel_t {
  */
 struct ws281x_command_t {
   // in the DDR shared with the PRU
-  uintptr_t pixels_dma;
+  uint32_t pixels_dma;
 
   // Length in pixels of the longest LED strip.
   unsigned num_pixels;
@@ -41,38 +187,235 @@ struct ws281x_command_t {
 
   // will have a non-zero response written when done
   volatile unsigned response;
-  ws281x_command_t(unsigned _num_pixels)
-      : pixels_dma(0), num_pixels(_num_pixels), command(0), response(0) {};
+
+  // Number of strips interleaved in the pixel slots of the frame.
+  unsigned num_channels;
+
+  // Pins in use on each of GPIO0 to GPIO3.
+  unsigned gpio_mask[4];
+
+  // WS281X_FLAG_* bits describing the frame, read with each command.
+  unsigned flags;
+
+  // Number of slots in the frame queue, or 0 to use the command instead.
+  // The PRU clocks out queue[queue_read] whenever it differs from
+  // queue_write, then advances queue_read past it once it is done.
+  unsigned queue_depth;
+  volatile unsigned queue_write;
+  volatile unsigned queue_read;
+
+  // Incremented each time the PRU finishes a frame with the queue empty.
+  volatile unsigned underruns;
+
+  ws281x_frame_t queue[WS281X_QUEUE_MAX];
+
+  // Bit timing, which the PRU reads into registers as it starts a frame.
+  ws281x_timing_t timing;
+
+  // Private to the PRU: the address of the frame and the cycle count that
+  // it started at, then the cycles that it took.
+  uint32_t frame_addr;
+  uint32_t cycles;
+
+  // Cycles that the last frame took to clock out, before its latch, and
+  // the number of frames clocked out.  The response is also the cycles.
+  volatile uint32_t frame_cycles;
+  volatile uint32_t frames_done;
+
+  // Cycles from the start of one frame to the start of the next, or 0 to
+  // start each one as soon as the last has latched.  The PRU stretches
+  // the latch to keep to it, and keeps the stretched latch time private.
+  unsigned frame_period;
+  uint32_t latch;
+
+  // The runs of slots that make up each frame, in the order that they go
+  // out and ended by a run of 0 slots.  The strips can be of different
+  // lengths, and the PRU stops sending on each one after its last pixel.
+  ws281x_run_t runs[WS281X_MAX_CHANNELS + 1];
+
+  ws281x_command_t(unsigned _num_pixels, unsigned _num_channels)
+      : pixels_dma(0), num_pixels(_num_pixels), command(0), response(0),
+        num_channels(_num_channels), flags(0), queue_depth(0),
+        queue_write(0), queue_read(0), underruns(0),
+        timing(ws281x_profiles[WS281X_WS2812]), frame_cycles(0),
+        frames_done(0), frame_period(0), runs() {
+    gpio_mask[0] = gpio_mask[1] = gpio_mask[2] = gpio_mask[3] = 0;
+  };
+
+  uint32_t setLengths(const uint16_t *lengths, uint32_t *slot_offset);
 
 } __attribute__((__packed__));
 
+/** Frame timings and counts, from PixelBone_Pixel::telemetry().
+ *
+ * The times are in ns over the last STATS_WINDOW frames.  transmit is the
+ * time that the PRU took to clock each frame out before its latch, from
+ * its cycle counter.  render is the time between show() calls that was
+ * not spent in wait(), prepare is the copying, correction and slicing in
+ * show(), and blocked is the time that show() and wait() slept on the PRU.
+ *
+ * Frames that block mostly are wire-bound, and frames that left the PRU
+ * with nothing to send are underruns, which are ARM-bound.  No frame is
+ * ever dropped, as show() waits for the PRU instead.
+ */
+struct pixel_telemetry_t {
+  stats_summary_t transmit;
+  stats_summary_t render;
+  stats_summary_t prepare;
+  stats_summary_t blocked;
+  uint64_t frames;         // shown
+  uint64_t frames_sent;    // clocked out by the PRU
+  uint64_t blocked_frames; // shown after sleeping on the PRU
+  uint64_t underruns;      // shown after the PRU ran out of frames
+};
+
+/** Called with the PRU's count of frames clocked out, once a frame is. */
+typedef void (*pixel_frame_callback_t)(void *arg, uint32_t frames_done);
+
 class PixelBone_Pixel {
   pru_t *pru0;
   uint32_t num_pixels;
+  uint32_t num_channels;
+  uint32_t stride;
+  uint16_t channel_length[WS281X_MAX_CHANNELS];
+  uint32_t *slot_offset;
   ws281x_command_t *ws281x;
   size_t buffer_size;
+  uint8_t num_buffers;
   uint8_t current_buffer_num;
   uint8_t brightness;
+  bitslice_t *slicer;
+  bool pipelined;
+  pru_t *pru1;
+  uint32_t fetch_slots;
+  uint8_t *shadow;
+  uint32_t dirty_words;
+  uint32_t *written;
+  uint32_t *behind;
+  uint32_t *unflushed;
+  size_t copied_bytes;
+  size_t frame_copied_bytes;
+  uint8_t gains[3];
+  float gamma;
+  color_t *color;
+  uint32_t *corrected;
+  uint16_t *deep;
+  uint8_t *dither_error;
+  char color_order[5];
+  bool white_extraction;
+  stats_t transmit_stats;
+  stats_t render_stats;
+  stats_t prepare_stats;
+  stats_t blocked_stats;
+  uint64_t last_show_ns;
+  uint64_t waited_ns;
+  uint32_t frames_done_seen;
+  uint32_t frames_handed;
+  unsigned underruns_base;
+  pixel_telemetry_t counts;
+  FILE *telemetry_file;
+  int telemetry_socket;
+  unsigned telemetry_interval;
+  pixel_frame_callback_t frame_callback;
+  void *frame_callback_arg;
 
 public:
   PixelBone_Pixel(uint16_t pixel_count);
+  PixelBone_Pixel(uint16_t pixel_count, uint8_t channels, uint16_t stride);
+  PixelBone_Pixel(const uint16_t *lengths, uint8_t channels,
+                  uint16_t stride = 0);
   ~PixelBone_Pixel();
   void show(void);
+  void showAt(uint64_t ns);
   void clear(void);
   void setPixelColor(uint32_t n, uint8_t r, uint8_t g, uint8_t b);
   void setPixelColor(uint32_t n, uint32_t c);
+  void setPixelColorRGBW(uint32_t n, uint8_t r, uint8_t g, uint8_t b,
+                         uint8_t w);
+  void setPixelColorWRGB(uint32_t n, uint32_t c);
   void setPixel(uint32_t n, pixel_t c);
+  void setPixelColor16(uint32_t n, uint16_t r, uint16_t g, uint16_t b);
+  void fill(uint32_t first, uint32_t count, uint32_t c);
+  void setPixels(uint32_t first, const uint32_t *colors, uint32_t count);
+  void setPixels(uint32_t first, const uint32_t *colors,
+                 const uint16_t *index, uint32_t count);
+  void setPixelsWRGB(uint32_t first, const uint32_t *colors, uint32_t count);
+  void setPixelsRGB(uint32_t first, const uint8_t *rgb, uint32_t count);
+  void setPixelsRGBA(uint32_t first, const uint8_t *rgba, uint32_t count);
+  void setPixelsHSL(uint32_t first, const uint16_t *hue,
+                    const uint8_t *saturation, const uint8_t *lightness,
+                    uint32_t count);
+  void setPixelsHSV(uint32_t first, const uint16_t *hue,
+                    const uint8_t *saturation, const uint8_t *value,
+                    uint32_t count);
   void moveToNextBuffer();
+  void setBitSlicing(bool enable);
+  void setFrameQueue(unsigned num_frames);
+  void setPipelining(bool enable);
+  void setDualPru(bool enable);
+  void setShadowBuffer(bool enable);
+  void flush();
+  void setDirtyTracking(bool enable);
+  void markDirty();
+  size_t dirtyBytes() const;
+  size_t copiedBytes() const;
+  void setBrightness(uint8_t brightness);
+  void setColorBalance(uint8_t r, uint8_t g, uint8_t b);
+  void setGamma(float gamma);
+  void setHighPrecision(bool enable);
+  void setColorOrder(const char *order);
+  void setWhiteExtraction(bool enable);
+  unsigned bitsPerPixel() const;
+  void setTiming(ws281x_profile_id profile);
+  void setTiming(const ws281x_profile_t &profile);
+  uint32_t frameTime() const;
+  void setFrameRate(unsigned hz);
+  void setFrameCallback(pixel_frame_callback_t callback, void *arg);
+  unsigned queuedFrames() const;
+  unsigned queueReadIndex() const;
+  unsigned underruns() const;
   uint32_t wait();
+  uint32_t tryWait();
+  int eventFd() const;
+  pixel_telemetry_t telemetry() const;
+  void resetTelemetry();
+  size_t formatTelemetry(char *buf, size_t len) const;
+  void setTelemetryExport(const char *dest, unsigned interval_frames);
   uint32_t numPixels() const;
+  uint32_t numChannels() const;
+  uint32_t channelLength(uint32_t channel) const;
   pixel_t *getCurrentBuffer() const;
   pixel_t *getPixel(uint32_t n) const;
   uint32_t getPixelColor(uint32_t n) const;
+  uint32_t getPixelColorWRGB(uint32_t n) const;
   static uint32_t Color(uint8_t red, uint8_t green, uint8_t blue);
   static uint32_t HSL(uint32_t hue, uint32_t saturation, uint32_t brightness);
+  static void HSL(const uint16_t *hue, const uint8_t *saturation,
+                  const uint8_t *lightness, uint32_t *colors, uint32_t count);
+  static uint32_t HSV(uint32_t hue, uint8_t saturation, uint8_t value);
+  static void HSV(const uint16_t *hue, const uint8_t *saturation,
+                  const uint8_t *value, uint32_t *colors, uint32_t count);
 
 private:
-  static uint32_t h2rgb(uint32_t v1, uint32_t v2, uint32_t hue);
+  bool contains(uint32_t n) const;
+  uint8_t *bufferBytes(unsigned buffer) const;
+  void allocShadow();
+  void allocDirty();
+  void freeDirty();
+  void markWords(uint32_t first, uint32_t last);
+  void markPixel(const pixel_t *p);
+  void flushBuffer(unsigned buffer);
+  void updateColor();
+  void allocCorrected();
+  size_t slicesSize() const;
+  uint32_t wordIndex(uint32_t n) const;
+  template <typename Write>
+  void writeSpan(uint32_t first, uint32_t count, Write write);
+  static uint32_t pixelWord(uint8_t r, uint8_t g, uint8_t b, uint8_t w = 0);
+  void drain();
+  ws281x_frame_t prepareFrame();
+  void pollFrames();
+  void exportTelemetry();
 };
 
 #endif
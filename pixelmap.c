@@ -0,0 +1,360 @@
+/** \file
+ * Maps from the positions of the LEDs of an irregular fixture to their
+ * indices in the strips.
+ *
+ * A map in memory is a single block laid out exactly as the binary file,
+ * whether it was mapped from one or built here, so saving it is one write.
+ * The header and row offsets of a mapped file are checked when it is
+ * opened, but the LEDs are not read until they are used, so the lookups
+ * check their positions and indices as they go instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pixelmap.h"
+#include "util.h"
+
+/** Positions are stored in 16 bits. */
+#define MAX_COORD 0xFFFFu
+
+/** Bytes in a map file, in 64 bits so that a bad header can not wrap. */
+static uint64_t image_size(const uint32_t height, const uint32_t num_leds) {
+  return sizeof(pixelmap_header_t) + (height + 1ull) * sizeof(uint32_t) +
+         (uint64_t)num_leds * sizeof(pixelmap_led_t);
+}
+
+/** Point a map at an image of a map file and check that it is one. */
+static pixelmap_t *attach(void *const data, const size_t size,
+                          const int mapped, const char *const name) {
+  const pixelmap_header_t *const header = data;
+  if (size < sizeof(*header) || memcmp(header->magic, PIXELMAP_MAGIC, 4))
+    die("%s is not a pixel map\n", name);
+  if (header->version != PIXELMAP_VERSION)
+    die("%s is version %u of the pixel map format, not %u\n", name,
+        header->version, PIXELMAP_VERSION);
+  if (header->height > MAX_COORD + 1 ||
+      size != image_size(header->height, header->num_leds))
+    die("%s is %zu bytes, not the size that its header says\n", name, size);
+
+  const uint32_t *const rows = (const uint32_t *)(header + 1);
+  for (uint32_t y = 0; y < header->height; y++)
+    if (rows[y] > rows[y + 1])
+      die("%s has row %u out of order\n", name, y);
+  if (rows[0] != 0 || rows[header->height] != header->num_leds)
+    die("%s has rows that do not cover its %u LEDs\n", name,
+        header->num_leds);
+
+  pixelmap_t *const map = calloc(1, sizeof(*map));
+  if (!map)
+    die("Unable to allocate a pixel map\n");
+  map->header = header;
+  map->rows = rows;
+  map->leds = (const pixelmap_led_t *)(rows + header->height + 1);
+  map->data = data;
+  map->size = size;
+  map->mapped = mapped;
+  return map;
+}
+
+static int compare_leds(const void *const a, const void *const b) {
+  const pixelmap_led_t *const p = a, *const q = b;
+  if (p->y != q->y)
+    return p->y < q->y ? -1 : 1;
+  if (p->x != q->x)
+    return p->x < q->x ? -1 : 1;
+  return p->z < q->z ? -1 : p->z > q->z;
+}
+
+pixelmap_t *pixelmap_points(const pixelmap_led_t *const leds,
+                            const uint32_t num_leds) {
+  // A map of no LEDs may get NULL back, which it never dereferences
+  pixelmap_led_t *const sorted = malloc(num_leds * sizeof(*sorted));
+  if (!sorted && num_leds)
+    die("Unable to allocate %u LEDs\n", num_leds);
+  memcpy(sorted, leds, num_leds * sizeof(*sorted));
+  qsort(sorted, num_leds, sizeof(*sorted), compare_leds);
+
+  pixelmap_header_t header;
+  memcpy(header.magic, PIXELMAP_MAGIC, 4);
+  header.version = PIXELMAP_VERSION;
+  header.width = header.height = header.depth = 0;
+  header.num_leds = num_leds;
+  header.num_indices = 0;
+  header.reserved = 0;
+  for (uint32_t i = 0; i < num_leds; i++) {
+    const pixelmap_led_t *const led = &sorted[i];
+    if (led->index == PIXELMAP_NONE)
+      die("LED at %u,%u,%u has no index\n", led->x, led->y, led->z);
+    if (i && !compare_leds(led, led - 1))
+      die("Two LEDs at %u,%u,%u\n", led->x, led->y, led->z);
+    if (led->x >= header.width)
+      header.width = led->x + 1;
+    if (led->z >= header.depth)
+      header.depth = led->z + 1;
+    if (led->index >= header.num_indices)
+      header.num_indices = led->index + 1;
+  }
+  header.height = num_leds ? sorted[num_leds - 1].y + 1 : 0;
+
+  const size_t size = image_size(header.height, num_leds);
+  uint8_t *const data = malloc(size);
+  if (!data)
+    die("Unable to allocate %zu for the pixel map\n", size);
+  memcpy(data, &header, sizeof(header));
+
+  uint32_t *const rows = (uint32_t *)(data + sizeof(header));
+  uint32_t i = 0;
+  for (uint32_t y = 0; y <= header.height; y++) {
+    rows[y] = i;
+    while (i < num_leds && sorted[i].y == y)
+      i++;
+  }
+  pixelmap_led_t *const out = (pixelmap_led_t *)(rows + header.height + 1);
+  for (i = 0; i < num_leds; i++) {
+    out[i] = sorted[i];
+    out[i].reserved = 0;
+  }
+  free(sorted);
+
+  return attach(data, size, 0, "pixel map");
+}
+
+pixelmap_t *pixelmap_grid(const uint32_t *const grid, const uint32_t width,
+                          const uint32_t height) {
+  if (width > MAX_COORD + 1 || height > MAX_COORD + 1)
+    die("Grid of %ux%u is larger than %u on a side\n", width, height,
+        MAX_COORD + 1);
+
+  pixelmap_led_t *const leds = malloc((size_t)width * height * sizeof(*leds));
+  if (!leds && width && height)
+    die("Unable to allocate a grid of %ux%u\n", width, height);
+
+  uint32_t num_leds = 0;
+  for (uint32_t y = 0; y < height; y++)
+    for (uint32_t x = 0; x < width; x++) {
+      const uint32_t index = grid[y * width + x];
+      if (index == PIXELMAP_NONE)
+        continue;
+      const pixelmap_led_t led = {x, y, 0, 0, index};
+      leds[num_leds++] = led;
+    }
+
+  pixelmap_t *const map = pixelmap_points(leds, num_leds);
+  free(leds);
+  return map;
+}
+
+/** Read the next number of a line, with a . for a missing number that is
+ * read as PIXELMAP_NONE.
+ *
+ * \return 1 for a number, 0 at the end of the line and -1 for anything
+ * else.
+ */
+static int next_number(const char **const p, unsigned long *const v) {
+  *p += strspn(*p, " \t\r\n,");
+  if (!**p)
+    return 0;
+
+  if (**p == '.') {
+    *v = PIXELMAP_NONE;
+    (*p)++;
+    return 1;
+  }
+
+  char *end;
+  errno = 0;
+  *v = strtoul(*p, &end, 10);
+  if (end == *p || errno || *v >= PIXELMAP_NONE || **p == '-')
+    return -1;
+  *p = end;
+  return 1;
+}
+
+static pixelmap_led_t *add_led(pixelmap_led_t *leds, uint32_t *const num_leds,
+                               uint32_t *const max_leds,
+                               const pixelmap_led_t led) {
+  if (*num_leds == *max_leds) {
+    *max_leds = *max_leds ? 2 * *max_leds : 1024;
+    leds = realloc(leds, *max_leds * sizeof(*leds));
+    if (!leds)
+      die("Unable to allocate %u LEDs\n", *max_leds);
+  }
+  leds[(*num_leds)++] = led;
+  return leds;
+}
+
+/** Parse a text map, which is either a grid or a list of points. */
+static pixelmap_t *parse(FILE *const file, const char *const path) {
+  enum { NONE, GRID, POINTS } kind = NONE;
+  pixelmap_led_t *leds = NULL;
+  uint32_t num_leds = 0, max_leds = 0, y = 0;
+  unsigned line_num = 0;
+  char *line = NULL;
+  size_t len = 0;
+
+  while (getline(&line, &len, file) >= 0) {
+    line_num++;
+    char *const comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+    const char *p = line + strspn(line, " \t\r\n");
+    if (!*p)
+      continue;
+
+    if (kind == NONE) {
+      const size_t word = strcspn(p, " \t\r\n");
+      if (p[word + strspn(p + word, " \t\r\n")])
+        die("%s:%u: expected grid or points\n", path, line_num);
+      if (word == 4 && !strncmp(p, "grid", 4))
+        kind = GRID;
+      else if (word == 6 && !strncmp(p, "points", 6))
+        kind = POINTS;
+      else
+        die("%s:%u: expected grid or points\n", path, line_num);
+      continue;
+    }
+
+    unsigned long v[5];
+    int n = 0, got;
+    uint32_t x = 0;
+    while ((got = next_number(&p, &v[n])) > 0) {
+      if (kind == POINTS) {
+        if (++n == 5)
+          break;
+        continue;
+      }
+
+      // Each number of a grid is the LED of the next x along the row
+      if (v[0] != PIXELMAP_NONE) {
+        if (x > MAX_COORD || y > MAX_COORD)
+          die("%s:%u: grid is larger than %u on a side\n", path, line_num,
+              MAX_COORD + 1);
+        const pixelmap_led_t led = {x, y, 0, 0, v[0]};
+        leds = add_led(leds, &num_leds, &max_leds, led);
+      }
+      x++;
+    }
+    if (got < 0)
+      die("%s:%u: expected %s\n", path, line_num,
+          kind == GRID ? "indices or ." : "numbers");
+    y++;
+    if (kind == GRID)
+      continue;
+
+    if (n != 3 && n != 4)
+      die("%s:%u: expected x, y, optionally z, and index\n", path, line_num);
+    for (int i = 0; i < n; i++)
+      if (v[i] == PIXELMAP_NONE || (i < n - 1 && v[i] > MAX_COORD))
+        die("%s:%u: expected positions up to %u and an index\n", path,
+            line_num, MAX_COORD);
+    const pixelmap_led_t led = {(uint16_t)v[0], (uint16_t)v[1],
+                                (uint16_t)(n == 4 ? v[2] : 0), 0,
+                                (uint32_t)v[n - 1]};
+    leds = add_led(leds, &num_leds, &max_leds, led);
+  }
+
+  if (kind == NONE)
+    die("%s is empty\n", path);
+  free(line);
+
+  pixelmap_t *const map = pixelmap_points(leds, num_leds);
+  free(leds);
+  return map;
+}
+
+pixelmap_t *pixelmap_open(const char *const path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    die("Unable to open %s: %s\n", path, strerror(errno));
+
+  char magic[4];
+  const ssize_t got = pread(fd, magic, sizeof(magic), 0);
+  if (got == sizeof(magic) && !memcmp(magic, PIXELMAP_MAGIC, 4)) {
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+      die("Unable to stat %s: %s\n", path, strerror(errno));
+    void *const data =
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+      die("Unable to map %s: %s\n", path, strerror(errno));
+    close(fd);
+    return attach(data, st.st_size, 1, path);
+  }
+
+  FILE *const file = fdopen(fd, "r");
+  if (!file)
+    die("Unable to read %s: %s\n", path, strerror(errno));
+  pixelmap_t *const map = parse(file, path);
+  fclose(file);
+  return map;
+}
+
+void pixelmap_save(const pixelmap_t *const map, const char *const path) {
+  FILE *const file = fopen(path, "wb");
+  if (!file)
+    die("Unable to create %s: %s\n", path, strerror(errno));
+  if (fwrite(map->data, map->size, 1, file) != 1 || fclose(file))
+    die("Unable to write %s: %s\n", path, strerror(errno));
+}
+
+void pixelmap_free(pixelmap_t *const map) {
+  if (!map)
+    return;
+  if (map->mapped)
+    munmap(map->data, map->size);
+  else
+    free(map->data);
+  free(map);
+}
+
+uint32_t pixelmap_find(const pixelmap_t *const map, const uint32_t x,
+                       const uint32_t y) {
+  if (y >= map->header->height)
+    return PIXELMAP_NONE;
+
+  // First LED of the row at or past x
+  uint32_t lo = map->rows[y], hi = map->rows[y + 1];
+  const uint32_t end = hi;
+  while (lo < hi) {
+    const uint32_t mid = lo + (hi - lo) / 2;
+    if (map->leds[mid].x < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == end || map->leds[lo].x != x)
+    return PIXELMAP_NONE;
+  return map->leds[lo].index;
+}
+
+void pixelmap_sample(const pixelmap_t *const map, const uint32_t *const canvas,
+                     const uint32_t width, const uint32_t height,
+                     uint32_t *const colors) {
+  const pixelmap_header_t *const header = map->header;
+  if (!header->width || !width || !height)
+    return;
+
+  // Steps across the canvas for each step across the map in 16.16 fixed
+  // point, starting from the middle of the first, so that a canvas the
+  // same size as the map is copied exactly
+  const uint64_t x_step = ((uint64_t)width << 16) / header->width;
+  const uint64_t y_step = ((uint64_t)height << 16) / header->height;
+
+  for (uint32_t y = 0; y < header->height; y++) {
+    const uint32_t cy = (y * y_step + y_step / 2) >> 16;
+    const uint32_t *const row = &canvas[(size_t)cy * width];
+
+    for (uint32_t i = map->rows[y]; i < map->rows[y + 1]; i++) {
+      const pixelmap_led_t *const led = &map->leds[i];
+      const uint32_t cx = (led->x * x_step + x_step / 2) >> 16;
+      if (cx < width && led->index < header->num_indices)
+        colors[led->index] = row[cx];
+    }
+  }
+}
@@ -0,0 +1,106 @@
+/** \file
+ * Maps from the positions of the LEDs of an irregular fixture to their
+ * indices in the strips.
+ *
+ * A map is a list of LEDs, each at an (x, y, z) position on a grid and
+ * with the index of the pixel that drives it, sorted by y, x and then z.
+ * Where each row starts in the list is kept alongside it, so finding the
+ * LED at a position is a binary search of one row and copying a canvas
+ * out to the LEDs reads the canvas in order.
+ *
+ * Maps are written by hand as text, either as a grid of indices or as a
+ * list of positions, and can be saved in a binary form that is the same
+ * as the map in memory.  Opening a binary map mmap()s it rather than
+ * reading it, so a map of millions of LEDs is ready at once and only the
+ * pages that are used are ever read in.
+ */
+#ifndef _pixelmap_h_
+#define _pixelmap_h_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PIXELMAP_MAGIC "PBPM"
+#define PIXELMAP_VERSION 1
+
+/** Index of a position with no LED. */
+#define PIXELMAP_NONE 0xFFFFFFFFu
+
+/** Header of a binary map file.
+ *
+ * It is followed by height + 1 uint32_t offsets of the first LED of each
+ * row, the last being num_leds, and then the num_leds LEDs, all in the
+ * byte order of the machine that wrote it.
+ */
+typedef struct {
+  char magic[4]; // "PBPM"
+  uint32_t version;
+  uint32_t width;       // one more than the largest x
+  uint32_t height;      // one more than the largest y
+  uint32_t depth;       // one more than the largest z
+  uint32_t num_leds;
+  uint32_t num_indices; // one more than the largest index
+  uint32_t reserved;
+} pixelmap_header_t;
+
+typedef struct {
+  uint16_t x, y, z;
+  uint16_t reserved;
+  uint32_t index;
+} pixelmap_led_t;
+
+/** A map in memory, laid out as in the file. */
+typedef struct {
+  const pixelmap_header_t *header;
+  const uint32_t *rows;
+  const pixelmap_led_t *leds;
+  void *data;
+  size_t size;
+  int mapped;
+} pixelmap_t;
+
+/** Open a binary map or parse a text one.
+ *
+ * A text map starts with a line of "grid" or "points", and # starts a
+ * comment.  A grid has a line for each row of the indices of the LEDs
+ * along it, with a . where there is none.  A list of points has a line
+ * for each LED of its x, y, optionally z, and index.
+ */
+extern pixelmap_t *pixelmap_open(const char *path);
+
+/** Build a map from a width by height grid of indices, with
+ * PIXELMAP_NONE where there is no LED.
+ */
+extern pixelmap_t *pixelmap_grid(const uint32_t *grid, uint32_t width,
+                                 uint32_t height);
+
+/** Build a map from a list of LEDs in any order. */
+extern pixelmap_t *pixelmap_points(const pixelmap_led_t *leds,
+                                   uint32_t num_leds);
+
+/** Write a map in the binary form that pixelmap_open() maps. */
+extern void pixelmap_save(const pixelmap_t *map, const char *path);
+
+extern void pixelmap_free(pixelmap_t *map);
+
+/** \return the index of the first LED at (x, y), or PIXELMAP_NONE. */
+extern uint32_t pixelmap_find(const pixelmap_t *map, uint32_t x, uint32_t y);
+
+/** Set colors[index] of each LED to the pixel of a width by height canvas
+ * at its position, scaled from the map to the canvas.
+ *
+ * colors holds num_indices colors.  Those of indices with no LED are left
+ * as they are.
+ */
+extern void pixelmap_sample(const pixelmap_t *map, const uint32_t *canvas,
+                            uint32_t width, uint32_t height,
+                            uint32_t *colors);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
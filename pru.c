@@ -8,10 +8,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 #include <prussdrv.h>
 #include <pruss_intc_mapping.h>
 #include "pru.h"
@@ -26,7 +28,48 @@ static unsigned int proc_read(const char *const fname) {
   return x;
 }
 
-pru_t *pru_init(const unsigned short pru_num) {
+static const pru_backend_t pru_hw_backend;
+
+/** The PRU subsystem and DDR window, shared by the open cores. */
+static struct {
+  unsigned users;
+  void *shared_ram;
+  void *ddr;
+  uintptr_t ddr_addr;
+  size_t ddr_size;
+  int ddr_devmem;
+  long map_us;
+} pruss;
+
+/** Map the uio driver's DDR window through /dev/mem.
+ *
+ * Only used if the driver can not map it itself.  The window is page
+ * aligned, so exactly that range is mapped.
+ */
+static void *pru_map_devmem(uintptr_t *const ddr_addr, size_t *const ddr_size) {
+  *ddr_addr = proc_read("/sys/class/uio/uio0/maps/map1/addr");
+  *ddr_size = proc_read("/sys/class/uio/uio0/maps/map1/size");
+
+  const int mem_fd = open("/dev/mem", O_RDWR);
+  if (mem_fd < 0)
+    die("Failed to open /dev/mem: %s\n", strerror(errno));
+
+  void *const ddr_mem = mmap(0, *ddr_size, PROT_WRITE | PROT_READ, MAP_SHARED,
+                             mem_fd, (off_t)*ddr_addr);
+  if (ddr_mem == MAP_FAILED)
+    die("Failed to mmap offset %" PRIxPTR " @ %zu bytes: %s\n", *ddr_addr,
+        *ddr_size, strerror(errno));
+
+  close(mem_fd);
+  return ddr_mem;
+}
+
+/** Set up the PRU subsystem for the first core to be opened. */
+static void pruss_open(void) {
+  // prussdrv_open() maps the PRU memories, including the DDR window
+  struct timespec map_start, map_end;
+  clock_gettime(CLOCK_MONOTONIC, &map_start);
+
   prussdrv_init();
 
   int ret = prussdrv_open(PRU_EVTOUT_0);
@@ -36,29 +79,42 @@ pru_t *pru_init(const unsigned short pru_num) {
   tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
   prussdrv_pruintc_init(&pruss_intc_initdata);
 
-  void *pru_data_mem;
-  prussdrv_map_prumem(pru_num == 0 ? PRUSS0_PRU0_DATARAM : PRUSS0_PRU1_DATARAM,
-                      &pru_data_mem);
-
-  const int mem_fd = open("/dev/mem", O_RDWR);
-  if (mem_fd < 0)
-    die("Failed to open /dev/mem: %s\n", strerror(errno));
+  if (prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, &pruss.shared_ram))
+    pruss.shared_ram = NULL;
+
+  // The uio driver maps just the DDR window that it set aside for the PRU
+  pruss.ddr_devmem = 0;
+  if (prussdrv_map_extmem(&pruss.ddr) == 0 && pruss.ddr &&
+      pruss.ddr != MAP_FAILED) {
+    pruss.ddr_addr = prussdrv_get_phys_addr(pruss.ddr);
+    pruss.ddr_size = prussdrv_extmem_size();
+  } else {
+    pruss.ddr = pru_map_devmem(&pruss.ddr_addr, &pruss.ddr_size);
+    pruss.ddr_devmem = 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &map_end);
+  pruss.map_us = (map_end.tv_sec - map_start.tv_sec) * 1000000 +
+                 (map_end.tv_nsec - map_start.tv_nsec) / 1000;
+}
 
-  const uintptr_t ddr_addr = proc_read("/sys/class/uio/uio0/maps/map1/addr");
-  const uintptr_t ddr_size = proc_read("/sys/class/uio/uio0/maps/map1/size");
+pru_t *pru_init(const unsigned short pru_num) {
+  if (pru_soft_enabled())
+    return pru_soft_init(pru_num);
+  if (pru_num > 1)
+    die("PRU %u requested, only 0 and 1 exist\n", pru_num);
 
-  const uintptr_t ddr_start = 0x10000000;
-  const uintptr_t ddr_offset = ddr_addr - ddr_start;
-  const size_t ddr_filelen = ddr_size + ddr_start;
+  if (!pruss.users)
+    pruss_open();
+  pruss.users++;
 
-  /* map the memory */
-  uint8_t *const ddr_mem = mmap(0, ddr_filelen, PROT_WRITE | PROT_READ,
-                                MAP_SHARED, mem_fd, ddr_offset);
-  if (ddr_mem == MAP_FAILED)
-    die("Failed to mmap offset %" PRIxPTR " @ %zu bytes: %s\n", ddr_offset,
-        ddr_filelen, strerror(errno));
+  // PRU0 interrupts the ARM on PRU_EVTOUT_0, which pruss_open() has set up
+  if (pru_num == 1 && prussdrv_open(PRU_EVTOUT_1))
+    die("prussdrv_open for PRU1 failed\n");
 
-  close(mem_fd);
+  void *pru_data_mem;
+  prussdrv_map_prumem(pru_num == 0 ? PRUSS0_PRU0_DATARAM : PRUSS0_PRU1_DATARAM,
+                      &pru_data_mem);
 
   pru_t *const pru = calloc(1, sizeof(*pru));
   if (!pru)
@@ -67,34 +123,97 @@ pru_t *pru_init(const unsigned short pru_num) {
   *pru = (pru_t) { .pru_num = pru_num,
                    .data_ram = pru_data_mem,
                    .data_ram_size = 8192, // how to determine?
-                   .ddr_addr = ddr_addr,
-                   .ddr = (void *)(ddr_mem + ddr_start),
-                   .ddr_size = ddr_size, };
+                   .shared_ram = pruss.shared_ram,
+                   .shared_ram_size = pruss.shared_ram ? 12288 : 0,
+                   .ddr_addr = pruss.ddr_addr,
+                   .ddr = pruss.ddr,
+                   .ddr_size = pruss.ddr_size,
+                   .backend = &pru_hw_backend, };
 
   printf("%s: PRU %d: data %p @ %zu bytes,  DMA %p / %" PRIxPTR
-         " @ %zu bytes\n",
+         " @ %zu bytes, mapped through %s in %ld us\n",
          __func__, pru_num, pru->data_ram, pru->data_ram_size, pru->ddr,
-         pru->ddr_addr, pru->ddr_size);
+         pru->ddr_addr, pru->ddr_size, pruss.ddr_devmem ? "/dev/mem" : "uio",
+         pruss.map_us);
 
   return pru;
 }
 
 void pru_exec(pru_t *const pru, const char *const program) {
+  pru->backend->exec(pru, program);
+}
+
+/** The program should have halted before the PRU is closed; use
+ * pru_wait_event() to wait for its exit interrupt.
+ */
+void pru_close(pru_t *const pru) { pru->backend->close(pru); }
+
+int pru_event_fd(const pru_t *const pru) {
+  return pru->backend->event_fd(pru);
+}
+
+int pru_wait_event(pru_t *const pru, const int timeout_ms) {
+  return pru->backend->wait_event(pru, timeout_ms);
+}
+
+static void pru_hw_exec(pru_t *const pru, const char *const program) {
   char *program_unconst = (char *)(uintptr_t)program;
   if (prussdrv_exec_program(pru->pru_num, program_unconst) < 0)
     die("%s failed", program);
 }
 
-void pru_close(pru_t *const pru) {
-  // \todo unmap memory
-  prussdrv_pru_wait_event(PRU_EVTOUT_0);
-  prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+static void pru_hw_close(pru_t *const pru) {
   prussdrv_pru_disable(pru->pru_num);
+  free(pru);
+
+  if (--pruss.users)
+    return;
+
+  // prussdrv_exit() unmaps the data RAM and its own DDR mapping
+  if (pruss.ddr_devmem)
+    munmap(pruss.ddr, pruss.ddr_size);
   prussdrv_exit();
 }
 
+static unsigned pru_host_interrupt(const pru_t *const pru) {
+  return pru->pru_num == 0 ? PRU_EVTOUT_0 : PRU_EVTOUT_1;
+}
+
+static int pru_hw_event_fd(const pru_t *const pru) {
+  return prussdrv_pru_event_fd(pru_host_interrupt(pru));
+}
+
+static int pru_hw_wait_event(pru_t *const pru, const int timeout_ms) {
+  struct pollfd pfd = {.fd = pru_hw_event_fd(pru), .events = POLLIN};
+
+  const int rc = poll(&pfd, 1, timeout_ms);
+  if (rc < 0 && errno != EINTR)
+    die("poll failed: %s\n", strerror(errno));
+  if (rc <= 0)
+    return 0;
+
+  // Consume the event count and re-enable the host interrupt, which the
+  // uio driver masks each time it fires.
+  prussdrv_pru_wait_event(pru_host_interrupt(pru));
+  prussdrv_pru_clear_event(pru_host_interrupt(pru),
+                           pru->pru_num == 0 ? PRU0_ARM_INTERRUPT
+                                             : PRU1_ARM_INTERRUPT);
+  return 1;
+}
+
+static const pru_backend_t pru_hw_backend = {
+    .exec = pru_hw_exec,
+    .close = pru_hw_close,
+    .event_fd = pru_hw_event_fd,
+    .wait_event = pru_hw_wait_event,
+};
+
 int pru_gpio(const unsigned gpio, const unsigned pin, const unsigned direction,
              const unsigned initial_value) {
+  // There are no pins to configure for the software PRU
+  if (pru_soft_enabled())
+    return 0;
+
   const unsigned pin_num = gpio * 32 + pin;
   const char *export_name = "/sys/class/gpio/export";
   FILE *const export = fopen(export_name, "w");
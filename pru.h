@@ -13,10 +13,14 @@ extern "C" {
 #include <inttypes.h>
 #include "util.h"
 
+struct pru_backend;
+
 /** Mapping of the PRU memory spaces.
  *
  * The PRU has a small, fast local data RAM that is mapped into ARM memory,
- * as well as slower access to the DDR RAM of the ARM.
+ * as well as slower access to the DDR RAM of the ARM.  The shared RAM and
+ * DDR are the same for both cores, so both can be open at once to hand
+ * data from one to the other.
  */
 typedef struct {
   unsigned pru_num;
@@ -24,17 +28,76 @@ typedef struct {
   void *data_ram;       // PRU data ram in ARM space
   size_t data_ram_size; // size in bytes of the PRU's data RAM
 
+  void *shared_ram;       // PRU shared RAM in ARM space
+  size_t shared_ram_size; // size in bytes of the shared RAM
+
   void *ddr;          // PRU DMA address (in ARM space)
   uintptr_t ddr_addr; // PRU DMA address (in PRU space)
   size_t ddr_size;    // Size in bytes of the shared space
+
+  const struct pru_backend *backend; // hardware or software PRU
+  void *priv;                        // backend private state
 } pru_t;
 
+/** Operations behind the pru_* functions.
+ *
+ * The hardware backend uses prussdrv.  Setting PIXELBONE_PRU=soft in the
+ * environment selects the software backend instead, which provides the
+ * memory spaces from anonymous memory and runs an emulation of the PRU
+ * program in a thread, so that everything above this layer runs on any
+ * Linux machine.
+ */
+typedef struct pru_backend {
+  void (*exec)(pru_t *const pru, const char *const program);
+  void (*close)(pru_t *const pru);
+  int (*event_fd)(const pru_t *const pru);
+  int (*wait_event)(pru_t *const pru, const int timeout_ms);
+} pru_backend_t;
+
+/** Open PRU core 0 or 1.
+ *
+ * The first core to be opened sets up the PRU subsystem and the DDR
+ * window, which stay until the last one is closed.
+ */
 extern pru_t *pru_init(const unsigned short pru_num);
 
 extern void pru_exec(pru_t *const pru, const char *const program);
 
 extern void pru_close(pru_t *const pru);
 
+/** File descriptor that becomes readable when the PRU raises its ARM
+ * interrupt.  Suitable for poll() or epoll; call pru_wait_event() once it
+ * is readable to acknowledge the event.
+ */
+extern int pru_event_fd(const pru_t *const pru);
+
+/** Sleep until the PRU raises its ARM interrupt and re-arm it.
+ *
+ * A negative timeout waits forever.
+ * \return 1 if there was an event, 0 on timeout.
+ */
+extern int pru_wait_event(pru_t *const pru, const int timeout_ms);
+
+/** Emulation of a PRU program, run in a thread by the software backend.
+ *
+ * It returns when the program would have halted.
+ */
+typedef void pru_emulator_t(pru_t *const pru);
+
+/** True if PIXELBONE_PRU=soft selects the software backend. */
+extern int pru_soft_enabled(void);
+
+extern pru_t *pru_soft_init(const unsigned short pru_num);
+
+/** Run emulator in place of any program with the same file name when
+ * using the software backend.
+ */
+extern void pru_soft_register(const char *const program,
+                              pru_emulator_t *const emulator);
+
+/** Raise the ARM interrupt from an emulated program. */
+extern void pru_soft_raise_event(pru_t *const pru);
+
 /** Configure a GPIO pin.
  *
  * Since the device tree won't do it for us, we need to do it via
@@ -0,0 +1,192 @@
+/** \file
+ * Software PRU backend.
+ *
+ * The data RAM, shared RAM and DDR window come from anonymous memory and
+ * the ARM interrupt is an eventfd.  Both cores see the same shared RAM
+ * and DDR.  pru_exec() looks up the emulator registered
+ * for the program and runs it in a thread, which talks to the ARM side
+ * through the same shared memory the real PRU would.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "pru.h"
+
+#define PRU_SOFT_DATA_RAM_SIZE 8192
+#define PRU_SOFT_SHARED_RAM_SIZE 12288
+#define PRU_SOFT_DDR_SIZE (8 << 20)
+#define PRU_SOFT_DDR_ADDR 0x80000000
+#define PRU_SOFT_MAX_EMULATORS 8
+
+typedef struct {
+  int event_fd;
+  pthread_t thread;
+  int running;
+  pru_emulator_t *emulator;
+} pru_soft_t;
+
+static struct {
+  const char *program;
+  pru_emulator_t *emulator;
+} emulators[PRU_SOFT_MAX_EMULATORS];
+
+/** Memory shared by the open cores. */
+static struct {
+  unsigned users;
+  void *shared_ram;
+  void *ddr;
+} pruss;
+
+static const pru_backend_t pru_soft_backend;
+
+int pru_soft_enabled(void) {
+  const char *const backend = getenv("PIXELBONE_PRU");
+  return backend && strcmp(backend, "soft") == 0;
+}
+
+/** Programs are matched by file name so "./ws281x.bin" finds "ws281x.bin". */
+static const char *basename_of(const char *const path) {
+  const char *const slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+void pru_soft_register(const char *const program,
+                       pru_emulator_t *const emulator) {
+  for (unsigned i = 0; i < PRU_SOFT_MAX_EMULATORS; i++) {
+    if (emulators[i].program &&
+        strcmp(emulators[i].program, basename_of(program)) != 0)
+      continue;
+    emulators[i].program = basename_of(program);
+    emulators[i].emulator = emulator;
+    return;
+  }
+
+  die("too many PRU emulators\n");
+}
+
+static void *pru_soft_map(const size_t size) {
+  void *const mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    die("mmap failed: %s\n", strerror(errno));
+  return mem;
+}
+
+pru_t *pru_soft_init(const unsigned short pru_num) {
+  pru_soft_t *const soft = calloc(1, sizeof(*soft));
+  pru_t *const pru = calloc(1, sizeof(*pru));
+  if (!soft || !pru)
+    die("calloc failed: %s\n", strerror(errno));
+
+  soft->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (soft->event_fd < 0)
+    die("eventfd failed: %s\n", strerror(errno));
+
+  if (!pruss.users++) {
+    pruss.shared_ram = pru_soft_map(PRU_SOFT_SHARED_RAM_SIZE);
+    pruss.ddr = pru_soft_map(PRU_SOFT_DDR_SIZE);
+  }
+
+  *pru = (pru_t){.pru_num = pru_num,
+                 .data_ram = pru_soft_map(PRU_SOFT_DATA_RAM_SIZE),
+                 .data_ram_size = PRU_SOFT_DATA_RAM_SIZE,
+                 .shared_ram = pruss.shared_ram,
+                 .shared_ram_size = PRU_SOFT_SHARED_RAM_SIZE,
+                 .ddr_addr = PRU_SOFT_DDR_ADDR,
+                 .ddr = pruss.ddr,
+                 .ddr_size = PRU_SOFT_DDR_SIZE,
+                 .backend = &pru_soft_backend,
+                 .priv = soft, };
+
+  fprintf(stderr, "%s: software PRU%u, %zu bytes of DDR\n", __func__,
+          pru_num, pru->ddr_size);
+
+  return pru;
+}
+
+static void *pru_soft_thread(void *const arg) {
+  pru_t *const pru = arg;
+  pru_soft_t *const soft = pru->priv;
+
+  soft->emulator(pru);
+  return NULL;
+}
+
+static void pru_soft_exec(pru_t *const pru, const char *const program) {
+  pru_soft_t *const soft = pru->priv;
+
+  for (unsigned i = 0; i < PRU_SOFT_MAX_EMULATORS; i++)
+    if (emulators[i].program &&
+        strcmp(emulators[i].program, basename_of(program)) == 0)
+      soft->emulator = emulators[i].emulator;
+
+  if (!soft->emulator)
+    die("%s: no emulator for the software PRU\n", program);
+
+  const int rc = pthread_create(&soft->thread, NULL, pru_soft_thread, pru);
+  if (rc)
+    die("pthread_create failed: %s\n", strerror(rc));
+  soft->running = 1;
+}
+
+static void pru_soft_close(pru_t *const pru) {
+  pru_soft_t *const soft = pru->priv;
+
+  if (soft->running)
+    pthread_join(soft->thread, NULL);
+
+  close(soft->event_fd);
+  munmap(pru->data_ram, pru->data_ram_size);
+  free(soft);
+  free(pru);
+
+  if (--pruss.users)
+    return;
+
+  munmap(pruss.shared_ram, PRU_SOFT_SHARED_RAM_SIZE);
+  munmap(pruss.ddr, PRU_SOFT_DDR_SIZE);
+}
+
+void pru_soft_raise_event(pru_t *const pru) {
+  pru_soft_t *const soft = pru->priv;
+  const uint64_t one = 1;
+
+  if (write(soft->event_fd, &one, sizeof(one)) != sizeof(one))
+    warn("eventfd write failed: %s\n", strerror(errno));
+}
+
+static int pru_soft_event_fd(const pru_t *const pru) {
+  const pru_soft_t *const soft = pru->priv;
+  return soft->event_fd;
+}
+
+static int pru_soft_wait_event(pru_t *const pru, const int timeout_ms) {
+  pru_soft_t *const soft = pru->priv;
+  struct pollfd pfd = {.fd = soft->event_fd, .events = POLLIN};
+
+  const int rc = poll(&pfd, 1, timeout_ms);
+  if (rc < 0 && errno != EINTR)
+    die("poll failed: %s\n", strerror(errno));
+  if (rc <= 0)
+    return 0;
+
+  // Reading the eventfd resets it, like acknowledging the interrupt
+  uint64_t count;
+  if (read(soft->event_fd, &count, sizeof(count)) != sizeof(count))
+    return 0;
+  return 1;
+}
+
+static const pru_backend_t pru_soft_backend = {
+    .exec = pru_soft_exec,
+    .close = pru_soft_close,
+    .event_fd = pru_soft_event_fd,
+    .wait_event = pru_soft_wait_event,
+};
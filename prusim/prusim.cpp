@@ -0,0 +1,1129 @@
+/** \file
+ * Cycle counting simulator for the PRU that runs ws281x.bin on the host.
+ *
+ * The simulator loads the binary that pasm produces and executes it
+ * against a model of one PRU: the register file, its 8 KB data RAM, the
+ * shared RAM, the control registers with the cycle counter at 0x2200C,
+ * the constant table, a window of DDR and the set and clear registers of
+ * GPIO0 to GPIO3.  It plays the ARM side of the ws281x_command_t protocol,
+ * handing the program a number of random frames, and records every edge
+ * on the pins of the active channels.
+ *
+ * The edges are decoded back into bits and compared with the frames, and
+ * the high and low times, the reset time and the frame time are checked
+ * against the LED timing spec.  The exit status is non-zero if any of
+ * them are out of spec, so this can be run on every change to ws281x.p.
+ *
+ * Every instruction takes one cycle except for the memory accesses,
+ * which use the estimates below.  Loads from DDR go through the L3
+ * interconnect and vary with the ARM's own traffic, so their latency can
+ * be set on the command line to test the worst case.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <getopt.h>
+#include "../pixel.hpp"
+
+#define PRU_NS_PER_CYCLE 5
+#define PRU_IRAM_WORDS 2048
+#define PRU_DRAM_SIZE 8192
+#define PRU_SHARED_SIZE 12288
+
+/** Each core's view of the PRU subsystem.  The control registers of
+ * PRU1 follow those of PRU0.
+ */
+#define PRU_DRAM_ADDR 0x00000
+#define PRU_OTHER_DRAM_ADDR 0x02000
+#define PRU_SHARED_ADDR 0x10000
+#define PRU_CTRL_ADDR 0x22000
+#define PRU_CTRL_STRIDE 0x2000
+#define PRU_CFG_ADDR 0x26000
+#define PRU_CFG_SIZE 0x100
+#define PRU_LOCAL_END 0x80000
+
+/** Offsets of the control registers. */
+#define CTRL_CONTROL 0x00
+#define CTRL_CYCLE 0x0C
+#define CTRL_CTBIR0 0x20
+#define CTRL_CTBIR1 0x24
+#define CTRL_CTPPR0 0x28
+#define CTRL_CTPPR1 0x2C
+#define CTRL_COUNTER_ENABLE (1 << 3)
+
+/** Where the uio driver usually puts the shared DDR window. */
+#define SIM_DDR_ADDR 0x9C940000u
+#define SIM_DDR_SIZE (4 << 20)
+
+#define GPIO_CLEARDATAOUT 0x190
+#define GPIO_SETDATAOUT 0x194
+#define GPIO_SIZE 0x1000
+
+static const uint32_t gpio_base[4] = {0x44E07000, 0x4804C000, 0x481AC000,
+                                      0x481AE000};
+
+/** PRU0_ARM_INTERRUPT, as raised through R31. */
+#define ARM_EVENT 19
+
+/** Cycles for local loads and stores.  Each extra 4 bytes of a burst
+ * takes another cycle.
+ */
+#define LOCAL_LOAD_CYCLES 3
+#define STORE_CYCLES 2
+#define DEFAULT_DDR_CYCLES 40
+
+/** Shortest low time that is taken as the gap between two frames. */
+#define FRAME_GAP_NS 10000
+
+/** Timing windows in ns, for the high and low times of each bit. */
+struct spec_t {
+  const char *name;
+  unsigned t0h[2], t0l[2], t1h[2], t1l[2];
+  unsigned reset;
+};
+
+static const spec_t specs[] = {
+    {"ws2812", {250, 550}, {700, 1000}, {650, 950}, {300, 600}, 50000},
+    {"ws2811", {100, 400}, {850, 1150}, {450, 750}, {500, 800}, 50000},
+    {"ws2811-400k", {350, 650}, {1850, 2150}, {1050, 1350}, {1150, 1450},
+     50000},
+    {"sk6812", {150, 450}, {750, 1050}, {450, 750}, {450, 750}, 80000},
+};
+
+/** The library's timing profiles and the spec that each should meet. */
+static const struct {
+  const char *name;
+  ws281x_profile_id profile;
+  const char *spec;
+} profiles[] = {
+    {"ws2811-400k", WS281X_WS2811_400KHZ, "ws2811-400k"},
+    {"ws2812", WS281X_WS2812, "ws2812"},
+    {"sk6812", WS281X_SK6812, "sk6812"},
+    {"1mhz", WS281X_OVERCLOCK_1MHZ, NULL},
+};
+
+/** Memory and devices that both cores see. */
+struct pruss_sim_t {
+  uint8_t dram[2][PRU_DRAM_SIZE];
+  uint8_t shared[PRU_SHARED_SIZE];
+  uint8_t cfg[PRU_CFG_SIZE];
+  uint8_t *ddr;
+  unsigned ddr_cycles;
+
+  uint32_t gpio_out[4];
+};
+
+struct pru_sim_t {
+  unsigned num;
+  pruss_sim_t *pruss;
+
+  uint32_t r[32];
+  uint32_t pc;
+  unsigned carry;
+  bool halted;
+
+  uint64_t now; // cycles since the program started
+
+  uint32_t iram[PRU_IRAM_WORDS];
+
+  uint32_t control;
+  uint32_t cycle;
+  uint32_t ctbir[2];
+  uint32_t ctppr[2];
+};
+
+/** Recorded behaviour of one channel. */
+struct channel_t {
+  unsigned gpio, pin;
+  bool level;
+  uint64_t rise, fall; // ns of the last edges
+  bool have_bit;
+
+  uint32_t bits_in_frame;
+  uint32_t value; // bits of the current pixel
+  unsigned frame;
+
+  unsigned t0h[2], t0l[2], t1h[2], t1l[2];
+  uint64_t min_reset;
+  unsigned last_bit;
+  unsigned errors;
+};
+
+/** The ARM side of the protocol. */
+struct host_t {
+  unsigned num_frames;
+  unsigned num_channels;
+  unsigned num_pixels; // of the longest channel
+  uint16_t lengths[WS281X_MAX_CHANNELS];
+  bool uneven; // lengths were given rather than num_pixels
+  unsigned queue_depth;
+  bool sliced;
+  bool pipelined;
+  bool fetch; // PRU1 runs ws281x_fetch.bin
+  unsigned rate; // frames per second, or 0 to send them back to back
+  unsigned bits; // per pixel, 24 or 32
+  ws281x_profile_id profile;
+  unsigned decode_ns; // bits high for longer than this are ones
+
+  unsigned num_buffers;
+  size_t buffer_size;
+  size_t slices_size;
+  bitslice_t *slicer;
+  uint32_t *slot_offset;
+
+  uint32_t *expected; // frames x channels x pixels
+  unsigned sent;
+  unsigned done;
+  bool command_pending;
+  bool exit_sent;
+
+  uint64_t frame_start_ns;
+  uint64_t min_frame_ns, max_frame_ns;
+  uint64_t min_sent_ns, max_sent_ns; // as counted by the PRU
+  uint64_t min_period_ns, max_period_ns; // after the first frame
+};
+
+static FILE *trace;
+static channel_t channels[WS281X_MAX_CHANNELS];
+static host_t host;
+
+static ws281x_command_t *command_of(pru_sim_t *const sim) {
+  return (ws281x_command_t *)sim->pruss->dram[0];
+}
+
+/** Field encodings used by the register operands. */
+static unsigned field_shift(const unsigned field) {
+  static const unsigned shift[8] = {0, 8, 16, 24, 0, 8, 16, 0};
+  return shift[field];
+}
+
+static uint32_t field_mask(const unsigned field) {
+  if (field < 4)
+    return 0xFF;
+  if (field < 7)
+    return 0xFFFF;
+  return 0xFFFFFFFF;
+}
+
+static unsigned field_bits(const unsigned field) {
+  return field < 4 ? 8 : field < 7 ? 16 : 32;
+}
+
+static uint32_t reg_read(const pru_sim_t *const sim, const unsigned reg,
+                         const unsigned field) {
+  // R31 reads the input pins and the host interrupt status, all zero here
+  const uint32_t value = reg == 31 ? 0 : sim->r[reg];
+  return (value >> field_shift(field)) & field_mask(field);
+}
+
+static void host_event(pru_sim_t *const sim);
+
+static void reg_write(pru_sim_t *const sim, const unsigned reg,
+                      const unsigned field, const uint32_t value) {
+  const uint32_t mask = field_mask(field) << field_shift(field);
+  const uint32_t merged =
+      (sim->r[reg] & ~mask) | ((value << field_shift(field)) & mask);
+
+  if (reg != 31) {
+    sim->r[reg] = merged;
+    return;
+  }
+
+  // Writing R31 with bit 5 set strobes system event 16 + bits 3:0
+  if ((merged & (1 << 5)) && 16 + (merged & 0xF) == ARM_EVENT)
+    host_event(sim);
+}
+
+static uint64_t now_ns(const pru_sim_t *const sim) {
+  return sim->now * PRU_NS_PER_CYCLE;
+}
+
+/** Record the pins that changed on a GPIO bank. */
+static void gpio_write(pru_sim_t *const sim, const unsigned bank,
+                       const uint32_t out) {
+  const uint32_t changed = sim->pruss->gpio_out[bank] ^ out;
+  sim->pruss->gpio_out[bank] = out;
+
+  for (unsigned c = 0; c < host.num_channels; c++) {
+    channel_t *const ch = &channels[c];
+    if (ch->gpio != bank || !(changed & (1u << ch->pin)))
+      continue;
+
+    const uint64_t t = now_ns(sim);
+    ch->level = (out >> ch->pin) & 1;
+    if (trace)
+      fprintf(trace, "%llu %u %u\n", (unsigned long long)t, c, ch->level);
+
+    if (ch->level) {
+      // The low time of the previous bit ends here, unless it was reset
+      if (ch->have_bit) {
+        const uint64_t low = t - ch->fall;
+        if (low >= FRAME_GAP_NS) {
+          if (low < ch->min_reset)
+            ch->min_reset = low;
+        } else {
+          unsigned *const range = ch->last_bit ? ch->t1l : ch->t0l;
+          if (low < range[0])
+            range[0] = low;
+          if (low > range[1])
+            range[1] = low;
+        }
+      }
+      ch->rise = t;
+      continue;
+    }
+
+    const uint64_t high = t - ch->rise;
+    const unsigned bit = high > host.decode_ns;
+    unsigned *const range = bit ? ch->t1h : ch->t0h;
+    if (high < range[0])
+      range[0] = high;
+    if (high > range[1])
+      range[1] = high;
+
+    ch->fall = t;
+    ch->have_bit = true;
+    ch->last_bit = bit;
+    ch->value = (ch->value << 1) | bit;
+
+    if (++ch->bits_in_frame % host.bits)
+      continue;
+
+    // A whole pixel has been clocked out
+    const unsigned slot = ch->bits_in_frame / host.bits - 1;
+    if (ch->frame < host.num_frames) {
+      const uint32_t expected =
+          host.expected[(ch->frame * host.num_channels + c) * host.num_pixels +
+                        slot];
+      if (ch->value != expected) {
+        if (!ch->errors)
+          fprintf(stderr, "channel %u frame %u pixel %u: sent %0*x, "
+                          "expected %0*x\n",
+                  c, ch->frame, slot, host.bits / 4, ch->value, host.bits / 4,
+                  expected);
+        ch->errors++;
+      }
+    } else {
+      ch->errors++;
+    }
+
+    if (ch->bits_in_frame == host.bits * host.lengths[c]) {
+      ch->bits_in_frame = 0;
+      ch->frame++;
+    }
+    ch->value = 0;
+  }
+}
+
+/** Locate PRU memory that is plain RAM. */
+static uint8_t *mem_ptr(pru_sim_t *const sim, const uint32_t addr,
+                        const unsigned len) {
+  pruss_sim_t *const pruss = sim->pruss;
+
+  if (addr + len <= PRU_DRAM_ADDR + PRU_DRAM_SIZE)
+    return &pruss->dram[sim->num][addr - PRU_DRAM_ADDR];
+  if (addr >= PRU_OTHER_DRAM_ADDR &&
+      addr + len <= PRU_OTHER_DRAM_ADDR + PRU_DRAM_SIZE)
+    return &pruss->dram[!sim->num][addr - PRU_OTHER_DRAM_ADDR];
+  if (addr >= PRU_SHARED_ADDR && addr + len <= PRU_SHARED_ADDR + PRU_SHARED_SIZE)
+    return &pruss->shared[addr - PRU_SHARED_ADDR];
+  if (addr >= PRU_CFG_ADDR && addr + len <= PRU_CFG_ADDR + PRU_CFG_SIZE)
+    return &pruss->cfg[addr - PRU_CFG_ADDR];
+  if (addr >= SIM_DDR_ADDR && addr + len <= SIM_DDR_ADDR + SIM_DDR_SIZE)
+    return &pruss->ddr[addr - SIM_DDR_ADDR];
+  return NULL;
+}
+
+static uint32_t *ctrl_reg(pru_sim_t *const sim, const uint32_t offset) {
+  switch (offset) {
+  case CTRL_CONTROL:
+    return &sim->control;
+  case CTRL_CYCLE:
+    return &sim->cycle;
+  case CTRL_CTBIR0:
+    return &sim->ctbir[0];
+  case CTRL_CTBIR1:
+    return &sim->ctbir[1];
+  case CTRL_CTPPR0:
+    return &sim->ctppr[0];
+  case CTRL_CTPPR1:
+    return &sim->ctppr[1];
+  }
+  return NULL;
+}
+
+/** Copy a burst between the register file and memory, a word at a time
+ * for the registers and devices.
+ */
+static void mem_access(pru_sim_t *const sim, const uint32_t addr,
+                       uint8_t *const regs, const unsigned len,
+                       const bool load) {
+  uint8_t *const mem = mem_ptr(sim, addr, len);
+  if (mem) {
+    if (load)
+      memcpy(regs, mem, len);
+    else
+      memcpy(mem, regs, len);
+    return;
+  }
+
+  for (unsigned i = 0; i < len; i += 4) {
+    const uint32_t word_addr = addr + i;
+    uint32_t value = 0;
+    uint32_t *reg = NULL;
+    int bank = -1;
+
+    const uint32_t ctrl_addr = PRU_CTRL_ADDR + sim->num * PRU_CTRL_STRIDE;
+    if (word_addr >= ctrl_addr && word_addr < ctrl_addr + 0x30)
+      reg = ctrl_reg(sim, word_addr - ctrl_addr);
+    for (unsigned b = 0; b < 4; b++)
+      if (word_addr >= gpio_base[b] && word_addr < gpio_base[b] + GPIO_SIZE)
+        bank = b;
+
+    if ((word_addr & 3) || len - i < 4 || (!reg && bank < 0))
+      die("pc %u: %s of %u bytes at unmapped address 0x%08x\n", sim->pc,
+          load ? "load" : "store", len, addr);
+
+    if (load) {
+      if (reg)
+        value = *reg;
+      memcpy(&regs[i], &value, 4);
+      continue;
+    }
+
+    memcpy(&value, &regs[i], 4);
+    if (reg) {
+      *reg = value;
+    } else if (word_addr - gpio_base[bank] == GPIO_CLEARDATAOUT) {
+      gpio_write(sim, bank, sim->pruss->gpio_out[bank] & ~value);
+    } else if (word_addr - gpio_base[bank] == GPIO_SETDATAOUT) {
+      gpio_write(sim, bank, sim->pruss->gpio_out[bank] | value);
+    }
+  }
+}
+
+static uint32_t constant(const pru_sim_t *const sim, const unsigned index) {
+  static const uint32_t table[32] = {
+      0x00020000, 0x48040000, 0x4802A000, 0x00030000, 0x00026000, 0x48060000,
+      0x48030000, 0x00028000, 0x46000000, 0x4A100000, 0x48318000, 0x48022000,
+      0x48024000, 0x48310000, 0x481CC000, 0x481D0000, 0x481A0000, 0x4819C000,
+      0x48300000, 0x48302000, 0x48304000, 0x00032400, 0x480C8000, 0x480CA000,
+  };
+
+  // The rest are set by the CTBIR and CTPPR registers
+  switch (index) {
+  case 24:
+    return (sim->ctbir[0] & 0xFF) << 8;
+  case 25:
+    return 0x00002000 | ((sim->ctbir[0] >> 16) & 0xFF) << 8;
+  case 26:
+    return 0x0002E000;
+  case 27:
+    return 0x00032000;
+  case 28:
+    return (sim->ctppr[0] & 0xFFFF) << 8;
+  case 29:
+    return 0x49000000 | ((sim->ctppr[0] >> 16) & 0xFFFF) << 8;
+  case 30:
+    return 0x40000000 | (sim->ctppr[1] & 0xFFFF) << 8;
+  case 31:
+    return 0x80000000 | ((sim->ctppr[1] >> 16) & 0xFFFF) << 8;
+  }
+  return table[index];
+}
+
+/** Second operand: an 8 bit immediate or a register field. */
+static uint32_t op2(const pru_sim_t *const sim, const uint32_t op) {
+  if (op & (1 << 24))
+    return (op >> 16) & 0xFF;
+  return reg_read(sim, (op >> 16) & 0x1F, (op >> 21) & 7);
+}
+
+static int branch_offset(const uint32_t op) {
+  const int offset = ((op >> 25) & 3) << 8 | (op & 0xFF);
+  return offset & 0x200 ? offset - 0x400 : offset;
+}
+
+static unsigned arithmetic(pru_sim_t *const sim, const uint32_t op) {
+  const unsigned dst = op & 0x1F, dst_field = (op >> 5) & 7;
+  const uint32_t a = reg_read(sim, (op >> 8) & 0x1F, (op >> 13) & 7);
+  const uint32_t b = op2(sim, op);
+  const unsigned bits = field_bits(dst_field);
+  uint64_t result;
+
+  switch ((op >> 25) & 0xF) {
+  case 0: // ADD
+    result = (uint64_t)a + b;
+    sim->carry = (result >> bits) & 1;
+    break;
+  case 1: // ADC
+    result = (uint64_t)a + b + sim->carry;
+    sim->carry = (result >> bits) & 1;
+    break;
+  case 2: // SUB
+    result = (uint64_t)a - b;
+    sim->carry = a < b;
+    break;
+  case 3: // SUC
+    result = (uint64_t)a - b - sim->carry;
+    sim->carry = (uint64_t)a < (uint64_t)b + sim->carry;
+    break;
+  case 4: // LSL
+    result = (uint64_t)a << (b & 0x1F);
+    break;
+  case 5: // LSR
+    result = a >> (b & 0x1F);
+    break;
+  case 6: // RSB
+    result = (uint64_t)b - a;
+    sim->carry = b < a;
+    break;
+  case 7: // RSC
+    result = (uint64_t)b - a - sim->carry;
+    sim->carry = (uint64_t)b < (uint64_t)a + sim->carry;
+    break;
+  case 8: // AND
+    result = a & b;
+    break;
+  case 9: // OR
+    result = a | b;
+    break;
+  case 10: // XOR
+    result = a ^ b;
+    break;
+  case 11: // NOT
+    result = ~a;
+    break;
+  case 12: // MIN
+    result = a < b ? a : b;
+    break;
+  case 13: // MAX
+    result = a > b ? a : b;
+    break;
+  case 14: // CLR
+    result = a & ~(1u << (b & 0x1F));
+    break;
+  default: // SET
+    result = a | (1u << (b & 0x1F));
+    break;
+  }
+
+  reg_write(sim, dst, dst_field, result);
+  sim->pc++;
+  return 1;
+}
+
+static unsigned burst(pru_sim_t *const sim, const uint32_t op,
+                      const bool constant_base) {
+  const bool load = op & (1 << 28);
+  const unsigned reg_byte = (op & 0x1F) * 4 + ((op >> 5) & 3);
+  const unsigned code =
+      ((op >> 25) & 7) << 4 | ((op >> 13) & 7) << 1 | ((op >> 7) & 1);
+  const unsigned len =
+      code < 124 ? code + 1 : (sim->r[0] >> (8 * (code - 124))) & 0xFF;
+  const unsigned base_index = (op >> 8) & 0x1F;
+  const uint32_t base =
+      constant_base ? constant(sim, base_index) : sim->r[base_index];
+  const uint32_t addr = base + op2(sim, op);
+
+  if (reg_byte + len > sizeof(sim->r))
+    die("pc %u: burst of %u bytes runs past r31\n", sim->pc, len);
+
+  mem_access(sim, addr, (uint8_t *)sim->r + reg_byte, len, load);
+  sim->pc++;
+
+  const unsigned words = (len + 3) / 4;
+  if (!load)
+    return STORE_CYCLES + words - 1;
+  if (addr < PRU_LOCAL_END)
+    return LOCAL_LOAD_CYCLES + words - 1;
+  return sim->pruss->ddr_cycles + words - 1;
+}
+
+/** Execute one instruction.
+ *
+ * \return the number of cycles that it took.
+ */
+static unsigned step(pru_sim_t *const sim) {
+  if (sim->pc >= PRU_IRAM_WORDS)
+    die("pc %u is past the end of the instruction RAM\n", sim->pc);
+
+  const uint32_t op = sim->iram[sim->pc];
+  const unsigned dst = op & 0x1F, dst_field = (op >> 5) & 7;
+
+  switch (op >> 29) {
+  case 0:
+    return arithmetic(sim, op);
+  case 1:
+    break;
+  case 2:
+  case 3: {
+    // QBxx: branch if OP is greater, equal or less than the register
+    const unsigned cond = (op >> 27) & 7;
+    const uint32_t a = reg_read(sim, (op >> 8) & 0x1F, (op >> 13) & 7);
+    const uint32_t b = op2(sim, op);
+    const bool taken = cond == 7 || ((cond & 4) && b > a) ||
+                       ((cond & 2) && b == a) || ((cond & 1) && b < a);
+    sim->pc += taken ? branch_offset(op) : 1;
+    return 1;
+  }
+  case 4:
+    return burst(sim, op, true);
+  case 6: {
+    // QBBS and QBBC
+    const uint32_t a = reg_read(sim, (op >> 8) & 0x1F, (op >> 13) & 7);
+    const bool set = (a >> (op2(sim, op) & 0x1F)) & 1;
+    const bool taken = ((op >> 27) & 3) == 2 ? set : !set;
+    sim->pc += taken ? branch_offset(op) : 1;
+    return 1;
+  }
+  case 7:
+    return burst(sim, op, false);
+  default:
+    die("pc %u: unsupported instruction %08x\n", sim->pc, op);
+  }
+
+  const uint32_t target =
+      op & (1 << 24) ? (op >> 8) & 0xFFFF
+                     : reg_read(sim, (op >> 16) & 0x1F, (op >> 21) & 7);
+
+  switch ((op >> 25) & 0xF) {
+  case 0: // JMP
+    sim->pc = target;
+    return 1;
+  case 1: // JAL
+    reg_write(sim, dst, dst_field, sim->pc + 1);
+    sim->pc = target;
+    return 1;
+  case 2: // LDI
+    reg_write(sim, dst, dst_field, (op >> 8) & 0xFFFF);
+    sim->pc++;
+    return 1;
+  case 3: { // LMBD
+    const unsigned src_field = (op >> 13) & 7;
+    const uint32_t a = reg_read(sim, (op >> 8) & 0x1F, src_field);
+    const unsigned want = op2(sim, op) & 1;
+    unsigned bit = 32;
+    for (int i = field_bits(src_field) - 1; i >= 0; i--) {
+      if (((a >> i) & 1) == want) {
+        bit = i;
+        break;
+      }
+    }
+    reg_write(sim, dst, dst_field, bit);
+    sim->pc++;
+    return 1;
+  }
+  case 5: // HALT
+    sim->halted = true;
+    return 1;
+  }
+
+  die("pc %u: unsupported instruction %08x\n", sim->pc, op);
+}
+
+/** Run the cores side by side, always stepping the one that is furthest
+ * behind.  PRU1 is told to exit once PRU0 has halted.
+ */
+static void run(pru_sim_t *const cores, const unsigned num_cores,
+                const uint64_t max_cycles) {
+  while (!cores[num_cores - 1].halted || !cores[0].halted) {
+    pru_sim_t *sim = &cores[0];
+    if (num_cores > 1 && !cores[1].halted &&
+        (cores[0].halted || cores[1].now < cores[0].now))
+      sim = &cores[1];
+
+    if (cores[0].halted)
+      ((ws281x_fetch_command_t *)sim->pruss->dram[1])->command = 0xFF;
+
+    if (sim->now > max_cycles)
+      die("PRU%u still running after %llu cycles, pc %u\n", sim->num,
+          (unsigned long long)sim->now, sim->pc);
+
+    const unsigned cycles = step(sim);
+    sim->now += cycles;
+    if (sim->control & CTRL_COUNTER_ENABLE)
+      sim->cycle += cycles;
+  }
+}
+
+/** Render frame n into its buffer and return it for the PRU. */
+static ws281x_frame_t host_frame(pru_sim_t *const sim, const unsigned n) {
+  const unsigned buffer = n % host.num_buffers;
+  const size_t offset = buffer * host.buffer_size;
+  uint32_t *const pixels = (uint32_t *)(sim->pruss->ddr + offset);
+  ws281x_frame_t frame;
+
+  for (unsigned c = 0; c < host.num_channels; c++) {
+    for (unsigned p = 0; p < host.lengths[c]; p++) {
+      const uint32_t value =
+          ((uint32_t)rand() << 16 ^ rand()) >> (32 - host.bits);
+      pixels[host.slot_offset[p] + c] = value;
+      host.expected[(n * host.num_channels + c) * host.num_pixels + p] = value;
+    }
+  }
+
+  const uint32_t pipelined = (host.pipelined ? WS281X_FLAG_PIPELINED : 0) |
+                             (host.fetch ? WS281X_FLAG_FETCH : 0) |
+                             (host.bits == 32 ? WS281X_FLAG_32BIT : 0);
+  if (!host.sliced) {
+    frame.pixels_dma = SIM_DDR_ADDR + offset;
+    frame.flags = pipelined;
+    return frame;
+  }
+
+  const size_t slices = host.num_buffers * host.buffer_size +
+                        buffer * host.slices_size;
+  uint8_t *out = sim->pruss->ddr + slices;
+  for (const ws281x_run_t *run = command_of(sim)->runs; run->num_slots;
+       run++) {
+    bitslice_frame_channels(host.slicer, out, &pixels[run->offset / 4],
+                            run->num_slots, run->num_channels);
+    out += run->num_slots * BITSLICE_SLOT_SIZE(host.bits);
+  }
+  frame.pixels_dma = SIM_DDR_ADDR + slices;
+  frame.flags = WS281X_FLAG_SLICED | pipelined;
+  return frame;
+}
+
+/** Hand the next frame to the PRU the way show() does. */
+static void host_send(pru_sim_t *const sim) {
+  ws281x_command_t *const cmd = command_of(sim);
+
+  if (host.queue_depth) {
+    while (host.sent < host.num_frames &&
+           (cmd->queue_write + 1) % host.queue_depth != cmd->queue_read) {
+      cmd->queue[cmd->queue_write] = host_frame(sim, host.sent++);
+      cmd->queue_write = (cmd->queue_write + 1) % host.queue_depth;
+    }
+    return;
+  }
+
+  if (cmd->command || host.sent == host.num_frames)
+    return;
+
+  const ws281x_frame_t frame = host_frame(sim, host.sent++);
+  cmd->pixels_dma = frame.pixels_dma;
+  cmd->flags = frame.flags;
+  cmd->command = 1;
+  host.command_pending = true;
+}
+
+/** The PRU has raised its ARM interrupt. */
+static void host_event(pru_sim_t *const sim) {
+  ws281x_command_t *const cmd = command_of(sim);
+
+  if (host.command_pending && !cmd->command) {
+    // The command has been taken and the frame started
+    host.command_pending = false;
+    host.frame_start_ns = now_ns(sim);
+    host_send(sim);
+    return;
+  }
+
+  if (host.exit_sent)
+    return;
+
+  const uint64_t frame_ns = now_ns(sim) - host.frame_start_ns;
+  if (frame_ns < host.min_frame_ns)
+    host.min_frame_ns = frame_ns;
+  if (frame_ns > host.max_frame_ns)
+    host.max_frame_ns = frame_ns;
+  if (host.done && frame_ns < host.min_period_ns)
+    host.min_period_ns = frame_ns;
+  if (host.done && frame_ns > host.max_period_ns)
+    host.max_period_ns = frame_ns;
+  const uint64_t sent_ns = (uint64_t)cmd->frame_cycles * PRU_NS_PER_CYCLE;
+  if (sent_ns < host.min_sent_ns)
+    host.min_sent_ns = sent_ns;
+  if (sent_ns > host.max_sent_ns)
+    host.max_sent_ns = sent_ns;
+  host.frame_start_ns = now_ns(sim);
+
+  if (++host.done < host.num_frames) {
+    host_send(sim);
+    return;
+  }
+
+  cmd->command = 0xFF;
+  host.exit_sent = true;
+}
+
+static void host_init(pru_sim_t *const sim) {
+  ws281x_command_t *const cmd = command_of(sim);
+  *cmd = ws281x_command_t(host.num_pixels, host.num_channels);
+  cmd->timing = ws281x_timing_t(ws281x_profiles[host.profile]);
+  host.decode_ns = (ws281x_profiles[host.profile].t0h +
+                    ws281x_profiles[host.profile].t1h) / 2;
+
+  host.slot_offset =
+      (uint32_t *)calloc(host.num_pixels + 1, sizeof(*host.slot_offset));
+  if (!host.slot_offset)
+    die("calloc failed\n");
+  const uint32_t words = cmd->setLengths(host.lengths, host.slot_offset);
+
+  uint8_t gpio[WS281X_MAX_CHANNELS], pin[WS281X_MAX_CHANNELS];
+  for (unsigned c = 0; c < host.num_channels; c++) {
+    gpio[c] = channels[c].gpio = ws281x_pins[c].gpio;
+    pin[c] = channels[c].pin = ws281x_pins[c].pin;
+
+    channels[c].t0h[0] = channels[c].t0l[0] = ~0u;
+    channels[c].t1h[0] = channels[c].t1l[0] = ~0u;
+    channels[c].min_reset = ~0ull;
+  }
+
+  host.num_buffers = host.queue_depth ? host.queue_depth : 2;
+  host.buffer_size = words * sizeof(uint32_t);
+  host.slices_size = host.num_pixels * BITSLICE_SLOT_SIZE(host.bits);
+  if (host.sliced)
+    host.slicer = bitslice_init(host.num_channels, host.bits, gpio, pin);
+  if (host.num_buffers * (host.buffer_size + host.slices_size) > SIM_DDR_SIZE)
+    die("%u pixels do not fit in the simulated DDR\n", host.num_pixels);
+
+  host.expected = (uint32_t *)calloc(
+      host.num_frames * host.num_channels * host.num_pixels, sizeof(uint32_t));
+  if (!host.expected)
+    die("calloc failed\n");
+
+  host.min_frame_ns = host.min_sent_ns = host.min_period_ns = ~0ull;
+  cmd->queue_depth = host.queue_depth;
+  if (host.rate)
+    cmd->frame_period = 1000000000u / host.rate / PRU_NS_PER_CYCLE;
+  host_send(sim);
+}
+
+static bool check_range(const char *const name, const unsigned *const seen,
+                        const unsigned *const limits) {
+  if (seen[0] > seen[1]) {
+    printf("%-6s      -            [%5u, %5u]\n", name, limits[0], limits[1]);
+    return true;
+  }
+
+  const bool ok = seen[0] >= limits[0] && seen[1] <= limits[1];
+  printf("%-6s %5u - %5u ns   [%5u, %5u] %s\n", name, seen[0], seen[1],
+         limits[0], limits[1], ok ? "ok" : "OUT OF SPEC");
+  return ok;
+}
+
+static void merge(unsigned *const all, const unsigned *const one) {
+  if (one[0] < all[0])
+    all[0] = one[0];
+  if (one[1] > all[1])
+    all[1] = one[1];
+}
+
+/** Print the measured timing and return true if it is all in spec. */
+static bool report(const pru_sim_t *const sim, const spec_t *const spec) {
+  unsigned t0h[2] = {~0u, 0}, t0l[2] = {~0u, 0};
+  unsigned t1h[2] = {~0u, 0}, t1l[2] = {~0u, 0};
+  uint64_t min_reset = ~0ull;
+  unsigned errors = 0;
+  bool ok = true;
+
+  for (unsigned c = 0; c < host.num_channels; c++) {
+    const channel_t *const ch = &channels[c];
+    merge(t0h, ch->t0h);
+    merge(t0l, ch->t0l);
+    merge(t1h, ch->t1h);
+    merge(t1l, ch->t1l);
+    if (ch->min_reset < min_reset)
+      min_reset = ch->min_reset;
+    errors += ch->errors;
+
+    // The low time after the last frame lasts until the program exits
+    const unsigned frames = host.lengths[c] ? host.num_frames : 0;
+    if (ch->frame != frames || ch->bits_in_frame) {
+      printf("channel %u: %u whole frames and %u bits sent, expected %u "
+             "frames\n",
+             c, ch->frame, ch->bits_in_frame, frames);
+      ok = false;
+    }
+  }
+
+  printf("%u frames of %s%u %u bit pixels on %u channels%s%s%s, %s timing\n",
+         host.num_frames, host.uneven ? "up to " : "", host.num_pixels,
+         host.bits, host.num_channels,
+         host.sliced ? ", bit sliced" : "",
+         host.pipelined ? ", pipelined" : "",
+         host.fetch ? ", fetched by PRU1" : "",
+         ws281x_profiles[host.profile].name);
+  printf("frame  %llu - %llu ns\n", (unsigned long long)host.min_frame_ns,
+         (unsigned long long)host.max_frame_ns);
+  printf("sent   %llu - %llu ns before the latch, counted by the PRU\n",
+         (unsigned long long)host.min_sent_ns,
+         (unsigned long long)host.max_sent_ns);
+  printf("run    %llu ns\n", (unsigned long long)now_ns(sim));
+
+  // Frames start a whole frame period apart, and finish within a bit
+  // period of that.  Pipelined frames finish before their latch, so they
+  // also spread as much as the times that they take to send.
+  if (host.rate && host.num_frames > 1) {
+    const uint64_t period_ns = 1000000000u / host.rate;
+    uint64_t slack_ns = ws281x_profiles[host.profile].period;
+    if (host.pipelined)
+      slack_ns += host.max_sent_ns - host.min_sent_ns;
+    const bool rate_ok = host.min_period_ns + slack_ns >= period_ns &&
+                         host.max_period_ns <= period_ns + slack_ns;
+    printf("rate   %llu - %llu ns     [%llu] %s\n",
+           (unsigned long long)host.min_period_ns,
+           (unsigned long long)host.max_period_ns,
+           (unsigned long long)period_ns, rate_ok ? "ok" : "OFF RATE");
+    ok &= rate_ok;
+  }
+
+  if (!spec) {
+    printf("no spec to check the timing against\n");
+    printf("bits   %u pixel errors\n", errors);
+    return ok && !errors;
+  }
+
+  printf("spec   %s\n", spec->name);
+  ok &= check_range("T0H", t0h, spec->t0h);
+  ok &= check_range("T0L", t0l, spec->t0l);
+  ok &= check_range("T1H", t1h, spec->t1h);
+  ok &= check_range("T1L", t1l, spec->t1l);
+
+  if (host.num_frames > 1) {
+    const bool reset_ok = min_reset >= spec->reset;
+    printf("reset  %llu ns min    [%5u, ...] %s\n",
+           (unsigned long long)min_reset, spec->reset,
+           reset_ok ? "ok" : "OUT OF SPEC");
+    ok &= reset_ok;
+  }
+
+  printf("bits   %u pixel errors\n", errors);
+  return ok && !errors;
+}
+
+static void load_program(pru_sim_t *const sim, const char *const file) {
+  FILE *const f = fopen(file, "rb");
+  if (!f)
+    die("%s: Unable to open: %s\n", file, strerror(errno));
+
+  const size_t words = fread(sim->iram, sizeof(uint32_t), PRU_IRAM_WORDS, f);
+  fclose(f);
+  if (!words)
+    die("%s: empty program\n", file);
+}
+
+static void usage(const char *const prog) {
+  fprintf(stderr,
+          "Usage: %s [options] [ws281x.bin]\n"
+          "  -c, --channels N    number of channels (1)\n"
+          "  -n, --pixels N      pixels per channel (8)\n"
+          "  -l, --lengths N,... pixels on each channel, instead of -c and -n\n"
+          "  -f, --frames N      frames to send (3)\n"
+          "  -q, --queue N       use a frame queue of N slots\n"
+          "  -s, --sliced        send bit sliced frames, as is always done\n"
+          "                      for more than %u channels\n"
+          "  -P, --pipelined     start each frame during the last one's latch\n"
+          "  -F, --fetch FILE    run FILE on PRU1 to fetch the frames, which\n"
+          "                      are then always bit sliced\n"
+          "  -w, --rgbw          send 32 bit RGBW pixels\n"
+          "  -r, --rate HZ       lock the frames to HZ frames/sec\n"
+          "  -d, --ddr-cycles N  latency of a DDR load (%u)\n"
+          "  -p, --profile NAME  ws2811-400k, ws2812, sk6812 or 1mhz (ws2812)\n"
+          "  -S, --spec NAME     ws2812, ws2811, ws2811-400k or sk6812\n"
+          "                      (the spec of the profile)\n"
+          "  -t, --trace FILE    write every edge as: ns channel level\n",
+          prog, WS281X_UNSLICED_CHANNELS, DEFAULT_DDR_CYCLES);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {
+      {"channels", required_argument, NULL, 'c'},
+      {"pixels", required_argument, NULL, 'n'},
+      {"lengths", required_argument, NULL, 'l'},
+      {"frames", required_argument, NULL, 'f'},
+      {"queue", required_argument, NULL, 'q'},
+      {"sliced", no_argument, NULL, 's'},
+      {"pipelined", no_argument, NULL, 'P'},
+      {"fetch", required_argument, NULL, 'F'},
+      {"rgbw", no_argument, NULL, 'w'},
+      {"rate", required_argument, NULL, 'r'},
+      {"ddr-cycles", required_argument, NULL, 'd'},
+      {"profile", required_argument, NULL, 'p'},
+      {"spec", required_argument, NULL, 'S'},
+      {"trace", required_argument, NULL, 't'},
+      {NULL, 0, NULL, 0},
+  };
+
+  pruss_sim_t *const pruss = (pruss_sim_t *)calloc(1, sizeof(*pruss));
+  pru_sim_t *const sim = (pru_sim_t *)calloc(2, sizeof(*sim));
+  const char *fetch_program = NULL;
+  const spec_t *spec = &specs[0];
+  const char *spec_name = NULL;
+  if (!pruss || !sim)
+    die("calloc failed\n");
+
+  for (unsigned i = 0; i < 2; i++) {
+    sim[i].num = i;
+    sim[i].pruss = pruss;
+  }
+
+  pruss->ddr_cycles = DEFAULT_DDR_CYCLES;
+  host.num_channels = 1;
+  host.num_pixels = 8;
+  host.num_frames = 3;
+  host.profile = WS281X_WS2812;
+  host.bits = 24;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:n:l:f:q:sPF:wr:d:p:S:t:", options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'c':
+      host.num_channels = atoi(optarg);
+      break;
+    case 'n':
+      host.num_pixels = atoi(optarg);
+      break;
+    case 'l': {
+      char *end = optarg;
+      host.uneven = true;
+      host.num_channels = 0;
+      do {
+        if (host.num_channels == WS281X_MAX_CHANNELS)
+          usage(argv[0]);
+        host.lengths[host.num_channels++] = strtoul(end, &end, 0);
+      } while (*end++ == ',');
+      break;
+    }
+    case 'f':
+      host.num_frames = atoi(optarg);
+      break;
+    case 'q':
+      host.queue_depth = atoi(optarg);
+      break;
+    case 's':
+      host.sliced = true;
+      break;
+    case 'P':
+      host.pipelined = true;
+      break;
+    case 'F':
+      host.fetch = true;
+      fetch_program = optarg;
+      break;
+    case 'w':
+      host.bits = 32;
+      break;
+    case 'r':
+      host.rate = atoi(optarg);
+      break;
+    case 'd':
+      pruss->ddr_cycles = atoi(optarg);
+      break;
+    case 'p': {
+      bool found = false;
+      for (const auto &p : profiles) {
+        if (strcmp(p.name, optarg) != 0)
+          continue;
+        host.profile = p.profile;
+        if (!spec_name)
+          spec = NULL;
+        for (const spec_t &s : specs)
+          if (!spec_name && p.spec && strcmp(s.name, p.spec) == 0)
+            spec = &s;
+        found = true;
+      }
+      if (!found)
+        usage(argv[0]);
+      break;
+    }
+    case 'S':
+      spec = NULL;
+      spec_name = optarg;
+      for (const spec_t &s : specs)
+        if (strcmp(s.name, optarg) == 0)
+          spec = &s;
+      if (!spec)
+        usage(argv[0]);
+      break;
+    case 't':
+      trace = strcmp(optarg, "-") == 0 ? stdout : fopen(optarg, "w");
+      if (!trace)
+        die("%s: Unable to open: %s\n", optarg, strerror(errno));
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (host.num_channels < 1 || host.num_channels > WS281X_MAX_CHANNELS)
+    usage(argv[0]);
+  if (host.uneven) {
+    host.num_pixels = 0;
+    for (unsigned c = 0; c < host.num_channels; c++)
+      if (host.lengths[c] > host.num_pixels)
+        host.num_pixels = host.lengths[c];
+  } else {
+    for (unsigned c = 0; c < host.num_channels; c++)
+      host.lengths[c] = host.num_pixels;
+  }
+
+  // The library slices the frames of channels that the PRU can not test,
+  // and every frame that PRU1 fetches
+  if (host.num_channels > WS281X_UNSLICED_CHANNELS || host.fetch)
+    host.sliced = true;
+
+  if (host.num_pixels < 1 || host.num_frames < 1 || host.queue_depth == 1 ||
+      host.queue_depth > WS281X_QUEUE_MAX || optind + 1 < argc)
+    usage(argv[0]);
+
+  load_program(sim, optind < argc ? argv[optind] : "ws281x.bin");
+
+  if (fetch_program)
+    load_program(&sim[1], fetch_program);
+
+  pruss->ddr = (uint8_t *)calloc(1, SIM_DDR_SIZE);
+  if (!pruss->ddr)
+    die("calloc failed\n");
+  pruss->cfg[4] = 1 << 4; // SYSCFG comes up with STANDBY_INIT set
+
+  if (trace) {
+    fprintf(trace, "# ns channel level\n");
+    for (unsigned c = 0; c < host.num_channels; c++)
+      fprintf(trace, "# channel %u is gpio%u_%u\n", c, ws281x_pins[c].gpio,
+              ws281x_pins[c].pin);
+  }
+
+  host_init(sim);
+
+  // Enough for every bit to take a few times longer than it should
+  const ws281x_timing_t timing(ws281x_profiles[host.profile]);
+  uint64_t frame_cycles =
+      host.num_pixels * host.bits * timing.period + timing.latch + 20000;
+  if (host.rate)
+    frame_cycles += 1000000000u / host.rate / PRU_NS_PER_CYCLE;
+  const uint64_t max_cycles = (uint64_t)host.num_frames * frame_cycles * 4;
+  run(sim, host.fetch ? 2 : 1, max_cycles);
+
+  if (command_of(sim)->response != 0xFF)
+    die("pc %u: halted without writing the exit response\n", sim->pc);
+  if (host.fetch &&
+      ((ws281x_fetch_command_t *)pruss->dram[1])->response != 0xFF)
+    die("PRU1 pc %u: halted without writing the exit response\n", sim[1].pc);
+  if (trace && trace != stdout)
+    fclose(trace);
+
+  bool ok = report(sim, spec);
+
+  if (host.fetch) {
+    // Every slot of every frame should have gone through the ring, with a
+    // request for each frame
+    const ws281x_fetch_t *const fetch = (ws281x_fetch_t *)pruss->shared;
+    const unsigned slots = host.num_frames * host.num_pixels;
+    const unsigned requests = host.num_frames;
+    const bool fetch_ok = fetch->request == requests &&
+                          fetch->fetched == slots && fetch->consumed == slots;
+    printf("fetch  %u requests, %u slots fetched, %u clocked out %s\n",
+           fetch->request, fetch->fetched, fetch->consumed,
+           fetch_ok ? "ok" : "MISSING");
+    ok &= fetch_ok;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,52 @@
+/** \file
+ * Rolling percentiles of frame timings.
+ *
+ * The percentiles are nearest rank: the p99 of 100 samples is the 99th
+ * smallest, so a single slow frame in the window shows up only in the max.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+
+void stats_reset(stats_t *const stats) {
+  stats->num_samples = 0;
+  stats->next = 0;
+}
+
+void stats_add(stats_t *const stats, const uint32_t value) {
+  stats->samples[stats->next] = value;
+  stats->next = (stats->next + 1) % STATS_WINDOW;
+  if (stats->num_samples < STATS_WINDOW)
+    stats->num_samples++;
+}
+
+static int compare_u32(const void *const a, const void *const b) {
+  const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/** Sample at a percentile of n sorted samples. */
+static uint32_t rank(const uint32_t *const sorted, const unsigned n,
+                     const unsigned percent) {
+  const unsigned r = (n * percent + 99) / 100;
+  return sorted[r ? r - 1 : 0];
+}
+
+stats_summary_t stats_summary(const stats_t *const stats) {
+  stats_summary_t summary = {0, 0, 0, 0};
+  const unsigned n = stats->num_samples;
+  uint32_t sorted[STATS_WINDOW];
+
+  if (!n)
+    return summary;
+
+  // Until the window is full the samples start at 0
+  memcpy(sorted, stats->samples, n * sizeof(*sorted));
+  qsort(sorted, n, sizeof(*sorted), compare_u32);
+
+  summary.p50 = rank(sorted, n, 50);
+  summary.p99 = rank(sorted, n, 99);
+  summary.max = sorted[n - 1];
+  summary.num_samples = n;
+  return summary;
+}
@@ -0,0 +1,45 @@
+/** \file
+ * Rolling percentiles of frame timings.
+ *
+ * Each series keeps its last STATS_WINDOW samples in a ring, so that the
+ * percentiles follow the load of the last few seconds rather than the
+ * whole run.  Adding a sample is a store; the samples are only sorted
+ * when a summary is asked for.
+ */
+#ifndef _stats_h_
+#define _stats_h_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STATS_WINDOW 1024
+
+typedef struct {
+  uint32_t samples[STATS_WINDOW];
+  unsigned num_samples; // in the window, up to STATS_WINDOW
+  unsigned next;        // index of the oldest once the window is full
+} stats_t;
+
+/** Median, 99th percentile and largest of the samples in the window. */
+typedef struct {
+  uint32_t p50;
+  uint32_t p99;
+  uint32_t max;
+  unsigned num_samples;
+} stats_summary_t;
+
+extern void stats_reset(stats_t *stats);
+
+extern void stats_add(stats_t *stats, uint32_t value);
+
+/** \return all 0 if there are no samples. */
+extern stats_summary_t stats_summary(const stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
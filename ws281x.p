@@ -9,34 +9,59 @@
  //* To stop, the ARM can write a 0xFF to the command, which will
  //* cause the PRU code to exit.
  //*
- //* At 800 KHz:
- //*  0 is 0.25 usec high, 1 usec low
- //*  1 is 0.60 usec high, 0.65 usec low
+ //* The ARM interrupt is raised when a command is taken and at the
+ //* end of every frame, so the ARM can sleep instead of polling.
+ //*
+ //* The bit timing is read from the timing block in the command into
+ //* registers at the start of every frame, so that the ARM can choose the
+ //* LED type.  Every edge is timed from the start of its bit.  With
+ //* a frame period set the latch is stretched so that each frame starts
+ //* that many cycles after the last one did, if it is ready by then.  For
+ //* a WS2812 at 800 KHz:
+ //*  0 is 0.40 usec high, 0.85 usec low
+ //*  1 is 0.80 usec high, 0.45 usec low
  //*  Reset is 50 usec
  //
  // Pins are not contiguous.
- // 1 pins on GPIO0: 2 
+ // 14 pins on GPIO0: 2 3 4 5 7 14 15 20 22 23 26 27 30 31
+ // 10 pins on GPIO1: 12 13 14 15 16 17 18 19 28 29
+ //  5 pins on GPIO2: 1 2 3 4 5
+ //  3 pins on GPIO3: 14 15 16
+ //
+ // each pixel is stored in 4 bytes in the order BRGW and sent as a word
+ // from its most significant bit down (the W is only sent to RGBW strips)
+ // and the pixels of all of the channels are interleaved, so the frame
+ // looks like S0P0 S1P0 ... SnP0 S0P1 S1P1 ... SnP1 etc.
  //
- // each pixel is stored in 4 bytes in the order GRBA (4th byte is ignored)
+ // The strips can be of different lengths.  The frame is clocked out in
+ // the runs of slots listed in the command, each of which only holds the
+ // channels up to the last one still sending, and only toggles the pins of
+ // the channels that are.
+ //
+ // Testing each channel's bit takes longer than a bit does past 8
+ // channels, so frames for more are always bit sliced by the ARM and
+ // only the first 8 channels are read from unsliced frames.
  //
  // while len > 0:
+	 // read the slot of channels
 	 // for bit# = 24 down to 0:
-		 // delay 600 ns
-		 // read 1 registers of data, build zero map for gpio0
+		 // build zero maps for gpio0-3
+		 // delay until the bit period
 		 //
-		 // Send start pulse on all pins on gpio0, gpio1 and gpio3
-		 // delay 250 ns
+		 // Send start pulse on all pins on gpio0, gpio1, gpio2 and gpio3
+		 // delay until T0H
 		 // bring zero pins low
-		 // delay 300 ns
-		 // bring all pins low
-	 // increment address by 32
+		 // delay until T1H, bring all pins low
+	 // increment address by 4 * number of channels
+ //
+ // So everything between two bits happens while the pins are low, where
+ // the spec leaves the most room.
 
  //*
  //* So to clock this out:
  //*  ____
  //* |  | |______|
- //* 0  250 600  1250 offset
- //*    250 350   650 delta
+ //* 0 T0H T1H  period
  //* 
  //*/
 
@@ -51,74 +76,248 @@
 //===============================
 // GPIO Pin Mapping
 
-// Pins in GPIO0
-#define gpio0_bit0 2
-
-#define GPIO0_LED_MASK (0\
-|(1<<gpio0_bit0)\
-)
-
-/** Register map */
-#define data_addr r0
-#define data_len r1
+// Channel to GPIO bank and pin.  This table must match the
+// ws281x_pins[] table in pixel.cpp.
+#define ch0_gpio 0
+#define ch0_bit 2
+#define ch1_gpio 0
+#define ch1_bit 3
+#define ch2_gpio 0
+#define ch2_bit 4
+#define ch3_gpio 0
+#define ch3_bit 5
+#define ch4_gpio 0
+#define ch4_bit 7
+#define ch5_gpio 0
+#define ch5_bit 14
+#define ch6_gpio 0
+#define ch6_bit 15
+#define ch7_gpio 0
+#define ch7_bit 20
+#define ch8_gpio 0
+#define ch8_bit 22
+#define ch9_gpio 0
+#define ch9_bit 23
+#define ch10_gpio 0
+#define ch10_bit 26
+#define ch11_gpio 0
+#define ch11_bit 27
+#define ch12_gpio 0
+#define ch12_bit 30
+#define ch13_gpio 0
+#define ch13_bit 31
+#define ch14_gpio 1
+#define ch14_bit 12
+#define ch15_gpio 1
+#define ch15_bit 13
+#define ch16_gpio 1
+#define ch16_bit 14
+#define ch17_gpio 1
+#define ch17_bit 15
+#define ch18_gpio 1
+#define ch18_bit 16
+#define ch19_gpio 1
+#define ch19_bit 17
+#define ch20_gpio 1
+#define ch20_bit 18
+#define ch21_gpio 1
+#define ch21_bit 19
+#define ch22_gpio 1
+#define ch22_bit 28
+#define ch23_gpio 1
+#define ch23_bit 29
+#define ch24_gpio 2
+#define ch24_bit 1
+#define ch25_gpio 2
+#define ch25_bit 2
+#define ch26_gpio 2
+#define ch26_bit 3
+#define ch27_gpio 2
+#define ch27_bit 4
+#define ch28_gpio 2
+#define ch28_bit 5
+#define ch29_gpio 3
+#define ch29_bit 14
+#define ch30_gpio 3
+#define ch30_bit 15
+#define ch31_gpio 3
+#define ch31_bit 16
+
+/** Offsets of the fields in ws281x_command_t */
+#define CMD_NUM_CHANNELS 16
+#define CMD_GPIO_MASK 20
+#define CMD_FLAGS 36
+#define CMD_QUEUE_DEPTH 40
+#define CMD_QUEUE_READ 48
+#define CMD_UNDERRUNS 52
+#define CMD_QUEUE 56
+#define CMD_TIMING 184
+#define CMD_FRAME_ADDR 200
+#define CMD_CYCLES 204
+#define CMD_FRAME_CYCLES 208
+#define CMD_FRAMES_DONE 212
+#define CMD_FRAME_PERIOD 216
+#define CMD_LATCH 220
+#define CMD_RUNS 224
+
+/** Offsets of the fields in ws281x_run_t */
+#define RUN_SIZE 28
+
+/** Offsets of the fields in ws281x_fetch_t, in the shared RAM */
+#define FETCH_FRAME 0
+#define FETCH_REQUEST 12
+#define FETCH_FETCHED 16
+#define FETCH_CONSUMED 20
+#define FETCH_RING_END 24
+#define FETCH_RING 32
+#define SHARED_RAM 0x10000
+
+/** Bits in the flags field */
+#define FLAG_SLICED 0
+#define FLAG_PIPELINED 1
+#define FLAG_FETCH 2
+#define FLAG_32BIT 3
+#define FLAG_FIRST_BIT 29 // private to the PRU, no bit of the frame is out yet
+#define FLAG_LATCHING 30 // private to the PRU, the frame started during a latch
+#define FLAG_QUEUED 31 // private to the PRU, the frame came from the queue
+
+/** Register map.  The timing is kept in registers for the whole frame,
+ * in PRU cycles, and every time in a bit is counted from its start.
+ */
+#define slot_size r0.w0 // b0 is the length of the burst that reads a slot
+#define run_addr r0.w2 // offset of the next run in the PRU DRAM
+#define data_addr r1
 #define gpio0_zeros r2
+#define gpio1_zeros r3
+#define gpio2_zeros r4
+#define gpio3_zeros r5
 #define bit_num r6
-#define sleep_counter r7
-#define addr_reg r8
-#define temp_reg r9
-#define temp2_reg r27
-// r10 - r26 are used for temp storage and bitmap processing
-
-
-/** Sleep a given number of nanoseconds with 10 ns resolution.
- *
- * This busy waits for a given number of cycles.  Not for use
- * with things that must happen on a tight schedule.
+#define now r7
+#define ctrl_addr r8
+#define bit_start r9
+#define bit_t0h r10.w0
+#define bit_t1h r10.w2
+#define bit_period r11.w0
+#define bit_latch r11.w2
+#define data_len r12
+#define flags r13
+#define gpio0_addr r14
+#define gpio1_addr r15
+#define gpio2_addr r16
+#define gpio3_addr r17
+#define run_mask0 r18
+#define run_mask1 r19
+#define run_mask2 r20
+#define run_mask3 r21
+// r22 - r29 hold the pixels of an unsliced slot, and are temporaries
+// between slots
+
+/** Wait for the cycle counter to reach a time since the start of the bit.
+ * The counter only runs up to 2^32, but it is reset for every frame.
  */
-.macro SLEEPNS
-.mparam ns,inst,lab
-#ifdef CONFIG_WS2812
-    MOV sleep_counter, (ns/5)-1-inst // ws2812 -- low speed
-#else
-    MOV sleep_counter, (ns/10)-1-inst // ws2811 -- high speed
-#endif
+.macro WAIT_FOR
+.mparam time,lab
 lab:
-    SUB sleep_counter, sleep_counter, 1
-    QBNE lab, sleep_counter, 0
+	LBBO now, ctrl_addr, 0xC, 4 // read the cycle counter
+	SUB now, now, bit_start
+	QBGT lab, now, time
 .endm
 
-
-/** Wait for the cycle counter to reach a given value */
-.macro WAITNS
-.mparam ns,lab
-    MOV r8, 0x22000 // control register
+/** Wait for the cycle counter to reach the end of the latch, which may
+ * have been stretched to keep to the frame period.
+ */
+.macro WAIT_LATCH
+.mparam lab
+    LBCO r22, CONST_PRUDRAM, CMD_LATCH, 4
 lab:
-	LBBO r9, r8, 0xC, 4 // read the cycle counter
-//	SUB r9, r9, sleep_counter 
-#ifdef CONFIG_WS2812
-	QBGT lab, r9, 2*(ns)/5
+	LBBO now, ctrl_addr, 0xC, 4 // read the cycle counter
+	QBGT lab, now, r22
+.endm
+
+/** Signal the ARM through the PRU0 to ARM system event */
+.macro RAISE_ARM_INTERRUPT
+#ifdef AM33XX
+    MOV R31.b0, PRU0_ARM_INTERRUPT+16
 #else
-	QBGT lab, r9, (ns)/5
+    MOV R31.b0, PRU0_ARM_INTERRUPT
 #endif
 .endm
 
-/** Reset the cycle counter */
+/** Load the frame at queue[r4] */
+.macro LOAD_QUEUED_FRAME
+    LSL r5, r4, 3
+    ADD r5, r5, CMD_QUEUE
+    LBCO data_addr, CONST_PRUDRAM, r5, 4
+    ADD r5, r5, 4
+    LBCO flags, CONST_PRUDRAM, r5, 4
+    SET flags, flags, FLAG_QUEUED
+    LBCO data_len, CONST_PRUDRAM, 4, 4
+.endm
+
+/** Ask PRU1 to copy r24 slots of r23 bytes from data_addr into the ring
+ * in the shared RAM, and read them from there instead.
+ */
+.macro REQUEST_FETCH
+.mparam skip
+    QBBC skip, flags, FLAG_FETCH
+    MOV r22, data_addr
+    SBCO r22, CONST_SHAREDRAM, FETCH_FRAME, 12
+    LSL r25, r23, 4 // WS281X_FETCH_SLOTS
+    MOV r26, SHARED_RAM + FETCH_RING
+    ADD r25, r25, r26
+    SBCO r25, CONST_SHAREDRAM, FETCH_RING_END, 4
+    LBCO r27, CONST_SHAREDRAM, FETCH_REQUEST, 4
+    ADD r27, r27, 1
+    SBCO r27, CONST_SHAREDRAM, FETCH_REQUEST, 4
+    MOV data_addr, r26
+skip:
+.endm
+
+/** Release a queued frame by advancing the read index past it, and
+ * count an underrun if the queue has now run dry.
+ */
+.macro RELEASE_FRAME
+.mparam no_wrap,done
+    QBBC done, flags, FLAG_QUEUED
+    LBCO r2, CONST_PRUDRAM, CMD_QUEUE_DEPTH, 12
+    ADD r4, r4, 1
+    QBNE no_wrap, r4, r2
+    MOV r4, 0
+no_wrap:
+    SBCO r4, CONST_PRUDRAM, CMD_QUEUE_READ, 4
+    QBNE done, r3, r4
+    LBCO r5, CONST_PRUDRAM, CMD_UNDERRUNS, 4
+    ADD r5, r5, 1
+    SBCO r5, CONST_PRUDRAM, CMD_UNDERRUNS, 4
+done:
+.endm
+
+/** Write out that we are done!
+ * Store a non-zero response in the buffer so that they know that we are done.
+ * The response is the number of cycles that the frame took to write out,
+ * which is also kept in frame_cycles along with a count of the frames.
+ */
+.macro FRAME_DONE
+    LBCO r2, CONST_PRUDRAM, CMD_CYCLES, 4
+    LBCO r3, CONST_PRUDRAM, CMD_FRAMES_DONE, 4
+    ADD r3, r3, 1
+    SBCO r2, CONST_PRUDRAM, CMD_FRAME_CYCLES, 8
+    SBCO r2, CONST_PRUDRAM, 12, 4
+    RAISE_ARM_INTERRUPT
+.endm
+
+/** Reset the cycle counter to 0. */
 .macro RESET_COUNTER
 	// Disable the counter and clear it, then re-enable it
-	MOV addr_reg, 0x22000 // control register
-	LBBO r9, addr_reg, 0, 4
-	CLR r9, r9, 3 // disable counter bit
-	SBBO r9, addr_reg, 0, 4 // write it back
+	LBBO r22, ctrl_addr, 0, 4
+	CLR r22, r22, 3 // disable counter bit
+	SBBO r22, ctrl_addr, 0, 4 // write it back
 
-	MOV temp2_reg, 0
-	SBBO temp2_reg, addr_reg, 0xC, 4 // clear the timer
+	MOV now, 0
+	SBBO now, ctrl_addr, 0xC, 4 // clear the timer
 
-	SET r9, r9, 3 // enable counter bit
-	SBBO r9, addr_reg, 0, 4 // write it back
-
-	// Read the current counter value
-	// Should be zero.
-	LBBO sleep_counter, addr_reg, 0xC, 4
+	SET r22, r22, 3 // enable counter bit
+	SBBO r22, ctrl_addr, 0, 4 // write it back
 .endm
 
 START:
@@ -131,9 +330,9 @@ START:
     SBCO	r0, C4, 4, 4
 
     // Configure the programmable pointer register for PRU0 by setting
-    // c28_pointer[15:0] field to 0x0120.  This will make C28 point to
-    // 0x00012000 (PRU shared RAM).
-    MOV		r0, 0x00000120
+    // c28_pointer[15:0] field to 0x0100.  This will make C28 point to
+    // 0x00010000 (PRU shared RAM).
+    MOV		r0, 0x00000100
     MOV		r1, CTPPR_0
     ST32	r0, r1
 
@@ -144,25 +343,45 @@ START:
     MOV		r1, CTPPR_1
     ST32	r0, r1
 
+    // The control registers and the clear registers of the GPIO banks are
+    // used by every bit.  The set register is 4 bytes after the clear one.
+    MOV ctrl_addr, 0x22000
+    MOV gpio0_addr, GPIO0 | GPIO_CLEARDATAOUT
+    MOV gpio1_addr, GPIO1 | GPIO_CLEARDATAOUT
+    MOV gpio2_addr, GPIO2 | GPIO_CLEARDATAOUT
+    MOV gpio3_addr, GPIO3 | GPIO_CLEARDATAOUT
+
     // Write a 0x1 into the response field so that they know we have started
     MOV r2, #0x1
     SBCO r2, CONST_PRUDRAM, 12, 4
 
-
-	MOV r20, 0xFFFFFFFF
-
     // Wait for the start condition from the main program to indicate
     // that we have a rendered frame ready to clock out.  This also
     // handles the exit case if an invalid value is written to the start
     // start position.
 _LOOP:
-    // Load the pointer to the buffer from PRU DRAM into r0 and the
-    // length (in bytes-bit words) into r1.
-    // start command into r2
-    LBCO      data_addr, CONST_PRUDRAM, 0, 12
+    // Frames in the queue are clocked out without waiting for a command.
+    // Load the queue depth into r2, the write index into r3 and the read
+    // index into r4.
+    LBCO r2, CONST_PRUDRAM, CMD_QUEUE_DEPTH, 12
+    QBEQ CHECK_COMMAND, r2, 0
+    QBEQ CHECK_COMMAND, r3, r4
+
+    // Load the frame pointer and flags from queue[read]
+    LOAD_QUEUED_FRAME
+    RESET_COUNTER
+    QBA FRAME_START
+
+CHECK_COMMAND:
+    // Load the pointer to the buffer from PRU DRAM into r22, the length
+    // in pixels into r23 and the start command into r24.
+    LBCO r22, CONST_PRUDRAM, 0, 12
 
     // Wait for a non-zero command
-    QBEQ _LOOP, r2, #0
+    QBEQ _LOOP, r24, #0
+    MOV data_addr, r22
+    MOV data_len, r23
+    MOV r2, r24
 
     // Reset the sleep timer
     RESET_COUNTER
@@ -172,99 +391,262 @@ _LOOP:
     // can now swap the frame buffer pointer and write a new start command.
     MOV r3, 0
     SBCO r3, CONST_PRUDRAM, 8, 4
+    RAISE_ARM_INTERRUPT
 
     // Command of 0xFF is the signal to exit
     QBEQ EXIT, r2, #0xFF
-
-WORD_LOOP:
-	// for bit in 24 to 0
+    LBCO flags, CONST_PRUDRAM, CMD_FLAGS, 4
+
+FRAME_START:
+    // Keep the timing for this frame in registers, so that a change part
+    // way through only applies from the next one.
+    LBCO r22, CONST_PRUDRAM, CMD_TIMING, 16
+    MOV bit_t0h, r22.w0
+    MOV bit_t1h, r23.w0
+    MOV bit_period, r24.w0
+    MOV bit_latch, r25.w0
+    SET flags, flags, FLAG_FIRST_BIT
+
+    // Start from the first run of slots.  The channels of an unsliced
+    // frame are all on GPIO0, so the other banks never have zeros.
+    MOV run_addr, CMD_RUNS
+    MOV gpio1_zeros, 0
+    MOV gpio2_zeros, 0
+    MOV gpio3_zeros, 0
+    SBCO data_addr, CONST_PRUDRAM, CMD_FRAME_ADDR, 4
+
+    // A sliced frame holds the 16 bytes of GPIO masks for each bit
+    // instead, and the address is advanced as each bit is read.  The
+    // slices of every run are the same size, so it is fetched in one go.
+    QBBC RUN_START, flags, FLAG_SLICED
+    MOV slot_size, 0
+    MOV r23, 24 * 16
+    QBBC sliced_fetch, flags, FLAG_32BIT
+    MOV r23, 32 * 16
+sliced_fetch:
+    MOV r24, data_len
+    REQUEST_FETCH sliced_fetched
+
+RUN_START:
+    // Load the next run, until the run of 0 slots that ends them, with
+    // the slots in r22, the channels in r23 and the offset in r24, and
+    // keep the pins that it sends on
+    LBCO r22, CONST_PRUDRAM, run_addr, 12
+    QBEQ FRAME_END, r22, 0
+    MOV data_len, r22
+    ADD run_addr, run_addr, 12
+    LBCO run_mask0, CONST_PRUDRAM, run_addr, 16
+    ADD run_addr, run_addr, RUN_SIZE - 12
+    QBBS SLOT_START, flags, FLAG_SLICED
+
+    // Each pixel slot of the run holds one 4 byte pixel for every channel
+    // up to the last one that is still sending.  Only sliced frames are
+    // fetched by PRU1.
+    LSL slot_size, r23, 2
+    LBCO data_addr, CONST_PRUDRAM, CMD_FRAME_ADDR, 4
+    ADD data_addr, data_addr, r24
+
+SLOT_START:
+	// Wait for PRU1 to have fetched the slot
+	QBBC fetch_ready, flags, FLAG_FETCH
+	fetch_wait:
+		LBCO r22, CONST_SHAREDRAM, FETCH_FETCHED, 8
+		QBEQ fetch_wait, r22, r23
+
+	fetch_ready:
+	// for bit in 24 (or 32 for RGBW pixels) to 0
 	MOV bit_num, 24
+	QBBC slot_bits, flags, FLAG_32BIT
+	MOV bit_num, 32
+
+	slot_bits:
+	// An unsliced slot is read once, with all of its channels on GPIO0
+	QBBS BIT_LOOP, flags, FLAG_SLICED
+	LBBO r22, data_addr, 0, b0
 
 	BIT_LOOP:
+		// Everything from here until the start of the bit happens after
+		// the last bit was brought low, so none of it stretches a bit.
 		SUB bit_num, bit_num, 1
+
+		// The ARM has already built the zero maps for sliced frames
+		QBBC TEST_BITS, flags, FLAG_SLICED
+		LBBO gpio0_zeros, data_addr, 0, 16
+		ADD data_addr, data_addr, 16
+		QBA CLOCK_BIT
+
+	TEST_BITS:
 		/** Macro to generate the mask of which bits are zero.
 		 * For each of these registers, set the
-		 * corresponding bit in the gpio0_zeros register if
-		 * the current bit is set in the strided register.
+		 * corresponding bit in the zeros register of the channel's
+		 * GPIO bank if the current bit is clear in the strided register.
 		 */
-		#define TEST_BIT(regN,gpioN,bitN) \
-			QBBS gpioN##_##regN##_skip, regN, bit_num; \
-			SET gpioN##_zeros, gpioN##_zeros, gpioN##_##bitN ; \
-			gpioN##_##regN##_skip: ; \
+		#define TEST_BIT(regN,chanN) \
+			QBBS ch##chanN##_skip, regN, bit_num ; \
+			SET GPIO_ZEROS(ch##chanN##_gpio), GPIO_ZEROS(ch##chanN##_gpio), ch##chanN##_bit ; \
+			ch##chanN##_skip: ; \
 
-		// Load 1 register of data, starting at r10
-		LBBO r10, r0, 0, 4
-		MOV gpio0_zeros, 0
-
-		TEST_BIT(r10, gpio0, bit0)
-
-		// Load the address(es) of the GPIO devices
-		MOV r20, GPIO0_LED_MASK
-
-		// Clear lines from last bit
-		MOV r22, GPIO0 | GPIO_CLEARDATAOUT
-
-		WAITNS 900, wait_one_time
-		SBBO r20, r22, 0, 4
-
-		MOV r22, GPIO0 | GPIO_SETDATAOUT
-
-		// Wait until the end of the frame (including the time it takes to reset the counter)
-		WAITNS 1150, wait_frame_spacing_time
-		RESET_COUNTER
+		#define GPIO_ZEROS(gpioN) GPIO_ZEROS_(gpioN)
+		#define GPIO_ZEROS_(gpioN) gpio##gpioN##_zeros
 
+		MOV gpio0_zeros, 0
+		TEST_BIT(r22, 0)
+		TEST_BIT(r23, 1)
+		TEST_BIT(r24, 2)
+		TEST_BIT(r25, 3)
+		TEST_BIT(r26, 4)
+		TEST_BIT(r27, 5)
+		TEST_BIT(r28, 6)
+		TEST_BIT(r29, 7)
+
+		// The registers past the end of a short slot hold whatever was
+		// last in them, so drop the zero bits of the other channels.
+		AND gpio0_zeros, gpio0_zeros, run_mask0
+
+	CLOCK_BIT:
+		// The first bit of a frame starts as soon as it is ready, or at the
+		// end of the latch for a frame that was started during the latch
+		// of the previous one.
+		QBBS FIRST_BIT, flags, FLAG_FIRST_BIT
+
+		// Wait until the end of the last bit.  The bits follow each other
+		// a whole period apart, unless a new run or a slow fetch has held
+		// this one up for more than a read of the counter, when its timing
+		// starts from when it really does.
+		WAIT_FOR bit_period, wait_period
+		SUB now, now, 5
+		MAX now, now, bit_period
+		ADD bit_start, bit_start, now
+
+	start_bit:
 		// Send all the start bits
-		SBBO r20, r22, 0, 4
+		SBBO run_mask0, gpio0_addr, 4, 4
+		SBBO run_mask1, gpio1_addr, 4, 4
+		SBBO run_mask2, gpio2_addr, 4, 4
+		SBBO run_mask3, gpio3_addr, 4, 4
 
-		// Reconfigure r10-13 for clearing the bits
-		MOV r22, GPIO0 | GPIO_CLEARDATAOUT
-
-		WAITNS 240, wait_zero_time
+		WAIT_FOR bit_t0h, wait_zero_time
 
 		// turn off all the zero bits
-		SBBO gpio0_zeros, r22, 0, 4
+		SBBO gpio0_zeros, gpio0_addr, 0, 4
+		SBBO gpio1_zeros, gpio1_addr, 0, 4
+		SBBO gpio2_zeros, gpio2_addr, 0, 4
+		SBBO gpio3_zeros, gpio3_addr, 0, 4
+
+		WAIT_FOR bit_t1h, wait_one_time
+
+		// and then the one bits
+		SBBO run_mask0, gpio0_addr, 0, 4
+		SBBO run_mask1, gpio1_addr, 0, 4
+		SBBO run_mask2, gpio2_addr, 0, 4
+		SBBO run_mask3, gpio3_addr, 0, 4
 
-		// One bits get turned off in the next round of the loop
 		QBNE BIT_LOOP, bit_num, 0
 
-	// The RGB streams have been clocked out
+	// The color streams have been clocked out
 	// Move to the next pixel on each row
-	ADD data_addr, data_addr, 4
-	SUB data_len, data_len, 1
-	QBNE WORD_LOOP, data_len, #0
+	ADD data_addr, data_addr, slot_size
 
-	// Final clear for the word
-	MOV r20, GPIO0_LED_MASK
-	MOV r10, GPIO0 | GPIO_CLEARDATAOUT
+	// Hand the slot back to PRU1 and wrap around the ring
+	QBBC slot_done, flags, FLAG_FETCH
+	LBCO r22, CONST_SHAREDRAM, FETCH_CONSUMED, 8
+	ADD r22, r22, 1
+	SBCO r22, CONST_SHAREDRAM, FETCH_CONSUMED, 4
+	QBNE slot_done, data_addr, r23
+	MOV data_addr, SHARED_RAM + FETCH_RING
 
-	WAITNS 1000, end_of_frame_clear_wait
-	SBBO r20, r10, 0, 4
-
-    // Delay at least 50 usec; this is the required reset
+slot_done:
+	SUB data_len, data_len, 1
+	QBNE SLOT_START, data_len, #0
+	QBA RUN_START
+
+FIRST_BIT:
+	// Count the frame from the start of its first bit
+	CLR flags, flags, FLAG_FIRST_BIT
+	QBBC first_bit_now, flags, FLAG_LATCHING
+	CLR flags, flags, FLAG_LATCHING
+	LBCO bit_start, CONST_PRUDRAM, CMD_LATCH, 4
+	first_bit_latch:
+		LBBO now, ctrl_addr, 0xC, 4 // read the cycle counter
+		QBGT first_bit_latch, now, bit_start
+
+first_bit_now:
+	LBBO bit_start, ctrl_addr, 0xC, 4
+	SBCO bit_start, CONST_PRUDRAM, CMD_CYCLES, 4
+	QBA start_bit
+
+FRAME_END:
+	// The lines have all been low since the T1H of the last bit.  Keep
+	// the cycles from the start of the first bit until then.
+	LBBO now, ctrl_addr, 0xC, 4
+	LBCO r22, CONST_PRUDRAM, CMD_CYCLES, 4
+	SUB r22, now, r22
+	SBCO r22, CONST_PRUDRAM, CMD_CYCLES, 4
+
+    // Stretch the latch to whatever is left of the frame period, so that
+    // the next frame starts a whole period after this one did
+    MOV r23, bit_latch
+    LBCO r24, CONST_PRUDRAM, CMD_FRAME_PERIOD, 4
+    QBGE latch_set, r24, r22
+    SUB r24, r24, r22
+    QBGE latch_set, r24, r23
+    MOV r23, r24
+latch_set:
+    SBCO r23, CONST_PRUDRAM, CMD_LATCH, 4
+
+    // Hold the lines low for the latch time; this is the required reset
     // time for the LED strip to update with the new pixels.
-    SLEEPNS 50000, 1, reset_time
-
-    // Write out that we are done!
-    // Store a non-zero response in the buffer so that they know that we are done
-    // aso a quick hack, we write the counter so that we know how
-    // long it took to write out.
-    MOV r8, 0x22000 // control register
-    LBBO r2, r8, 0xC, 4
-    SBCO r2, CONST_PRUDRAM, 12, 4
+    RESET_COUNTER
+    QBBS PIPELINE, flags, FLAG_PIPELINED
+    WAIT_LATCH reset_time
+
+    RELEASE_FRAME queue_no_wrap, queue_released
+    FRAME_DONE
 
     // Go back to waiting for the next frame buffer
     QBA _LOOP
 
+PIPELINE:
+    // Nothing reads this frame again, so hand it back to the ARM now
+    // rather than at the end of the latch.
+    RELEASE_FRAME pipeline_no_wrap, pipeline_released
+    FRAME_DONE
+
+    // Start on the next frame if there already is one.  Its first bit
+    // is fetched while the lines are held low and goes out as soon as
+    // the latch time is up.
+    LBCO r2, CONST_PRUDRAM, CMD_QUEUE_DEPTH, 12
+    QBEQ pipeline_command, r2, 0
+    QBEQ pipeline_command, r3, r4
+    LOAD_QUEUED_FRAME
+    QBA pipeline_start
+
+pipeline_command:
+    // Exit commands are left for _LOOP, after the latch
+    LBCO r22, CONST_PRUDRAM, 0, 12
+    QBEQ pipeline_idle, r24, #0
+    QBEQ pipeline_idle, r24, #0xFF
+    MOV r2, 0
+    SBCO r2, CONST_PRUDRAM, 8, 4
+    RAISE_ARM_INTERRUPT
+    MOV data_addr, r22
+    MOV data_len, r23
+    LBCO flags, CONST_PRUDRAM, CMD_FLAGS, 4
+
+pipeline_start:
+    SET flags, flags, FLAG_LATCHING
+    QBA FRAME_START
+
+pipeline_idle:
+    WAIT_LATCH pipeline_latch_time
+    QBA _LOOP
+
 EXIT:
     // Write a 0xFF into the response field so that they know we're done
     MOV r2, #0xFF
     SBCO r2, CONST_PRUDRAM, 12, 4
 
-#ifdef AM33XX
     // Send notification to Host for program completion
-    MOV R31.b0, PRU0_ARM_INTERRUPT+16
-#else
-    MOV R31.b0, PRU0_ARM_INTERRUPT
-#endif
+    RAISE_ARM_INTERRUPT
 
     HALT
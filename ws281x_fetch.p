@@ -0,0 +1,132 @@
+// \file
+ //* Frame fetcher for ws281x.p, run on PRU1.
+ //*
+ //* Loads from DDR stall the PRU for as long as the L3 interconnect takes,
+ //* which comes straight out of the bit timing when PRU0 does them.  With
+ //* WS281X_FLAG_FETCH set on a frame PRU0 asks this program to copy the
+ //* frame into a ring of pixel slots in the PRU shared RAM instead, and
+ //* only reads from there.
+ //*
+ //* The handoff is the ws281x_fetch_t at the start of the shared RAM.
+ //* PRU0 fills in the frame and increments the request count.  The slots
+ //* are copied in 64 byte bursts and counted in fetched, staying at most
+ //* WS281X_FETCH_SLOTS ahead of the slots that PRU0 has counted in
+ //* consumed.  Each frame starts at the beginning of the ring.
+ //*
+ //* The ARM writes 0xFF to the command in the PRU1 data RAM to exit.
+ //*/
+
+.origin 0
+.entrypoint START
+
+#include "ws281x.hp"
+
+/** Offsets of the fields in ws281x_fetch_command_t */
+#define CMD_COMMAND 0
+#define CMD_RESPONSE 4
+
+/** Offsets of the fields in ws281x_fetch_t, in the shared RAM */
+#define FETCH_FRAME 0
+#define FETCH_REQUEST 12
+#define FETCH_FETCHED 16
+#define FETCH_RING_END 24
+#define FETCH_RING 32
+#define FETCH_SLOTS 16 // WS281X_FETCH_SLOTS
+#define SHARED_RAM 0x10000
+
+/** PRU1's copy of the constant table pointer registers */
+#define PRU1_CTPPR_0 0x24028
+
+/** Register map */
+#define burst_len r0
+#define src_addr r1
+#define dst_addr r2
+#define slot_left r3
+#define slots_left r4
+#define slot_size r5
+#define ring_end r6
+#define last_request r7
+#define fetched r8
+#define consumed r9
+// r10 - r25 hold each burst
+
+START:
+    // Enable OCP master port, so that PRU1 can read the DDR
+    LBCO	r0, C4, 4, 4
+    CLR		r0, r0, 4
+    SBCO	r0, C4, 4, 4
+
+    // Point C28 at 0x00010000 (PRU shared RAM)
+    MOV		r0, 0x00000100
+    MOV		r1, PRU1_CTPPR_0
+    ST32	r0, r1
+
+    // Frames requested before now are not ours to fetch
+    LBCO last_request, CONST_SHAREDRAM, FETCH_REQUEST, 4
+
+    // Write a 0x1 into the response field so that they know we have started
+    MOV r2, #0x1
+    SBCO r2, CONST_PRUDRAM, CMD_RESPONSE, 4
+
+_LOOP:
+    // Command of 0xFF is the signal to exit
+    LBCO r2, CONST_PRUDRAM, CMD_COMMAND, 4
+    QBEQ EXIT, r2, #0xFF
+
+    // Wait for PRU0 to request a frame.  Load the frame address into
+    // src_addr, the slot size into dst_addr and the number of slots into
+    // slot_left and the request count into slots_left.
+    LBCO src_addr, CONST_SHAREDRAM, FETCH_FRAME, 16
+    QBEQ _LOOP, slots_left, last_request
+    MOV last_request, slots_left
+    MOV slot_size, dst_addr
+    MOV slots_left, slot_left
+    LBCO ring_end, CONST_SHAREDRAM, FETCH_RING_END, 4
+    MOV dst_addr, SHARED_RAM + FETCH_RING
+    QBEQ _LOOP, slots_left, 0
+
+SLOT_LOOP:
+    // Wait for room in the ring
+    room_wait:
+        LBCO fetched, CONST_SHAREDRAM, FETCH_FETCHED, 8
+        SUB r10, fetched, consumed
+        QBLE room_wait, r10, FETCH_SLOTS
+
+    // Copy the slot 64 bytes at a time
+    MOV slot_left, slot_size
+    COPY_LOOP:
+        MOV burst_len, slot_left
+        QBGE copy_burst, slot_left, 64
+        MOV burst_len, 64
+    copy_burst:
+        LBBO r10, src_addr, 0, b0
+        SBBO r10, dst_addr, 0, b0
+        ADD src_addr, src_addr, burst_len
+        ADD dst_addr, dst_addr, burst_len
+        SUB slot_left, slot_left, burst_len
+        QBNE COPY_LOOP, slot_left, 0
+
+    // Hand the slot to PRU0 and wrap around the ring
+    ADD fetched, fetched, 1
+    SBCO fetched, CONST_SHAREDRAM, FETCH_FETCHED, 4
+    QBNE slot_fetched, dst_addr, ring_end
+    MOV dst_addr, SHARED_RAM + FETCH_RING
+
+slot_fetched:
+    SUB slots_left, slots_left, 1
+    QBNE SLOT_LOOP, slots_left, 0
+    QBA _LOOP
+
+EXIT:
+    // Write a 0xFF into the response field so that they know we're done
+    MOV r2, #0xFF
+    SBCO r2, CONST_PRUDRAM, CMD_RESPONSE, 4
+
+    // Send notification to Host for program completion
+#ifdef AM33XX
+    MOV R31.b0, PRU1_ARM_INTERRUPT+16
+#else
+    MOV R31.b0, PRU1_ARM_INTERRUPT
+#endif
+
+    HALT
@@ -0,0 +1,192 @@
+/** \file
+ * Emulation of ws281x.p for the software PRU.
+ */
+#include "pixel.hpp"
+#include "ws281x_soft.hpp"
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(const uint64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000ull;
+  ts.tv_nsec = ns % 1000000000ull;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/** Recover the value that channel c sends for a slot of a frame, which
+ * is slot run_slot of a run.
+ */
+static uint32_t frame_value(const ws281x_run_t *const run,
+                            const uint8_t *const data, const bool sliced,
+                            const unsigned bits, const unsigned slot,
+                            const unsigned run_slot, const unsigned c) {
+  if (!sliced) {
+    const uint32_t word = ((const uint32_t *)(data + run->offset))
+        [run_slot * run->num_channels + c];
+    return bits == 32 ? word : word & 0xFFFFFF;
+  }
+
+  const uint32_t(*const zeros)[4] =
+      (const uint32_t(*)[4])(data + slot * BITSLICE_SLOT_SIZE(bits));
+  const ws281x_pin_t pin = ws281x_pins[c];
+  uint32_t value = 0;
+
+  for (unsigned bit = 0; bit < bits; bit++) {
+    value <<= 1;
+    if (!(zeros[bit][pin.gpio] & (1u << pin.pin)))
+      value |= 1;
+  }
+
+  return value;
+}
+
+static void capture_frame(FILE *const capture, const unsigned frame_num,
+                          const uint64_t start_ns,
+                          const ws281x_command_t *const cmd,
+                          const uint8_t *const data, const uint32_t flags) {
+  const bool sliced = flags & WS281X_FLAG_SLICED;
+  const unsigned bits = flags & WS281X_FLAG_32BIT ? 32 : 24;
+  ws281x_capture_t header;
+  memcpy(header.magic, "PBCF", sizeof(header.magic));
+  header.frame = frame_num;
+  header.num_channels = cmd->num_channels;
+  header.num_pixels = cmd->num_pixels;
+  header.time_ns = start_ns;
+  header.bits = bits;
+  fwrite(&header, sizeof(header), 1, capture);
+
+  for (unsigned c = 0; c < cmd->num_channels; c++) {
+    const ws281x_pin_t pin = ws281x_pins[c];
+    unsigned slot = 0;
+
+    for (const ws281x_run_t *run = cmd->runs; run->num_slots; run++) {
+      const bool sending = run->gpio_mask[pin.gpio] & (1u << pin.pin);
+      for (unsigned s = 0; s < run->num_slots; s++, slot++) {
+        const uint32_t value =
+            sending ? frame_value(run, data, sliced, bits, slot, s, c) : 0;
+        const uint8_t wire[4] = {(uint8_t)(value >> 24),
+                                 (uint8_t)(value >> 16), (uint8_t)(value >> 8),
+                                 (uint8_t)value};
+        fwrite(&wire[(32 - bits) / 8], bits / 8, 1, capture);
+      }
+    }
+  }
+
+  fflush(capture);
+}
+
+void ws281x_emulate(pru_t *const pru) {
+  ws281x_command_t *const cmd = (ws281x_command_t *)pru->data_ram;
+  const char *const capture_name = getenv("PIXELBONE_CAPTURE");
+  FILE *capture = NULL;
+  unsigned frame_num = 0;
+
+  if (capture_name) {
+    capture = fopen(capture_name, "wb");
+    if (!capture)
+      die("%s: Unable to open: %s\n", capture_name, strerror(errno));
+  }
+
+  // Tell the ARM that the program has started
+  cmd->response = 1;
+
+  while (1) {
+    ws281x_frame_t frame;
+    bool queued = false;
+
+    if (cmd->queue_depth && cmd->queue_read != cmd->queue_write) {
+      frame = cmd->queue[cmd->queue_read];
+      queued = true;
+    } else if (cmd->command) {
+      const unsigned command = cmd->command;
+      __sync_synchronize();
+      frame.pixels_dma = cmd->pixels_dma;
+      frame.flags = cmd->flags;
+      cmd->command = 0;
+      pru_soft_raise_event(pru);
+
+      if (command == 0xFF)
+        break;
+    } else {
+      // The PRU spins on the command; sleep a little between looks instead
+      sleep_until_ns(now_ns() + 20000);
+      continue;
+    }
+
+    // Each frame takes the bit period and latch time that it started with
+    const ws281x_timing_t timing = cmd->timing;
+    const uint64_t start_ns = now_ns();
+    const unsigned bits = frame.flags & WS281X_FLAG_32BIT ? 32 : 24;
+    const uint64_t frame_ns =
+        ((uint64_t)cmd->num_pixels * bits * timing.period + timing.latch) *
+        WS281X_NS_PER_CYCLE;
+
+    if (capture) {
+      const uint8_t *const data =
+          (const uint8_t *)pru->ddr + (frame.pixels_dma - pru->ddr_addr);
+      capture_frame(capture, frame_num, start_ns, cmd, data, frame.flags);
+    }
+    frame_num++;
+
+    // A pipelined frame is released at the start of the latch and the next
+    // one is picked up after it, which takes the same time as the PRU.
+    // The latch is stretched to the frame period, if there is one.
+    const bool pipelined = frame.flags & WS281X_FLAG_PIPELINED;
+    const uint64_t period_ns =
+        (uint64_t)cmd->frame_period * WS281X_NS_PER_CYCLE;
+    const uint64_t end_ns = start_ns + std::max(frame_ns, period_ns);
+    if (pipelined)
+      sleep_until_ns(start_ns + frame_ns - timing.latch * WS281X_NS_PER_CYCLE);
+    else
+      sleep_until_ns(end_ns);
+
+    // Account for the slots that PRU1 would have fetched
+    if (frame.flags & WS281X_FLAG_FETCH) {
+      ws281x_fetch_t *const fetch = (ws281x_fetch_t *)pru->shared_ram;
+      fetch->request++;
+      fetch->fetched += cmd->num_pixels;
+      fetch->consumed = fetch->fetched;
+    }
+
+    if (queued) {
+      cmd->queue_read = (cmd->queue_read + 1) % cmd->queue_depth;
+      if (cmd->queue_read == cmd->queue_write)
+        cmd->underruns++;
+    }
+
+    // The PRU counts the cycles of the bits but not the latch
+    const uint32_t cycles = (uint64_t)cmd->num_pixels * bits * timing.period;
+    cmd->frame_cycles = cycles;
+    cmd->frames_done++;
+    cmd->response = cycles;
+    pru_soft_raise_event(pru);
+
+    if (pipelined)
+      sleep_until_ns(end_ns);
+  }
+
+  if (capture)
+    fclose(capture);
+
+  cmd->response = 0xFF;
+  pru_soft_raise_event(pru);
+}
+
+void ws281x_fetch_emulate(pru_t *const pru) {
+  ws281x_fetch_command_t *const cmd = (ws281x_fetch_command_t *)pru->data_ram;
+
+  cmd->response = 1;
+  while (cmd->command != 0xFF)
+    sleep_until_ns(now_ns() + 100000);
+
+  cmd->response = 0xFF;
+  pru_soft_raise_event(pru);
+}
@@ -0,0 +1,38 @@
+/** \file
+ * Emulation of ws281x.p for the software PRU.
+ *
+ * The emulator follows the same command and frame queue protocol as the
+ * PRU program and takes as long as the real strips would to clock out
+ * each frame.  If PIXELBONE_CAPTURE names a file, every frame that would
+ * have been sent to the strips is appended to it.
+ */
+#ifndef _ws281x_soft_hpp_
+#define _ws281x_soft_hpp_
+#include "pru.h"
+
+/** Header of each frame in a capture file.
+ *
+ * It is followed by num_pixels pixels for each of the num_channels
+ * channels in turn, bits / 8 bytes each in the order that they go out on
+ * the wire: green, red, blue for the default format.  Strips shorter
+ * than num_pixels are padded out with zeros, which are not sent.
+ */
+struct ws281x_capture_t {
+  char magic[4]; // "PBCF"
+  uint32_t frame;
+  uint32_t num_channels;
+  uint32_t num_pixels;
+  uint64_t time_ns; // CLOCK_MONOTONIC when the frame started
+  uint32_t bits;    // per pixel, 24 or 32
+} __attribute__((__packed__));
+
+extern void ws281x_emulate(pru_t *const pru);
+
+/** Emulation of ws281x_fetch.bin.
+ *
+ * ws281x_emulate() reads frames straight from DDR, so this only follows
+ * the start and exit commands.
+ */
+extern void ws281x_fetch_emulate(pru_t *const pru);
+
+#endif